@@ -13,7 +13,7 @@ public:
     static uint8_t getInterrupt(uint32_t hardwareIntNumber);
     static bool isInterruptEnabled(uint32_t hardwareIntNumber);
     static void setInterruptEnabled(uint32_t hardwareIntNumber, bool enabled);
-    static void mapInterrupt(uint8_t interruptNum, uint8_t resultVector, uint8_t cpuId);
+    static void mapInterrupt(uint8_t interruptNum, uint8_t resultVector, uint8_t cpuId, bool levelTriggered = false, bool activeLow = false);
     static uint8_t getCPUID();
     static void sendEOI();
 
@@ -27,6 +27,11 @@ public:
 
     virtual void printImpl(char c) = 0;
 
+    /**
+     * @brief Makes the printed characters visible, called once at the end of every print and printf.
+     */
+    virtual void flush() {}
+
     void print(char c);
     void print(const char* str);
     void print(uint64_t hex, uint8_t minSize = 1, uint64_t maxSize = sizeof(uint64_t) * 2);
@@ -63,6 +68,7 @@ public:
 
     template<typename V, typename... T>
     void printf(const char* format, V v, T... args) {
+        PrintSection section(*this);
         char specifier;
         char length;
         char flags;
@@ -92,6 +98,28 @@ public:
     static void setDefault(Output* defaultOutput);
     static uint64_t readBuffer(uint8_t* buffer, uint64_t bufferSize);
     static void init();
+
+    /**
+     * @brief Moves the default vga output to a write combining mapping, called once the memory management is set up.
+     */
+    static void initMemoryType();
+
+protected:
+    /**
+     * @brief Flushes when the outermost print or printf returns, so nested calls do not flush for every character.
+     */
+    struct PrintSection {
+        Output& output;
+        inline PrintSection(Output& output) : output(output) { output.printDepth++; }
+        inline ~PrintSection() {
+            if (--output.printDepth == 0) {
+                output.flush();
+            }
+        }
+    };
+
+private:
+    uint32_t printDepth = 0;
 };
 
 class CombinedOutput : public Output {
@@ -105,6 +133,10 @@ public:
         primary->printImpl(c);
         secondary->printImpl(c);
     }
+    inline void flush() override {
+        primary->flush();
+        secondary->flush();
+    }
     inline void clear() {
         primary->clear();
         secondary->clear();
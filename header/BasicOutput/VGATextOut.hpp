@@ -16,8 +16,15 @@ public:
     void setX(uint64_t x) override;
     void setY(uint64_t y) override;
     void scroll();
+    void flush() override;// makes the buffered write combining stores visible
+
+    /**
+     * @brief Moves the text buffer to a write combining mapping (needs a working page table and physical allocator).
+     */
+    void mapWriteCombining();
 
 private:
     uint64_t index = 0;
     volatile char* textBuffer;
+    char shadowBuffer[80 * 25 * 2];// copy of the screen, so the text buffer never has to be read
 };
\ No newline at end of file
@@ -41,10 +41,38 @@ extern "C" uint64_t getFlags();
 extern "C" uint64_t getPriviledgeLevel();
 
 extern "C" void invalidatePage(uint64_t address);
+extern "C" void setCR0(uint64_t value);
+extern "C" void setCR3(uint64_t value);
+extern "C" void setCR4(uint64_t value);
 
 static inline void cpuid(uint64_t code, uint64_t* a, uint64_t* b, uint64_t* c, uint64_t* d) {
     asm volatile("cpuid"
                  : "=a"(*a), "=b"(*b),
                    "=c"(*c), "=d"(*d)
                  : "a"(code));
-}
\ No newline at end of file
+}
+static inline uint64_t readMSR(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr"
+                 : "=a"(low), "=d"(high)
+                 : "c"(msr));
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline void writeMSR(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr"
+                 :
+                 : "c"(msr), "a"((uint32_t) value), "d"((uint32_t) (value >> 32)));
+}
+
+static inline uint64_t readTimestamp() {
+    uint32_t low, high;
+    asm volatile("rdtsc"
+                 : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline void pause() {
+    asm volatile("pause" ::
+                         : "memory");
+}
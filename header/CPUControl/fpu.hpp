@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Enables the vector registers and reports the extensions of the cpu.
+ * @note Kernel code is compiled without vector registers and nothing saves their state yet, instructions that only use
+ * general purpose registers (like crc32) can be enabled per function with the target attribute.
+ */
+class FPU {
+public:
+    /**
+     * @brief Enables SSE and, if supported, XSAVE and AVX on the calling cpu.
+     */
+    static void initCPU();
+
+    static bool hasSSE42();
+};
@@ -65,6 +65,10 @@ public:
         return ((uint64_t*) stackFrame)[3];
     }
 
+    [[nodiscard]] inline bool wereInterruptsEnabled() const {
+        return ((uint64_t*) stackFrame)[2] & (1 << 9);// interrupt flag of the interrupted code
+    }
+
 private:
     uint8_t interruptNumber;
     uint64_t errorCode;
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Per cpu bookkeeping and a simple way to run work on the secondary cpus.
+ * @note Every cpu points its GS base at its own CPU data, the dense cpu index is stored at offset 0.
+ */
+class SMP {
+public:
+    using Work = void (*)(void* context);
+
+    static constexpr uint8_t maxCPUCount = 64;
+    static constexpr uint8_t wakeupVector = 0xE0;
+
+    /**
+     * @brief Sets up the per cpu data of the calling cpu.
+     * @param index the dense index of the cpu (0 is the bootstrap cpu).
+     * @param apicId the local APIC id of the cpu.
+     */
+    static void initCPU(uint8_t index, uint8_t apicId);
+
+    /**
+     * @brief Returns the dense index of the calling cpu.
+     */
+    static inline uint8_t getIndex() {
+        uint8_t index;
+        asm volatile("movb %%gs:0, %0"
+                     : "=r"(index));
+        return index;
+    }
+
+    /**
+     * @brief Installs the handler for the interrupt that wakes idle cpus.
+     * @note Has to be called after the interrupt vector table is set up and before secondary cpus are started.
+     */
+    static void setupWakeupInterrupt();
+
+    static uint8_t getCount();
+    static bool isOnline(uint8_t index);
+    static uint8_t getAPICID(uint8_t index);
+    static void setAPICID(uint8_t index, uint8_t apicId);
+
+    /**
+     * @brief Runs work on an idle cpu.
+     * @param index the dense index of the target cpu.
+     * @return false if the cpu is not online or still busy.
+     */
+    static bool run(uint8_t index, Work work, void* context);
+
+    /**
+     * @brief Ends a hlt of another cpu, used to wake cpus that wait for an interrupt delivered elsewhere.
+     */
+    static void wake(uint8_t index);
+
+    /**
+     * @brief Waits until the work given to a cpu is done.
+     */
+    static void wait(uint8_t index);
+
+    /**
+     * @brief Returns true if the cpu waits for work.
+     */
+    static bool isIdle(uint8_t index);
+
+    /**
+     * @brief Parks the calling cpu and executes work passed with run.
+     */
+    [[noreturn]] static void idle();
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief A simple test-and-test-and-set lock.
+ * @note A zero initialized SpinLock is unlocked, so it can be used as a static without a constructor call.
+ */
+class SpinLock {
+public:
+    inline void lock() {
+        while (__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked, __ATOMIC_RELAXED)) {
+                asm volatile("pause");
+            }
+        }
+    }
+
+    inline bool tryLock() {
+        return !__atomic_test_and_set(&locked, __ATOMIC_ACQUIRE);
+    }
+
+    inline void unlock() {
+        __atomic_clear(&locked, __ATOMIC_RELEASE);
+    }
+
+private:
+    bool locked;
+};
+
+/**
+ * @brief Disables interrupts on the current cpu until the guard is destroyed.
+ * @note Restores the previous interrupt flag, so guards can be nested.
+ */
+class InterruptGuard {
+public:
+    inline InterruptGuard() {
+        asm volatile("pushfq; popq %0; cli"
+                     : "=r"(flags)::"memory");
+    }
+    inline ~InterruptGuard() {
+        if (flags & (1 << 9)) {
+            asm volatile("sti" ::
+                                 : "memory");
+        }
+    }
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+private:
+    uint64_t flags;
+};
+
+/**
+ * @brief Holds a SpinLock with interrupts disabled until the guard is destroyed.
+ */
+class SpinLockGuard {
+public:
+    inline SpinLockGuard(SpinLock& lock) : lock(lock) {
+        this->lock.lock();
+    }
+    inline ~SpinLockGuard() {
+        lock.unlock();
+    }
+    SpinLockGuard(const SpinLockGuard&) = delete;
+    SpinLockGuard& operator=(const SpinLockGuard&) = delete;
+
+private:
+    InterruptGuard interruptGuard;
+    SpinLock& lock;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief CRC32C (Castagnoli polynomial, reflected 0x82F63B78) as used by Ext4 metadata checksums.
+ * @note update does not invert the crc before or after, like the Linux crc32c_le. A plain CRC32C of a buffer is ~update(~0u, data, size).
+ */
+class CRC32C {
+public:
+    enum class Backend {
+        Table,   // one table lookup per byte
+        SliceBy8,// eight table lookups per 8 bytes
+        SSE42,   // crc32 instruction, 8 bytes per instruction
+    };
+
+    /**
+     * @brief Continues crc over data with the fastest backend of the cpu.
+     */
+    static uint32_t update(uint32_t crc, const void* data, uint64_t size);
+
+    /**
+     * @brief Continues crc over data with a specific backend.
+     * @note The backend has to be supported.
+     */
+    static uint32_t update(Backend backend, uint32_t crc, const void* data, uint64_t size);
+
+    static bool isSupported(Backend backend);
+
+    /**
+     * @brief Returns the backend used by update, selected with CPUID.
+     * @note Needs FPU::initCPU.
+     */
+    static Backend getBackend();
+
+private:
+    static uint32_t updateSSE42(uint32_t crc, const uint8_t* data, uint64_t size);
+};
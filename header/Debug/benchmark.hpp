@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief In kernel micro benchmarks, compiled in with -DBENCHMARK (make build-x86_64 CXXFLAGS=-DBENCHMARK).
+ * @note Results are printed in cpu timestamp ticks, run qemu with -smp to include the secondary cpus.
+ */
+class Benchmark {
+public:
+    static void run();
+
+    static void heapStress();
+
+    /**
+     * @brief Compares memcpy and page table walks through the write back direct map and the uncached mmio window.
+     */
+    static void directMap();
+
+    /**
+     * @brief Measures switching between two address spaces that touch their pages, with and without keeping the tlb entries (PCID).
+     */
+    static void contextSwitch();
+
+    /**
+     * @brief Measures the latency of a tlb shootdown to an increasing number of idle cpus.
+     */
+    static void tlbShootdown();
+
+    /**
+     * @brief Measures insert, lookup, merge and split of Mapping regions for a growing number of regions.
+     */
+    static void mappingTree();
+
+    /**
+     * @brief Measures memcpy, memset, memcmp and memmove from 8 bytes to 1 MiB.
+     */
+    static void memoryFunctions();
+
+    /**
+     * @brief Compares the CRC32C backends from 64 bytes to 64 KiB.
+     */
+    static void crc32c();
+};
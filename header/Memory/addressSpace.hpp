@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief A top level page table with a private user half and the kernel half shared with all other address spaces.
+ * @note With PCID every address space has its own tag, so switching keeps the tlb entries of the other address spaces.
+ */
+class AddressSpace {
+public:
+    /**
+     * @brief Prepares the kernel half for sharing and enables global pages and PCID on the bootstrap cpu.
+     * @note Needs the physical allocator, has to be called before secondary cpus are started.
+     */
+    static void init();
+
+    /**
+     * @brief Enables global pages and PCID on the calling cpu.
+     */
+    static void initCPU();
+
+    /**
+     * @brief Switches the calling cpu back to the kernel address space.
+     */
+    static void activateKernel();
+
+    static bool isPCIDEnabled();
+
+    AddressSpace();
+    ~AddressSpace();
+    AddressSpace(const AddressSpace&) = delete;
+    AddressSpace& operator=(const AddressSpace&) = delete;
+
+    /**
+     * @brief Switches the calling cpu to this address space.
+     * @param keepTLB false flushes the tlb entries of this address space like a switch without PCID.
+     */
+    void activate(bool keepTLB = true);
+
+    /**
+     * @brief Forgets the tlb entries of this address space on all cpus, they are flushed when the address space is activated the next time.
+     * @note Needed after mappings of an address space were changed that is not active on the calling cpu.
+     */
+    void invalidate();
+
+    inline uint64_t getLevel4Address() const { return level4Address; }
+
+private:
+    uint64_t level4Address;// physical address of the level 4 page
+    uint16_t pcid;         // 0 if PCID is disabled or no tag was free
+    uint64_t validCPUs;    // cpus that may hold tlb entries of this address space tagged with pcid
+};
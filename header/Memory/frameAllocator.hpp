@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @brief Backend of the PhysicalAllocator that keeps track of free 4Ki frames.
+ * @note Exactly one backend is compiled in: the buddy allocator (default) or the bitmap allocator (-DPHYSICAL_ALLOCATOR_BITMAP).
+ * @note The backend does not lock, the PhysicalAllocator serializes all calls.
+ */
+class FrameAllocator {
+public:
+    /**
+     * @brief Returns the number of bytes of metadata the backend needs to manage frameCount frames.
+     */
+    static uint64_t getMetadataSize(uint64_t frameCount);
+
+    /**
+     * @brief Initializes the backend with all frames marked as unusable.
+     * @param metadata mapped memory of getMetadataSize(frameCount) bytes.
+     */
+    static void init(uint64_t frameCount, uint8_t* metadata);
+
+    /**
+     * @brief Marks usable frames as free (only used while initializing).
+     */
+    static void addFrames(uint64_t frame, uint64_t count);
+
+    /**
+     * @brief Allocates count contiguous frames.
+     * @param alignment the alignment of the first frame in frames (a power of two).
+     * @return the first allocated frame or ~0 if no such run is free.
+     */
+    static uint64_t allocate(uint64_t count, uint64_t alignment);
+
+    /**
+     * @brief Frees count frames starting at frame.
+     * @note Frames that are not managed are ignored. Double frees are not reliably detected (the buddy allocator only sees
+     * the first frame of free blocks), the PhysicalAllocator checks every frame before it calls this.
+     */
+    static void free(uint64_t frame, uint64_t count);
+};
@@ -4,16 +4,37 @@
 
 class PageTable {
 public:
+    /**
+     * @brief First level 4 entry of the kernel half (64Ti and above), the entries below are private to each address space.
+     */
+    static constexpr uint16_t kernelSpaceStartEntry = 128;
+
+    /**
+     * @brief Memory type of a mapping, the value is the index in the page attribute table programmed by initPAT.
+     */
+    enum class MemoryType : uint8_t {
+        WriteBack = 0,
+        WriteThrough = 1,
+        UncachedMinus = 2,// uncached, can be overridden by write combining mtrrs
+        Uncached = 3,
+        WriteCombining = 4,
+    };
+
+    enum class PageSize : uint64_t {
+        Size4Ki = 0x1000,
+        Size2Mi = 0x200000,
+        Size1Gi = 0x40000000,
+    };
+
     struct Option {
         bool writeEnable;
         bool userAvailable;
-        bool writeThrough;
-        bool cacheDisable;
+        MemoryType memoryType;
         bool executeDisable;
     };
 
     /**
-     * @brief Maps a physical page to a given virtual address.
+     * @brief Maps a physical page to a given virtual address in the active address space.
      * @param physicalAddress the physical address of the page to map.
      * @param virtualAddress the virtual address to map the page to.
      * @param options the options to apply to the mapping.
@@ -22,6 +43,34 @@ public:
      */
     static void map(uint64_t physicalAddress, void* virtualAddress, Option option = {});
 
+    /**
+     * @brief Maps a physical page of the given size to a given virtual address.
+     * @param physicalAddress the physical address of the page, aligned to size.
+     * @param virtualAddress the virtual address to map the page to, aligned to size.
+     * @note Paging structures below a replaced entry are freed, a big page that is partly remapped is split.
+     * @note 1Gi pages are mapped as 2Mi pages if the cpu does not support them.
+     */
+    static void map(uint64_t physicalAddress, void* virtualAddress, PageSize size, Option option = {});
+
+    /**
+     * @brief Maps a physically contiguous region using the largest pages that fit the alignment and size.
+     * @param size the size of the region in bytes (rounded up to full pages).
+     * @note Walks the paging structures once per range and flushes the tlb once at the end.
+     */
+    static void mapRange(uint64_t physicalAddress, void* virtualAddress, uint64_t size, Option option = {});
+
+    /**
+     * @brief Unmaps a region, big pages that are only partly inside the region are split.
+     * @param size the size of the region in bytes (rounded up to full pages).
+     * @note The unmapped physical memory is not marked as unused, the tlb is flushed once at the end.
+     */
+    static void unmapRange(uint64_t virtualAddress, uint64_t size);
+
+    /**
+     * @brief Returns the size of the page that maps the given virtual address (Size4Ki if it is not mapped).
+     */
+    static PageSize getPageSize(uint64_t virtualAddress);
+
     /**
      * @brief Returns the physical address that the given virtual address maps to.
      * @param virtualAddress the virtual address to get the physical address of.
@@ -31,9 +80,27 @@ public:
 
     /**
      * @brief unmaps the given virtual address.
-     * @param virtualAddress the virtual address to unmap.
+     * @param virtualAddress the virtual address to unmap (unmaps the whole page if it is part of a big page).
      * @note The unmapped physical memory region is not marked as unused.
      */
     static void unmap(uint64_t virtualAddress);
     static void init();
+
+    /**
+     * @brief Allocates the level 3 pages of the whole kernel half, so address spaces can share them by copying the level 4 entries.
+     * @note Needs the physical allocator.
+     */
+    static void initKernelSpace();
+
+    /**
+     * @brief Frees the paging structures of the user half of a level 4 page (the mapped memory is not freed).
+     * @param level4Address the physical address of the level 4 page.
+     */
+    static void releaseUserSpace(uint64_t level4Address);
+
+    /**
+     * @brief Programs the page attribute table of the calling cpu (every cpu needs the same table).
+     * @note Falls back to uncached for write combining if the cpu has no page attribute table.
+     */
+    static void initPAT();
 };
\ No newline at end of file
@@ -4,6 +4,13 @@
 
 class PhysicalAllocator {
 public:
+    enum class Flags : uint8_t {
+        None = 0,
+        Zeroed = 1,// the memory is filled with zeros, single pages come from a pool that idle cpus fill in the background
+    };
+
+    static constexpr uint64_t zeroPoolSize = 1024;
+
     static void readMultibootInfos(uint8_t* ptr);
 
     static uint64_t getTotalMemorySize();
@@ -11,19 +18,67 @@ public:
     static uint64_t getUsedMemorySize();
 
     /**
-     * @brief Allocates physical memory.
+     * @brief Allocates physically contiguous memory.
      * @param count the number of pages to allocate.
+     * @param alignment the alignment of the returned address in bytes (a power of two).
+     * @param flags Flags::Zeroed to get zero filled memory.
      * @return the physical address of the allocated memory.
-     * @note The allocated memory is not initialized.
+     * @note The allocated memory is not initialized unless Flags::Zeroed is given.
      * @note The allocated memory is marked as used.
+     * @note Runs in O(log n), the pages beyond count of the underlying power of two block stay free.
+     * @note Single pages come from a per cpu list without taking the global lock.
+     */
+    static uint64_t allocatePhysicalMemory(uint64_t count, uint64_t alignment = 0x1000, Flags flags = Flags::None);
+
+    /**
+     * @brief Like allocatePhysicalMemory, but returns 0 instead of stopping if no such memory is free.
      */
-    static uint64_t allocatePhysicalMemory(uint64_t count);
+    static uint64_t tryAllocatePhysicalMemory(uint64_t count, uint64_t alignment = 0x1000, Flags flags = Flags::None);
 
     /**
      * @brief Frees physical memory.
      * @param address the physical address of the memory to free.
      * @param count the number of pages to free.
-     * @note The freed memory is marked as unused.
+     * @note The freed memory is marked as unused and merged with free neighbours.
+     * @note Memory that is not managed by the allocator or not allocated (reserved or already free) is ignored, checked per page.
+     * @note Single pages go to a per cpu list first and reach the global allocator in batches.
      */
     static void freePhysicalMemory(uint64_t address, uint64_t count);
+
+    /**
+     * @brief Adds a reference to an allocated page, so it can be shared (copy on write).
+     * @note A page holds one reference after allocatePhysicalMemory.
+     */
+    static void addReference(uint64_t address);
+
+    /**
+     * @brief Drops a reference to a page, the page is freed with the last reference.
+     */
+    static void releaseReference(uint64_t address);
+
+    /**
+     * @brief Returns the number of references to a page, pages that are not managed by the allocator always have one.
+     */
+    static uint64_t getReferenceCount(uint64_t address);
+
+    /**
+     * @brief Keeps a page alive for a device transfer, it adds a reference that does not count as sharing.
+     * @note Copy on write decisions use getShareCount, so a pinned page is not copied away from under the transfer.
+     */
+    static void pin(uint64_t address);
+    static void unpin(uint64_t address);
+    static bool isPinned(uint64_t address);
+
+    /**
+     * @brief Returns the number of references to a page without the pins, i.e. the mappings and caches that share it.
+     */
+    static uint64_t getShareCount(uint64_t address);
+
+    /**
+     * @brief Zeroes one free page for the zero pool, called by idle cpus.
+     * @return false if the pool is full.
+     */
+    static bool prepareZeroedPage();
+
+    static uint64_t getZeroedPageCount();
 };
\ No newline at end of file
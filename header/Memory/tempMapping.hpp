@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Memory/pageTable.hpp"
 #include <stdint.h>
 
 class TempMemory {
@@ -14,4 +15,22 @@ public:
      * @note The mapped physical memory region is not marked as used.
      */
     static uint8_t* mapPages(uint64_t physicalAddress, uint64_t count, bool user);
+
+    /**
+     * @brief Returns an uncached mapping of physical memory for memory mapped io (APIC, HPET, PCI, ...).
+     * @param physicalAddress the physical address of the registers.
+     * @param count the number of pages to map, all of them have to be below 512Gi.
+     * @return the virtual address of the registers.
+     * @note mapPages maps ram write back cacheable, device registers have to use this mapping.
+     */
+    static uint8_t* mapMMIO(uint64_t physicalAddress, uint64_t count);
+
+    /**
+     * @brief Maps physical memory with the given memory type (for example write combining for framebuffers).
+     * @param physicalAddress the physical address of the memory.
+     * @param count the number of pages to map.
+     * @return the virtual address of the memory.
+     * @note The mapping is only accessible by the kernel and stays mapped, every call maps the memory at a new range of the VirtualAllocator.
+     */
+    static uint8_t* mapWithType(uint64_t physicalAddress, uint64_t count, PageTable::MemoryType memoryType);
 };
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+class AddressSpace;
+
+/**
+ * @brief Keeps the tlbs of all cpus coherent with the page tables (tlb shootdown over inter processor interrupts).
+ * @note Requests are queued per cpu and merged, a cpu only gets a new interrupt if it has no request pending.
+ * @note Every request gets a generation, the sender waits until the generation of every target cpu caught up.
+ */
+class TLB {
+public:
+    static constexpr uint8_t shootdownVector = 0xE1;
+    static constexpr uint64_t maxAddresses = 32;// more addresses are flushed as a whole
+
+    /**
+     * @brief Installs the handler for shootdown interrupts.
+     * @note Has to be called after the interrupt vector table is set up and before secondary cpus are started.
+     */
+    static void setupInterrupt();
+
+    /**
+     * @brief Remembers the address space the calling cpu runs (nullptr for the kernel address space).
+     */
+    static void setActiveAddressSpace(AddressSpace* addressSpace);
+
+    /**
+     * @brief Invalidates changed entries of the active address space on all other cpus that can cache them.
+     * @param addresses the changed virtual addresses (count may be larger than maxAddresses, then everything is flushed).
+     * @param global whether the addresses are in the kernel half (shared by all address spaces).
+     * @note The calling cpu has to flush its own tlb. User addresses only interrupt cpus that currently run the same
+     * address space, other cpus flush the address space lazily the next time they activate it.
+     */
+    static void shootdown(const uint64_t* addresses, uint64_t count, bool global);
+
+    /**
+     * @brief Invalidates addresses on the given cpus and waits until they are done.
+     * @param cpus one bit per dense cpu index, the calling cpu is ignored.
+     */
+    static void flushOn(uint64_t cpus, const uint64_t* addresses, uint64_t count, bool global);
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "Common/Units.hpp"
+#include <stdint.h>
+
+/**
+ * @brief Hands out page aligned ranges of the kernel virtual address space (heap, large buffers, typed mappings).
+ * @note Free ranges are kept in an AVL tree ordered by address that also tracks the largest free range of every subtree,
+ *       so reserve finds the lowest fitting range and release merges with its neighbours in O(log n).
+ * @note Every range is followed by an unmapped guard page, so running over the end of a buffer faults.
+ */
+class VirtualAllocator {
+public:
+    static constexpr uint64_t rangeStart = 80Ti;
+    static constexpr uint64_t rangeEnd = 96Ti;// the direct map starts here
+    static constexpr uint64_t guardPages = 1;
+
+    /**
+     * @brief Reserves count pages of virtual memory, the memory is not mapped.
+     * @param alignment the alignment of the returned address in bytes (a power of two, at least one page).
+     * @return the virtual address or 0 if no range is large enough.
+     */
+    static uint64_t reserve(uint64_t count, uint64_t alignment = 0x1000);
+
+    /**
+     * @brief Returns a range to the allocator.
+     * @param count the count that was passed to reserve.
+     * @note The range has to be unmapped before, so no cpu can access it through a stale tlb entry once it is reused.
+     */
+    static void release(uint64_t address, uint64_t count);
+
+    static uint64_t getReservedSize();// including guard pages
+};
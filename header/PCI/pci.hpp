@@ -137,6 +137,22 @@ public:
 
     BAR getBar(uint8_t index);
 
+    /**
+     * @brief Lets the device access memory (bus master) and its memory BARs.
+     */
+    void enableBusMaster();
+
+    /**
+     * @brief Returns the config space offset of a capability or 0 if the device does not have it.
+     */
+    uint8_t findCapability(uint8_t id);
+
+    /**
+     * @brief Sends the interrupts of the device as message signaled interrupts to one cpu and disables its legacy interrupt line.
+     * @return false if the device does not support MSI.
+     */
+    bool enableMSI(uint8_t vector, uint8_t apicId);
+
     template<typename T>
     inline T readConfig(uint64_t offset) {
         if constexpr (sizeof(T) == sizeof(uint8_t)) {
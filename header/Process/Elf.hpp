@@ -128,7 +128,7 @@ private:
     static_assert(sizeof(FileHeader) == 64, "FileHeader is not 64 bytes");
 
     struct Data {
-        const char* filename;
+        Filesystem::Node file;// resolved once, all reads go through the page cache
         bool valid;
         unique_ptr<SectionHeader::ElfSecHeader> sectionHeaders;
         unique_ptr<ProgramHeader::ElfProgHeader> programHeaders;
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <CPUControl/spinlock.hpp>
 #include <LanguageFeatures/SmartPointer.hpp>
+#include <Memory/addressSpace.hpp>
 #include <Memory/memory.hpp>
+#include <Storage/Filesystem.hpp>
 #include <stdint.h>
 
 class Process;
@@ -13,29 +16,97 @@ public:
         bool executable : 1;
     };
 
+    enum class Source : uint8_t {
+        Physical,// fixed physical memory, mapped when the mapping is loaded
+        Zero,    // zero filled on the first access
+        File,    // taken from the page cache on the first access, zero filled behind fileSize
+    };
+
 private:
+    // the entries do not overlap, so they are kept in an AVL tree ordered by virtAddr
     struct Entry {
         uint64_t virtAddr;
         uint64_t physAddr;
         uint64_t size;
         Flags flags;
-        unique_ptr<Entry> next;
+        Source source;
+        Filesystem::Node file;
+        uint64_t fileOffset;// file offset of virtAddr
+        uint64_t fileSize;  // bytes from virtAddr on that are backed by the file
+        unique_ptr<uint64_t> pages;// physical address of each page of a lazily filled entry, 0 until it is accessed
+        Entry* left;
+        Entry* right;
+        int8_t height;
     };
 
-    unique_ptr<Entry> head;
+    static void initPages(Entry* entry);
+    static Entry* createPart(const Entry* entry, uint64_t start, uint64_t end);
+    static void releasePages(Entry* entry, uint64_t start, uint64_t end);
+    static Entry* balance(Entry* node);
+    static Entry* insert(Entry* node, Entry* entry);
+    static Entry* remove(Entry* node, uint64_t virtAddr, Entry** removed);
+    static Entry* removeMin(Entry* node, Entry** removed);
+    static void destroy(Entry* node);
+
+    Entry* findEntry(uint64_t address);
+    Entry* findFirstEnd(uint64_t address);// first entry that ends after address
+    void add(Entry* entry);
+
+    template<typename Callback>
+    static void forEach(Entry* node, Callback callback);
+
+    Entry* root;
+    uint64_t entryCount;
+    SpinLock lock;// protects the tree and the pages of the entries against concurrent page faults
 
 public:
     Mapping();
+    ~Mapping();
     Mapping(const Mapping&) = delete;
     Mapping(Mapping&&) = delete;
     Mapping& operator=(const Mapping&) = delete;
     Mapping& operator=(Mapping&&) = delete;
 
     void map(uint64_t virtAddr, uint64_t physAddr, uint64_t size, Flags flags);
+
+    /**
+     * @brief Adds memory that is read from a file on the first access.
+     * @param virtAddr page aligned start of the memory.
+     * @param fileOffset the file offset that is mapped to virtAddr.
+     * @param fileSize the number of bytes from virtAddr on that are read from the file, the rest of size is zero filled.
+     * @note Pages that lie completely in the file at a page aligned offset are mapped from the page cache without a copy.
+     */
+    void mapFile(uint64_t virtAddr, uint64_t size, Flags flags, const Filesystem::Node& file, uint64_t fileOffset, uint64_t fileSize);
+
+    /**
+     * @brief Maps the page that contains address into the active address space.
+     * @param write the fault was caused by a write, shared pages of writable entries are copied (also a page cache frame that is filled by this fault).
+     * @return false if the address is not part of the mapping or the access is not allowed.
+     * @note Pages of lazily filled entries are filled on the first access and mapped read only while they are shared.
+     */
+    bool handlePageFault(uint64_t address, bool write);
+
+    /**
+     * @brief Copies all entries into target, the filled pages are shared copy on write.
+     * @note The mapping has to be loaded into the active address space and no other thread may use it,
+     *       its writable shared pages are unmapped so the next write fault copies them.
+     */
+    void clone(Mapping& target);
+
+    /**
+     * @brief Returns whether address belongs to an entry, in O(log n).
+     */
+    bool isMapped(uint64_t address);
+
+    /**
+     * @brief Removes [virtAddr, virtAddr + size) from all entries it overlaps, entries are split where needed.
+     * @note The pages of lazily filled entries in the range are released, so the range has to be unmapped from the address space first if the mapping is loaded.
+     */
     void unmap(uint64_t virtAddr, uint64_t size);
-    void load();
-    void unload();
-    void compact();
+    uint64_t getEntryCount() { return entryCount; }
+    void load();  // maps all physical entries into the active address space, the others are mapped on page faults
+    void unload();// unmaps all entries from the active address space and releases the pages of lazily filled entries
+    void compact();// merges neighbouring physical entries with contiguous memory and the same flags
 };
 
 class Thread {
@@ -57,6 +128,8 @@ public:
 class Process : public enable_shared_from_this<Process> {
 private:
     Mapping processMemory;// includes program code, global data, heap, etc.
+    AddressSpace addressSpace;
+    bool loaded;// processMemory is mapped into addressSpace
 public:
     Process();
     Process(const Process&) = delete;
@@ -66,5 +139,22 @@ public:
 
     unique_ptr<Thread> spawnThread(uint64_t entryPoint);
 
+    /**
+     * @brief Creates a copy of the process that shares the memory copy on write.
+     * @note The process has to be the active one.
+     */
+    unique_ptr<Process> fork();
+
+    /**
+     * @brief Switches the calling cpu to the address space of the process, the process memory is mapped on the first call.
+     */
+    void activate();
+
+    /**
+     * @brief Returns the process the calling cpu runs or nullptr.
+     */
+    static Process* getCurrent();
+
     Mapping& getProcessMemory() { return processMemory; }
+    AddressSpace& getAddressSpace() { return addressSpace; }
 };
\ No newline at end of file
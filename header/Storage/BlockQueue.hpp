@@ -0,0 +1,76 @@
+#pragma once
+
+#include "CPUControl/spinlock.hpp"
+#include "Storage/BlockRequest.hpp"
+#include "stdint.h"
+
+class Storage;
+
+/**
+ * @brief Holds the requests of a storage until it has room for them, merges adjacent requests and sorts them by sector.
+ * @note Commands start in ascending sector order (C-SCAN), a request that was passed over too often starts first.
+ * Overlapping reads and writes are not ordered against each other, callers must not have them queued at the same time.
+ */
+class BlockQueue {
+public:
+    struct Statistics {
+        uint64_t submitted;
+        uint64_t dispatched; // commands sent to the storage
+        uint64_t backMerges; // requests appended to a command
+        uint64_t frontMerges;// requests prepended to a command
+        uint64_t sharedReads;// reads served from the buffers of a queued read that contains them
+        uint64_t expired;    // commands started out of sector order because a request waited too long
+        uint64_t requeued;   // merged requests that did not fit in a short transfer
+        uint64_t queued;     // requests waiting now
+        uint64_t inFlight;   // commands the storage works on now
+        uint64_t maxQueued;
+        uint64_t maxInFlight;
+    };
+
+    static constexpr uint64_t maxCommands = 32;
+    static constexpr uint64_t maxSegments = 32;      // per merged command
+    static constexpr uint64_t maxMergeSectors = 8192;// per merged command
+    static constexpr uint64_t readExpire = 16;       // commands that may start before a waiting read
+    static constexpr uint64_t writeExpire = 64;      // commands that may start before a waiting write
+
+    BlockQueue(Storage& storage);
+    ~BlockQueue();
+
+    /**
+     * @brief Pins the buffers of a request and queues it for the storage, it completes like a request submitted to the storage directly.
+     * @return false if the request is invalid, it is never done then.
+     */
+    bool submit(BlockRequest& request);
+
+    /**
+     * @brief Removes a request that was not sent to the storage yet.
+     * @return true if the request was removed, it is never done then.
+     */
+    bool cancel(BlockRequest& request);
+
+    Statistics getStatistics();
+
+private:
+    struct Command {
+        BlockRequest request;// sent to the storage
+        BlockSegment segments[maxSegments];
+        BlockRequest* members;// merged requests in sector order, linked with next
+        BlockQueue* queue;
+        bool used;
+    };
+
+    Storage& storage;
+    Command* commands;
+    SpinLock lock;        // protects everything below
+    BlockRequest* sorted; // waiting requests by start sector, linked with next
+    uint64_t position;    // sector after the last started command
+    uint64_t sequence;    // started commands, requests remember it to expire
+    Statistics statistics;
+
+    void dispatch();
+    Command* buildCommand();                  // needs lock
+    BlockRequest* takeNext();                 // needs lock
+    void insertSorted(BlockRequest& request); // needs lock
+    void finish(Command& command);
+    static void onCommandDone(BlockRequest& request);
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "stdint.h"
+
+struct BlockRequest;
+using BlockCallback = void (*)(BlockRequest& request);
+
+/**
+ * @brief A contiguous piece of the memory of a request.
+ */
+struct BlockSegment {
+    uint8_t* buffer;// 2 byte aligned, mapped in the kernel half or the active address space
+    uint64_t size;  // even
+    uint64_t* frames;// physical address of every page of a user buffer, set while the request is pinned
+
+    /**
+     * @brief Returns the physical address of a byte of the buffer, usable in every address space once the request is pinned.
+     */
+    uint64_t getPhysicalAddress(uint64_t offset);
+
+    /**
+     * @brief Returns a kernel address of a byte of the buffer, it is only valid up to the end of its page.
+     */
+    uint8_t* getKernelAddress(uint64_t offset);
+};
+
+/**
+ * @brief A transfer that is submitted to a Storage or Partition and completes asynchronously.
+ * @note It has to stay alive until it is done. Fields not set by the caller have to be zero.
+ */
+struct BlockRequest {
+    static constexpr uint64_t sectorSize = 512;// unit of sectorIndex and sectorCount
+
+    uint64_t sectorIndex;
+    uint64_t sectorCount;
+    BlockSegment* segments;// scatter-gather list, the sizes add up to sectorCount * sectorSize
+    uint64_t segmentCount;
+    bool write;
+    BlockCallback callback;// runs with interrupts disabled, nullptr if the request is waited for with wait
+    void* context;
+
+    // set by the partition and the storage
+    uint64_t baseSector; // added to sectorIndex by the storage, set by a partition
+    int64_t result;      // transferred bytes or -1, set before the request is done
+    volatile bool done;  // only set for requests without callback
+    uint8_t waitingCPU;  // woken when the request is done
+    BlockRequest* next;  // used by the queues of the block layer and the storage
+    BlockRequest* shared;// reads the block queue serves from the buffers of this request
+    uint64_t queuedAt;   // commands the block queue started before this request was queued
+
+    inline uint64_t getStartSector() {
+        return baseSector + sectorIndex;
+    }
+
+    inline uint64_t getSize() {
+        return sectorCount * sectorSize;
+    }
+
+    inline bool isDone() {
+        return __atomic_load_n(&done, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * @brief Faults in the user pages of the segments and pins them until unpin.
+     * @note Called in the address space of the caller, afterwards the buffers can be reached from every address space.
+     * @return false if a page is not part of the process memory, nothing is pinned then.
+     */
+    bool pin();
+    void unpin();
+
+    /**
+     * @brief Called by the storage when the transfer finished, runs the callback or marks the request as done.
+     * @note The request may be freed by the callback, it must not be used afterwards.
+     */
+    void complete();
+};
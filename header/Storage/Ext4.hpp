@@ -320,6 +320,8 @@ public:
 public:
     Ext4(shared_ptr<Partition> partition);
 
+    int64_t implGetINode(const char* filepath) override;
+    int64_t implReadINode(uint64_t inode, uint64_t offset, uint64_t size, uint8_t* buffer) override;
     int64_t implRead(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) override;
     int64_t implWrite(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) override;
     int64_t implGetSize(const char* filepath) override;
@@ -343,12 +345,20 @@ private:
     unique_ptr<Superblock> superblock;
     bool valid;
     uint64_t blockSize;
+    uint64_t descriptorSize;
+    bool metadataChecksums;// RO_COMPAT_METADATA_CSUM, every metadata block is verified with CRC32C
+    uint32_t checksumSeed; // crc32c of the uuid or the stored seed, starts every metadata checksum
 
     using TravelCallback = bool (*)(void* context, uint64_t offsetInFile, uint64_t offsetInPartition, uint64_t lengthInByte, Ext4* instance);// Return true to stop traversal.
-    void getINode(int64_t inodeNumber, INode* out);
-    void getGroupDescriptor(int64_t inodeNumber, GroupDesc* out);
+    bool getINode(int64_t inodeNumber, INode* out);// false if the inode could not be read or its checksum is wrong
+    bool getGroupDescriptor(int64_t inodeNumber, GroupDesc* out);
     void travelFile(int64_t inodeNumber, TravelCallback callback, void* context);
-    bool travelExtentTree(uint8_t* buffer, TravelCallback callback, void* context);
+    bool travelExtentTree(uint8_t* buffer, uint32_t inodeSeed, TravelCallback callback, void* context);
+    uint32_t getINodeSeed(uint64_t inodeNumber, uint32_t generation);
+    bool verifySuperblock();
+    bool verifyGroupDescriptor(uint32_t group, uint8_t* descriptor);
+    bool verifyINode(uint8_t* raw, uint32_t inodeSeed);
+    bool verifyExtentBlock(uint8_t* block, uint32_t inodeSeed);
     int64_t getINodeNumber(const char* filepath, int64_t inode = 2);
 
     friend bool lookForFile(void* context, uint64_t inFile, uint64_t inPartition, uint64_t size, Ext4* instance);
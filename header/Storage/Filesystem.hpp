@@ -13,8 +13,28 @@ public:
         Error
     };
 
+    /**
+     * @brief Identifies a file independent of its path, so repeated accesses skip the path lookup.
+     */
+    struct Node {
+        Filesystem* filesystem;
+        int64_t inode;
+    };
+
     static void simplifyPath(const char* path, char* buffer, uint64_t bufferSize);
 
+    /**
+     * @brief Resolves a path once.
+     * @return false if the file does not exist.
+     */
+    static bool lookup(const char* filepath, Node& node);
+
+    /**
+     * @brief Reads a file through the page cache.
+     * @return the number of bytes read (less at the end of the file) or -1.
+     */
+    static int64_t read(const Node& node, uint64_t offset, uint64_t size, uint8_t* buffer);
+
     static int64_t read(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer);
     static int64_t write(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer);
     static int64_t getSize(const char* filepath);
@@ -48,6 +68,8 @@ public:
 
     inline Filesystem(shared_ptr<Partition> partition) : partition(partition), handlingPrefix(nullptr), prefixLength(0) {}
 
+    virtual int64_t implGetINode(const char* filepath) = 0;                                            // -1 if the file does not exist
+    virtual int64_t implReadINode(uint64_t inode, uint64_t offset, uint64_t size, uint8_t* buffer) = 0;// reads no more than the file size
     virtual int64_t implRead(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) = 0;
     virtual int64_t implWrite(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) = 0;
     virtual int64_t implGetSize(const char* filepath) = 0;
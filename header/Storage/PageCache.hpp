@@ -0,0 +1,29 @@
+#pragma once
+
+#include "stdint.h"
+
+class Filesystem;
+
+/**
+ * @brief Caches file contents page wise, keyed by filesystem, inode and page index.
+ * @note Cached pages are reference counted frames of the PhysicalAllocator, so they can be mapped into processes without a copy.
+ */
+class PageCache {
+public:
+    static constexpr uint64_t maxCachedPages = 8192;// older pages are dropped beyond this
+
+    /**
+     * @brief Returns a page of a file, it is read from the filesystem if it is not cached.
+     * @param validBytes receives the number of bytes of the page that belong to the file, the rest is zero.
+     * @return the physical address of the page with a reference for the caller (PhysicalAllocator::releaseReference) or 0 on errors.
+     */
+    static uint64_t getPage(Filesystem* filesystem, uint64_t inode, uint64_t pageIndex, uint64_t* validBytes);
+
+    /**
+     * @brief Drops all cached pages of a file, pages that are still referenced stay with their users.
+     * @note Pages that were being read while this ran are not cached, so calling it after a write leaves no stale pages.
+     */
+    static void invalidate(Filesystem* filesystem, uint64_t inode);
+
+    static uint64_t getCachedPageCount();
+};
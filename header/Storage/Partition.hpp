@@ -1,6 +1,7 @@
 #pragma once
 #include "BasicOutput/Output.hpp"
 #include "Memory/memory.hpp"
+#include "Storage/BlockRequest.hpp"
 
 class Storage;
 class PartitionTable;// provides its partitions (is created with a Storage)
@@ -42,6 +43,14 @@ public:
     virtual int64_t read(uint64_t offset, uint64_t size, uint8_t* buffer) = 0;
     virtual int64_t write(uint64_t offset, uint64_t size, uint8_t* buffer) = 0;
 
+    /**
+     * @brief Asynchronous access like Storage::submit, the sector index is relative to the partition.
+     */
+    virtual bool submit(BlockRequest& request) = 0;
+    virtual void poll() = 0;
+    virtual void wait(BlockRequest& request) = 0;
+    virtual bool cancel(BlockRequest& request) = 0;
+
     virtual shared_ptr<Filesystem> createFilesystem(shared_ptr<Partition> self) = 0;
 
     virtual ~Partition(){};
@@ -66,6 +75,11 @@ public:
 
     int64_t write(uint64_t offset, uint64_t size, uint8_t* buffer) override;
 
+    bool submit(BlockRequest& request) override;
+    void poll() override;
+    void wait(BlockRequest& request) override;
+    bool cancel(BlockRequest& request) override;
+
     inline OffsetImplementationPartition(shared_ptr<PartitionTable> partitionTable, uint64_t offset, uint64_t size)
         : Partition(partitionTable), offset(offset), size(size) {}
 
@@ -1,4 +1,6 @@
 #pragma once
+#include "CPUControl/interrupts.hpp"
+#include "CPUControl/spinlock.hpp"
 #include "Memory/memory.hpp"
 #include "PCI/pci.hpp"
 #include "Storage/Storage.hpp"
@@ -20,6 +22,12 @@ public:
         uint32_t capabilities2;
         uint32_t version;
         PCI::BAR abar;
+        SATA* ports[32];// initialized devices, they are never destroyed
+        volatile uint64_t interruptCount;
+        bool useInterrupts;// false until an interrupt was seen, the ports poll until then
+
+        void setupInterrupt();
+        static void onInterrupt(Interrupt& interrupt);
 
         friend class SATA;
     };
@@ -35,7 +43,39 @@ public:
 
     static PCI::Handler* getPCIHandler();
 
+    /**
+     * @brief Requests up to this size poll the port for completion instead of waiting for the interrupt with hlt.
+     * @note Polling has the lower latency but keeps the cpu busy, 0 always waits for the interrupt.
+     */
+    void setPollingSize(uint64_t size);
+
+    /**
+     * @brief Queues a request, it is started as soon as a command slot is free.
+     * @note Callbacks run in the interrupt handler or in poll. Long requests transfer less than requested when the PRDT is full,
+     * read and write submit the rest again.
+     */
+    bool submit(BlockRequest& request) override;
+
+    /**
+     * @brief Collects finished commands and completes their requests.
+     * @note Called by the interrupt, only needed if the controller has no working interrupt.
+     */
+    void poll() override;
+
+    /**
+     * @brief Waits with hlt for requests larger than the polling size if the interrupt works, otherwise polls.
+     */
+    void wait(BlockRequest& request) override;
+
+    bool cancel(BlockRequest& request) override;
+
+    inline bool hasNCQ() { return useNCQ; }
+    inline uint32_t getQueueDepth() override { return queueDepth; }
+
     constexpr static uint64_t sectorSize = 512;
+    constexpr static uint64_t defaultPollingSize = 4096;
+    constexpr static uint8_t interruptVector = 0xD0;// shared by all controllers
+    constexpr static uint64_t scratchSize = 512;     // identify data and error log pages
 
 private:
     bool tryToInit(uint8_t port);
@@ -48,7 +88,7 @@ private:
     PCI::BAR dbar;
     uint8_t* commandSlotPtr;
     uint8_t* receivedFISPtr;
-    uint8_t* commandTablePtr;
+    uint8_t* scratchPtr;// buffer of the commands the driver runs itself
 
     enum class Type : uint8_t {
         SATA,
@@ -62,9 +102,21 @@ private:
 
     uint64_t sectorCount;
     bool hasLBA48;
-
-    uint64_t findSlot();
-    bool waitForFinish();
-    bool waitForTask(uint64_t slotID);
-    void writeH2DCommand(uint32_t slotID, uint8_t command, uint64_t sectorIndex, uint64_t sectorCount);
+    uint64_t pollingSize;
+    bool useNCQ;       // commands are READ/WRITE FPDMA QUEUED, otherwise only one command runs at a time
+    uint8_t queueDepth;// slots used for requests
+
+    SpinLock lock;             // protects the queue, the slot masks and the command issue register
+    BlockRequest* queueHead;   // requests that wait for a slot
+    BlockRequest* queueTail;   //
+    uint32_t usedSlots;        // slots with a started request
+    BlockRequest* slotRequests[32];//
+
+    void startQueued();                      // needs lock
+    void startRequest(uint32_t slotID, BlockRequest& request);// needs lock
+    BlockRequest* collectCompletions();      // needs lock, returns the finished requests
+    uint32_t recover(uint32_t outstanding);  // needs lock, returns the slots whose command failed, the others were aborted
+    bool resetPort();                        // COMRESET, the device forgets all commands
+    bool runCommand(uint8_t command, uint64_t sectorIndex, uint64_t sectorCount);// in slot 0 into the scratch buffer, only while no request runs
+    void writeH2DCommand(uint32_t slotID, uint8_t command, uint64_t sectorIndex, uint64_t sectorCount, bool write);
 };
\ No newline at end of file
@@ -1,16 +1,55 @@
 #pragma once
 
 #include "Memory/memory.hpp"
+#include "Storage/BlockQueue.hpp"
+#include "Storage/BlockRequest.hpp"
 #include "Storage/Partition.hpp"
 #include "stdint.h"
 
 class Storage {
 public:
+    inline Storage() : queue(*this) {}
+
     virtual uint64_t getSize() = 0;
     virtual int64_t read(uint64_t offset, uint64_t size, uint8_t* buffer) = 0;
     virtual int64_t write(uint64_t offset, uint64_t size, uint8_t* buffer) = 0;
     virtual const char* getTypeName() = 0;
 
+    /**
+     * @brief Starts an asynchronous transfer, the default implementation transfers synchronously with read and write.
+     * @note The request can be done before submit returns.
+     * @return false if the request is invalid, it is never done then.
+     */
+    virtual bool submit(BlockRequest& request);
+
+    /**
+     * @brief Collects finished transfers, only needed by storages that can not complete requests from an interrupt.
+     */
+    virtual void poll() {}
+
+    /**
+     * @brief Blocks until a request without callback is done.
+     */
+    virtual void wait(BlockRequest& request);
+
+    /**
+     * @brief Removes a request that was not started yet.
+     * @return true if the request was removed, it is never done then.
+     */
+    virtual bool cancel(BlockRequest&) { return false; }
+
+    /**
+     * @brief Commands the storage can work on at the same time, the block queue keeps up to this many in flight.
+     */
+    virtual uint32_t getQueueDepth() { return 1; }
+
+    /**
+     * @brief The block queue in front of submit, partitions and the blocking read and write of a storage go through it.
+     */
+    inline BlockQueue& getQueue() {
+        return queue;
+    }
+
     virtual ~Storage() = default;
 
     inline const shared_ptr<Storage>& getNext() {
@@ -28,7 +67,15 @@ public:
     static void addStorage(const shared_ptr<Storage>&);
     static const shared_ptr<Storage>& getFirst();
 
+protected:
+    /**
+     * @brief Blocking read and write on top of the block queue and wait.
+     * @return size or -1, short transfers of the storage are continued until everything is transferred.
+     */
+    int64_t transfer(uint64_t offset, uint64_t size, uint8_t* buffer, bool write);
+
 private:
     shared_ptr<Storage> next;
     shared_ptr<PartitionTable> partition;
+    BlockQueue queue;
 };
@@ -1,12 +1,18 @@
 #include "ACPI/APIC.hpp"
 #include "BasicOutput/Output.hpp"
 #include "CPUControl/cpu.hpp"
+#include "CPUControl/fpu.hpp"
 #include "CPUControl/interrupts.hpp"
+#include "CPUControl/smp.hpp"
 #include "CPUControl/time.hpp"
 #include "Common/Symbols.hpp"
 #include "LanguageFeatures/memory.hpp"
+#include "Memory/addressSpace.hpp"
+#include "Memory/heap.hpp"
 #include "Memory/memory.hpp"
+#include "Memory/pageTable.hpp"
 #include "Memory/tempMapping.hpp"
+#include "Memory/tlb.hpp"
 
 union RedirectionEntry {
     struct {
@@ -58,7 +64,7 @@ bool APICTableParser::parse(ACPI::TableHeader* table) {
     if (memcmp(table->Signature, "APIC", 4) == 0) {
         processorCount = 0;
         MADT* madt = (MADT*) table;
-        localAPICAddress = (uint64_t) TempMemory::mapPages(madt->localAPICAddress, 1, false);
+        localAPICAddress = (uint64_t) TempMemory::mapMMIO(madt->localAPICAddress, 1);
         EntryBase* entry = (EntryBase*) (madt + 1);
         uint64_t remainingSize = madt->header.Length - sizeof(MADT);
         while (remainingSize > 0) {
@@ -132,7 +138,7 @@ static uint32_t getBaseInterrupt(uint32_t interruptNumber) {
             IOAPIC* ioapic = (IOAPIC*) entry;
             uint32_t globalSystemInterruptBase = ioapic->globalSystemInterruptBase;
             if (globalSystemInterruptBase <= interruptNumber && globalSystemInterruptBase + 24 > interruptNumber) {
-                uint8_t* address = TempMemory::mapPages(ioapic->address, 1, false);
+                uint8_t* address = TempMemory::mapMMIO(ioapic->address, 1);
                 uint8_t redirectionCount = (readIOApic(address, 0x01) >> 16) & 0xFF;
                 if (globalSystemInterruptBase + redirectionCount > interruptNumber) {
                     return globalSystemInterruptBase;
@@ -160,7 +166,7 @@ static uint8_t* getIOAPICAddress(uint32_t interruptNumber) {
             IOAPIC* ioapic = (IOAPIC*) entry;
             uint32_t globalSystemInterruptBase = ioapic->globalSystemInterruptBase;
             if (globalSystemInterruptBase <= interruptNumber && globalSystemInterruptBase + 24 > interruptNumber) {
-                uint8_t* address = TempMemory::mapPages(ioapic->address, 1, false);
+                uint8_t* address = TempMemory::mapMMIO(ioapic->address, 1);
                 uint8_t redirectionCount = (readIOApic(address, 0x01) >> 16) & 0xFF;
                 if (globalSystemInterruptBase + redirectionCount > interruptNumber) {
                     return address;
@@ -190,7 +196,7 @@ void APIC::setSpuriousInterruptVector(uint8_t vector) {
             } __attribute__((packed));
             IOAPIC* ioapic = (IOAPIC*) entry;
             uint32_t globalSystemInterruptBase = ioapic->globalSystemInterruptBase;
-            uint8_t* address = TempMemory::mapPages(ioapic->address, 1, false);
+            uint8_t* address = TempMemory::mapMMIO(ioapic->address, 1);
             uint8_t redirectionCount = (readIOApic(address, 0x01) >> 16) & 0xFF;
             for (uint8_t i = 0; i < redirectionCount; i++) {
                 RedirectionEntry entry;
@@ -231,7 +237,7 @@ void APIC::setInterruptEnabled(uint32_t interruptNumber, bool enabled) {
     writeIOApic(address, 0x10 + interruptNumber * 2, entry.lowerDword);
     writeIOApic(address, 0x10 + interruptNumber * 2 + 1, entry.upperDword);
 }
-void APIC::mapInterrupt(uint8_t interruptNumber, uint8_t resultVector, uint8_t cpuId) {
+void APIC::mapInterrupt(uint8_t interruptNumber, uint8_t resultVector, uint8_t cpuId, bool levelTriggered, bool activeLow) {
     uint8_t* address = getIOAPICAddress(interruptNumber);
     if (address == nullptr) {
         return;
@@ -245,8 +251,8 @@ void APIC::mapInterrupt(uint8_t interruptNumber, uint8_t resultVector, uint8_t c
     entry.delvMode = 0;
     entry.destMode = 0;
     entry.delvStatus = 0;
-    entry.pinPolarity = 0;
-    entry.triggerMode = 0;
+    entry.pinPolarity = activeLow ? 1 : 0;
+    entry.triggerMode = levelTriggered ? 1 : 0;
     entry.mask = 0;
     entry.destination = cpuId;
 
@@ -317,6 +323,9 @@ void APIC::sendInterrupt(uint8_t vector, uint8_t destinationMode, uint8_t target
 
 static volatile bool secondaryCpuInInit;// this should be a mutex or stuff
 static uint8_t secondaryCpuId;
+static uint8_t secondaryCpuIndex;
+
+constexpr uint64_t secondaryStackSize = 4096 * 4;
 
 static void initCPU(uint8_t cpuid, uint64_t entry) {
     using namespace time;
@@ -331,15 +340,36 @@ static void initCPU(uint8_t cpuid, uint64_t entry) {
     APIC::sendInterrupt(entry / pageSize, 6, cpuid, 0, false);
     sleep(100ms);
     while (secondaryCpuInInit) {}
+    secondaryCpuIndex++;
+}
+
+static void secondaryCpuStart() {
+    //running on the own stack, the trampoline stack can be used by the next cpu
+    secondaryCpuInInit = false;
+    SMP::idle();
 }
 
 extern "C" void secondaryCpuMain() {
-    //TODO allocate stack
-    //TODO change stack
-    //TODO add stuff that returns cpu specific memory
     uint8_t cpuid = secondaryCpuId;
+    SMP::initCPU(secondaryCpuIndex, cpuid);
+    PageTable::initPAT();
+    AddressSpace::initCPU();
+    FPU::initCPU();
+    APIC::set(0x0F0, APIC::get(0x0F0) | 0x100 | 0xFF);// enable local apic with the spurious vector of the bsp
+    uint64_t stack = (uint64_t) kmalloc(secondaryStackSize);
+    if (stack == 0) {
+        Output::getDefault()->printf("CPU %hhu has no stack\n", cpuid);
+        secondaryCpuInInit = false;
+        stop();
+    }
+    stack += secondaryStackSize - 0x10;
     Output::getDefault()->printf("CPU %hhu started\n", cpuid);
-    secondaryCpuInInit = false;
+    asm volatile("movq %0, %%rsp\n\t"
+                 "xorq %%rbp, %%rbp\n\t"
+                 "callq *%1\n\t"
+                 :
+                 : "r"(stack), "r"(&secondaryCpuStart)
+                 : "memory");
     stop();
 }
 
@@ -347,10 +377,14 @@ void APIC::initAllCPUs() {
     using namespace time;
     uint64_t entry;
     saveReadSymbol("trampolineStart", entry);
+    SMP::setAPICID(0, APIC::getCPUID());
+    SMP::setupWakeupInterrupt();
+    TLB::setupInterrupt();
     if (entry % pageSize != 0) {
         Output::getDefault()->print("Invalid trampoline start address!\n");
     } else {
         secondaryCpuInInit = false;
+        secondaryCpuIndex = 1;
         for (uint64_t i = 0; i < 64; ++i) {
             if (cpuBitmap & (1ull << i)) {
                 if (i == APIC::getCPUID()) {
@@ -360,4 +394,4 @@ void APIC::initAllCPUs() {
             }
         }
     }
-}
\ No newline at end of file
+}
@@ -47,7 +47,7 @@ bool HPETParser::parse(ACPI::TableHeader* table) {
         return false;
     }
     hpetTable = (HPETTable*) table;
-    hpetAddress = TempMemory::mapPages(hpetTable->address.address, 1, false);
+    hpetAddress = TempMemory::mapMMIO(hpetTable->address.address, 1);
     if (hpetTable->address.address_space_id != 0) {
         Output::getDefault()->print("HPET: Unsupported address space\n");
         return false;
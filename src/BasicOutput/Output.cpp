@@ -19,6 +19,10 @@ void Output::init() {
     outputBufferSize = 0;
 }
 
+void Output::initMemoryType() {
+    ((VGATextOut*) defaultBuffer)->mapWriteCombining();
+}
+
 Output* Output::getDefault() {
     return defaultOut;
 }
@@ -51,17 +55,20 @@ uint64_t Output::readBuffer(uint8_t* buffer, uint64_t bufferSize) {
 }
 
 void Output::print(char c) {
+    PrintSection section(*this);
     addToBuffer(c);
     printImpl(c);
 }
 
 void Output::print(const char* str) {
+    PrintSection section(*this);
     for (; *str; ++str) {
         print(*str);
     }
 }
 
 void Output::print(uint64_t hex, uint8_t minSize, uint64_t maxSize) {
+    PrintSection section(*this);
     if (maxSize < 16) {
         hex &= (1ull << (maxSize * 4)) - 1;
         if (minSize > maxSize) {
@@ -86,6 +93,7 @@ void Output::print(uint64_t hex, uint8_t minSize, uint64_t maxSize) {
 }
 
 void Output::printDec(int64_t dec, bool printPlus) {
+    PrintSection section(*this);
     if (dec < 0) {
         print('-');
         dec = -dec;
@@ -96,6 +104,7 @@ void Output::printDec(int64_t dec, bool printPlus) {
 }
 
 void Output::printDec(uint64_t dec) {
+    PrintSection section(*this);
     uint64_t div = 1;
     while (dec / div >= 10) {
         div *= 10;
@@ -172,6 +181,7 @@ void Output::printValueImpl(uint64_t v, char specifier, char length, char flags,
 }
 
 void Output::print(BitList bits) {
+    PrintSection section(*this);
     print('[');
     bool first = true;
     for (uint8_t i = 0; i < bits.bitCount; ++i) {
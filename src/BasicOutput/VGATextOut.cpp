@@ -1,22 +1,33 @@
 #include "BasicOutput/VGATextOut.hpp"
 #include "CPUControl/cpu.hpp"
 #include "LanguageFeatures/memory.hpp"
+#include "Memory/tempMapping.hpp"
 
 VGATextOut::VGATextOut() {
     index = 0;
     textBuffer = (volatile char*) 0xB8000;
+    memcpy(shadowBuffer, (void*) textBuffer, sizeof(shadowBuffer));
+}
+
+void VGATextOut::mapWriteCombining() {
+    textBuffer = (volatile char*) TempMemory::mapWithType(0xB8000, 1, PageTable::MemoryType::WriteCombining);
+}
+
+void VGATextOut::flush() {
+    asm volatile("sfence" ::
+                         : "memory");
 }
 
 void VGATextOut::scroll() {
+    // scroll in the shadow buffer, the text buffer is only written (reads from it are uncached)
+    uint64_t lineSize = getWidth() * 2;
     for (uint64_t line = 1; line < getHeight(); ++line) {
-        memcpy((void*) (textBuffer + (line - 1) * getWidth() * 2),
-               (void*) (textBuffer + line * getWidth() * 2),
-               getWidth() * 2);
+        memcpy(shadowBuffer + (line - 1) * lineSize, shadowBuffer + line * lineSize, lineSize);
     }
-    memset((void*) (textBuffer + (getHeight() - 1) * getWidth() * 2),
-           0,
-           getWidth() * 2);
+    memset(shadowBuffer + (getHeight() - 1) * lineSize, 0, lineSize);
+    memcpy((void*) textBuffer, shadowBuffer, sizeof(shadowBuffer));
     setCursor(0, getHeight() - 1);
+    flush();
 }
 
 void VGATextOut::printImpl(char c) {
@@ -24,6 +35,8 @@ void VGATextOut::printImpl(char c) {
         setY(getY() + 1);
         setX(0);
     } else {
+        shadowBuffer[index * 2] = c;
+        shadowBuffer[index * 2 + 1] = 0x07;
         textBuffer[index * 2] = c;
         textBuffer[index * 2 + 1] = 0x07;
         index++;
@@ -35,9 +48,11 @@ void VGATextOut::printImpl(char c) {
 
 void VGATextOut::clear() {
     for (uint64_t i = 0; i < 80 * 25; i++) {
-        textBuffer[i * 2] = ' ';
-        textBuffer[i * 2 + 1] = 0x07;
+        shadowBuffer[i * 2] = ' ';
+        shadowBuffer[i * 2 + 1] = 0x07;
     }
+    memcpy((void*) textBuffer, shadowBuffer, sizeof(shadowBuffer));
+    flush();
 }
 
 uint64_t VGATextOut::getWidth() {
@@ -160,4 +160,19 @@ getFlags:
 invalidatePage:
     invlpg (%rdi)
     ret
+.global setCR0
+.type setCR0, @function
+setCR0:
+    movq %rdi, %cr0
+    ret
+.global setCR3
+.type setCR3, @function
+setCR3:
+    movq %rdi, %cr3
+    ret
+.global setCR4
+.type setCR4, @function
+setCR4:
+    movq %rdi, %cr4
+    ret
 )");
\ No newline at end of file
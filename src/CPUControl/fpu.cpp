@@ -0,0 +1,53 @@
+#include "CPUControl/fpu.hpp"
+#include "CPUControl/cpu.hpp"
+
+constexpr uint64_t cr0MonitorCoprocessor = 1ull << 1;
+constexpr uint64_t cr0Emulation = 1ull << 2;
+constexpr uint64_t cr0TaskSwitched = 1ull << 3;
+constexpr uint64_t cr0NumericError = 1ull << 5;
+constexpr uint64_t cr4OSFXSR = 1ull << 9;
+constexpr uint64_t cr4OSXMMEXCPT = 1ull << 10;
+constexpr uint64_t cr4OSXSAVE = 1ull << 18;
+
+constexpr uint64_t xcr0X87 = 1ull << 0;
+constexpr uint64_t xcr0SSE = 1ull << 1;
+constexpr uint64_t xcr0AVX = 1ull << 2;
+
+constexpr uint32_t initialMXCSR = 0x1F80;
+
+static bool sse42;
+
+static inline void cpuidLeaf(uint32_t leaf, uint32_t subleaf, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    asm volatile("cpuid"
+                 : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+void FPU::initCPU() {
+    setCR0((getCR0() & ~(cr0Emulation | cr0TaskSwitched)) | cr0MonitorCoprocessor | cr0NumericError);
+
+    uint32_t a, b, c, d;
+    cpuidLeaf(1, 0, &a, &b, &c, &d);
+    bool xsave = c & (1 << 26);
+    bool avx = c & (1 << 28);
+    sse42 = c & (1 << 20);
+
+    uint64_t cr4 = getCR4() | cr4OSFXSR | cr4OSXMMEXCPT;
+    if (xsave) {
+        cr4 |= cr4OSXSAVE;
+    }
+    setCR4(cr4);
+
+    if (xsave) {
+        uint64_t enabledComponents = xcr0X87 | xcr0SSE | (avx ? xcr0AVX : 0);
+        asm volatile("xsetbv" ::"c"(0), "a"((uint32_t) enabledComponents), "d"((uint32_t) (enabledComponents >> 32)));
+    }
+
+    uint32_t mxcsr = initialMXCSR;
+    asm volatile("fninit\n\t"
+                 "ldmxcsr %0" ::"m"(mxcsr));
+}
+
+bool FPU::hasSSE42() {
+    return sse42;
+}
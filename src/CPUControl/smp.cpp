@@ -0,0 +1,112 @@
+#include "CPUControl/smp.hpp"
+#include "ACPI/APIC.hpp"
+#include "CPUControl/cpu.hpp"
+#include "CPUControl/interrupts.hpp"
+#include "Memory/physicalAllocator.hpp"
+
+constexpr uint32_t gsBaseMSR = 0xC0000101;
+
+struct CPUData {
+    uint8_t index;// must stay at offset 0 (read by SMP::getIndex)
+    uint8_t apicId;
+    volatile bool online;
+    volatile bool busy;
+    SMP::Work volatile work;
+    void* volatile context;
+} __attribute__((aligned(64)));// one cache line per cpu
+
+static CPUData cpuData[SMP::maxCPUCount];
+static volatile uint8_t cpuCount;
+
+static void onWakeup(Interrupt&) {
+    // nothing to do, the interrupt only ends the hlt in SMP::idle
+}
+
+void SMP::initCPU(uint8_t index, uint8_t apicId) {
+    CPUData& data = cpuData[index];
+    data.index = index;
+    data.apicId = apicId;
+    data.busy = false;
+    data.work = nullptr;
+    data.context = nullptr;
+    writeMSR(gsBaseMSR, (uint64_t) &data);
+    data.online = true;
+    if (index + 1 > cpuCount) {
+        cpuCount = index + 1;
+    }
+}
+
+void SMP::setupWakeupInterrupt() {
+    Interrupt::setupInterruptHandler(wakeupVector, onWakeup, {false, 0});
+}
+
+uint8_t SMP::getCount() {
+    return cpuCount == 0 ? 1 : cpuCount;
+}
+
+bool SMP::isOnline(uint8_t index) {
+    return cpuData[index].online;
+}
+
+uint8_t SMP::getAPICID(uint8_t index) {
+    return cpuData[index].apicId;
+}
+
+void SMP::setAPICID(uint8_t index, uint8_t apicId) {
+    cpuData[index].apicId = apicId;
+}
+
+bool SMP::run(uint8_t index, Work work, void* context) {
+    CPUData& data = cpuData[index];
+    if (index >= cpuCount || !data.online || index == getIndex()) {
+        return false;
+    }
+    if (__atomic_exchange_n(&data.busy, true, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    data.context = context;
+    __atomic_store_n(&data.work, work, __ATOMIC_RELEASE);
+    APIC::sendInterrupt(wakeupVector, 0, data.apicId, 0, false);
+    return true;
+}
+
+void SMP::wake(uint8_t index) {
+    if (index < cpuCount && cpuData[index].online && index != getIndex()) {
+        APIC::sendInterrupt(wakeupVector, 0, cpuData[index].apicId, 0, false);
+    }
+}
+
+void SMP::wait(uint8_t index) {
+    while (__atomic_load_n(&cpuData[index].busy, __ATOMIC_ACQUIRE)) {
+        pause();
+    }
+}
+
+bool SMP::isIdle(uint8_t index) {
+    return cpuData[index].online && !cpuData[index].busy;
+}
+
+void SMP::idle() {
+    CPUData& data = cpuData[getIndex()];
+    while (true) {
+        Interrupt::disableInterrupts();
+        Work work = __atomic_load_n(&data.work, __ATOMIC_ACQUIRE);
+        if (work == nullptr) {
+            //zero pages for the pool while there is nothing else to do, work is checked again after every page
+            Interrupt::enableInterrupts();
+            if (PhysicalAllocator::prepareZeroedPage()) {
+                continue;
+            }
+            Interrupt::disableInterrupts();
+            if (__atomic_load_n(&data.work, __ATOMIC_ACQUIRE) == nullptr) {
+                asm volatile("sti; hlt" ::
+                                     : "memory");// sti only takes effect after hlt, so a wakeup can not get lost
+            }
+            continue;
+        }
+        Interrupt::enableInterrupts();
+        work(data.context);
+        data.work = nullptr;
+        __atomic_store_n(&data.busy, false, __ATOMIC_RELEASE);
+    }
+}
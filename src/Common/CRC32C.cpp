@@ -0,0 +1,97 @@
+#include "Common/CRC32C.hpp"
+#include "CPUControl/fpu.hpp"
+
+constexpr uint32_t polynomial = 0x82F63B78;// reflected Castagnoli polynomial
+constexpr uint64_t tableOnlySize = 8;      // shorter updates do not pay for a faster backend
+
+struct Tables {
+    uint32_t entries[8][256];// entries[k][b] is the crc of b followed by k zero bytes
+
+    constexpr Tables() : entries() {
+        for (uint32_t b = 0; b < 256; ++b) {
+            uint32_t crc = b;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (polynomial & (0 - (crc & 1)));
+            }
+            entries[0][b] = crc;
+        }
+        for (uint32_t b = 0; b < 256; ++b) {
+            for (int k = 1; k < 8; ++k) {
+                entries[k][b] = (entries[k - 1][b] >> 8) ^ entries[0][entries[k - 1][b] & 0xFF];
+            }
+        }
+    }
+};
+
+static constexpr Tables tables;
+
+static uint32_t updateTable(uint32_t crc, const uint8_t* data, uint64_t size) {
+    while (size--) {
+        crc = (crc >> 8) ^ tables.entries[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+static uint32_t updateSliceBy8(uint32_t crc, const uint8_t* data, uint64_t size) {
+    while (size && ((uint64_t) data & 7)) {
+        crc = (crc >> 8) ^ tables.entries[0][(crc ^ *data++) & 0xFF];
+        size--;
+    }
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word = *(const uint64_t*) data ^ crc;
+        crc = tables.entries[7][word & 0xFF] ^
+              tables.entries[6][(word >> 8) & 0xFF] ^
+              tables.entries[5][(word >> 16) & 0xFF] ^
+              tables.entries[4][(word >> 24) & 0xFF] ^
+              tables.entries[3][(word >> 32) & 0xFF] ^
+              tables.entries[2][(word >> 40) & 0xFF] ^
+              tables.entries[1][(word >> 48) & 0xFF] ^
+              tables.entries[0][word >> 56];
+    }
+    return updateTable(crc, data, size);
+}
+
+// the crc32 instruction only uses general purpose registers, so it needs no FPU state despite being part of SSE4.2
+__attribute__((target("crc32"))) uint32_t CRC32C::updateSSE42(uint32_t crc, const uint8_t* data, uint64_t size) {
+    while (size && ((uint64_t) data & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+        size--;
+    }
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        crc64 = __builtin_ia32_crc32di(crc64, *(const uint64_t*) data);
+    }
+    crc = (uint32_t) crc64;
+    while (size) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+        size--;
+    }
+    return crc;
+}
+
+uint32_t CRC32C::update(uint32_t crc, const void* data, uint64_t size) {
+    if (size < tableOnlySize) {
+        return updateTable(crc, (const uint8_t*) data, size);
+    }
+    return update(getBackend(), crc, data, size);
+}
+
+uint32_t CRC32C::update(Backend backend, uint32_t crc, const void* data, uint64_t size) {
+    switch (backend) {
+        case Backend::Table:
+            return updateTable(crc, (const uint8_t*) data, size);
+        case Backend::SliceBy8:
+            return updateSliceBy8(crc, (const uint8_t*) data, size);
+        case Backend::SSE42:
+            return updateSSE42(crc, (const uint8_t*) data, size);
+    }
+    return crc;
+}
+
+bool CRC32C::isSupported(Backend backend) {
+    return backend != Backend::SSE42 || FPU::hasSSE42();
+}
+
+CRC32C::Backend CRC32C::getBackend() {
+    return FPU::hasSSE42() ? Backend::SSE42 : Backend::SliceBy8;
+}
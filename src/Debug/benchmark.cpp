@@ -0,0 +1,397 @@
+#include "Debug/benchmark.hpp"
+#include "BasicOutput/Output.hpp"
+#include "CPUControl/cpu.hpp"
+#include "CPUControl/smp.hpp"
+#include "Common/CRC32C.hpp"
+#include "Common/Units.hpp"
+#include "LanguageFeatures/memory.hpp"
+#include "Memory/addressSpace.hpp"
+#include "Memory/heap.hpp"
+#include "Memory/memory.hpp"
+#include "Memory/pageTable.hpp"
+#include "Memory/physicalAllocator.hpp"
+#include "Memory/tempMapping.hpp"
+#include "Memory/tlb.hpp"
+#include "Process/Process.hpp"
+
+/**
+ * @brief Runs work on the first cpuCount cpus at the same time (including the calling cpu) and waits for all of them.
+ */
+static void runOnCPUs(uint8_t cpuCount, SMP::Work work, void* context) {
+    uint8_t self = SMP::getIndex();
+    uint8_t started = 1;
+    for (uint8_t i = 0; i < SMP::getCount() && started < cpuCount; ++i) {
+        if (i != self && SMP::run(i, work, context)) {
+            started++;
+        }
+    }
+    work(context);
+    for (uint8_t i = 0; i < SMP::getCount(); ++i) {
+        if (i != self) {
+            SMP::wait(i);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------[Heap Stress]-----------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint64_t heapStressIterations = 10000;
+constexpr uint64_t heapStressBatch = 64;
+
+struct HeapStressContext {
+    volatile uint64_t ready;
+    uint64_t cpuCount;
+    uint64_t cycles[SMP::maxCPUCount];
+    void* volatile handOver[SMP::maxCPUCount][heapStressBatch];// objects allocated on one cpu and freed on the next
+};
+
+static void heapStressWorker(void* ptr) {
+    HeapStressContext* context = (HeapStressContext*) ptr;
+    uint8_t index = SMP::getIndex();
+    uint8_t next = (index + 1) % context->cpuCount;
+    __atomic_add_fetch(&context->ready, 1, __ATOMIC_ACQ_REL);
+    while (context->ready < context->cpuCount) {
+        pause();
+    }
+
+    void* objects[heapStressBatch];
+    uint64_t start = readTimestamp();
+    for (uint64_t iteration = 0; iteration < heapStressIterations; ++iteration) {
+        for (uint64_t i = 0; i < heapStressBatch; ++i) {
+            objects[i] = kmalloc(16ull << ((iteration + i) % 7));
+        }
+        for (uint64_t i = 0; i < heapStressBatch; ++i) {
+            kfree(objects[(i * 7) % heapStressBatch]);// 7 and 64 are coprime, so every object is freed once
+        }
+        //every 16th round frees objects of another cpu to exercise the depot
+        if (iteration % 16 == 0) {
+            for (uint64_t i = 0; i < heapStressBatch; ++i) {
+                void* old = __atomic_exchange_n(&context->handOver[next][i], kmalloc(64), __ATOMIC_ACQ_REL);
+                kfree(old);
+            }
+        }
+    }
+    context->cycles[index] = readTimestamp() - start;
+}
+
+void Benchmark::heapStress() {
+    for (uint64_t cpuCount = 1; cpuCount <= SMP::getCount(); cpuCount *= 2) {
+        HeapStressContext* context = new HeapStressContext();
+        context->ready = 0;
+        context->cpuCount = cpuCount;
+        for (uint64_t i = 0; i < SMP::maxCPUCount; ++i) {
+            context->cycles[i] = 0;
+            for (uint64_t j = 0; j < heapStressBatch; ++j) {
+                context->handOver[i][j] = nullptr;
+            }
+        }
+        runOnCPUs(cpuCount, heapStressWorker, context);
+
+        uint64_t totalCycles = 0;
+        for (uint64_t i = 0; i < cpuCount; ++i) {
+            totalCycles += context->cycles[i];
+        }
+        uint64_t operations = heapStressIterations * heapStressBatch * 2 + (heapStressIterations / 16 + 1) * heapStressBatch * 2;
+        Output::getDefault()->printf("Benchmark: heap stress on %llu cpu(s): %llu ticks per kmalloc/kfree\n", cpuCount, totalCycles / (operations * cpuCount));
+        for (uint64_t i = 0; i < SMP::maxCPUCount; ++i) {
+            for (uint64_t j = 0; j < heapStressBatch; ++j) {
+                kfree(context->handOver[i][j]);
+            }
+        }
+        delete context;
+    }
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------[Direct Map]------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint64_t directMapPages = 16;
+constexpr uint64_t directMapCopies = 64;
+constexpr uint64_t directMapWalks = 10000;
+
+static void flushCacheLines(uint8_t* ptr, uint64_t size) {
+    for (uint64_t i = 0; i < size; i += 64) {
+        asm volatile("clflush (%0)" ::"r"(ptr + i)
+                     : "memory");
+    }
+    asm volatile("mfence" ::
+                         : "memory");
+}
+
+/**
+ * @brief Translates a virtual address by reading the paging structures through the given mapping of physical memory.
+ */
+static uint64_t walkPageTable(uint64_t virtualAddress, uint8_t* (*map)(uint64_t physicalAddress)) {
+    uint64_t table = getCR3() & ~0xFFFull;
+    for (uint64_t level = 4; level > 0; --level) {
+        uint64_t index = (virtualAddress >> (12 + 9 * (level - 1))) & 0x1FF;
+        uint64_t entry = ((volatile uint64_t*) map(table))[index];
+        if (!(entry & 0b1)) {
+            return 0;
+        }
+        table = entry & 0x000FFFFFFFFFF000ull;
+        if (level > 1 && (entry & (1 << 7))) {
+            return table + (virtualAddress & ((1ull << (12 + 9 * (level - 1))) - 1));
+        }
+    }
+    return table + (virtualAddress & 0xFFF);
+}
+
+static uint64_t measureCopy(uint8_t* destination, uint8_t* source, uint64_t copies) {
+    uint64_t start = readTimestamp();
+    for (uint64_t i = 0; i < copies; ++i) {
+        memcpy(destination, source, directMapPages * pageSize);
+    }
+    return (readTimestamp() - start) / copies;
+}
+
+static uint64_t measureWalk(uint64_t virtualAddress, uint8_t* (*map)(uint64_t physicalAddress)) {
+    uint64_t start = readTimestamp();
+    for (uint64_t i = 0; i < directMapWalks; ++i) {
+        walkPageTable(virtualAddress, map);
+    }
+    return (readTimestamp() - start) / directMapWalks;
+}
+
+void Benchmark::directMap() {
+    uint64_t size = directMapPages * pageSize;
+    uint64_t source = PhysicalAllocator::allocatePhysicalMemory(directMapPages);
+    uint64_t destination = PhysicalAllocator::allocatePhysicalMemory(directMapPages);
+    memset(TempMemory::mapPages(source, directMapPages, false), 0x5A, size);
+
+    uint64_t cachedCopy = measureCopy(TempMemory::mapPages(destination, directMapPages, false), TempMemory::mapPages(source, directMapPages, false), directMapCopies);
+    // the same memory through the uncached window, write back the cached lines first to not mix both memory types
+    flushCacheLines(TempMemory::mapPages(source, directMapPages, false), size);
+    flushCacheLines(TempMemory::mapPages(destination, directMapPages, false), size);
+    uint64_t uncachedCopy = measureCopy(TempMemory::mapMMIO(destination, directMapPages), TempMemory::mapMMIO(source, directMapPages), directMapCopies / 16);
+    flushCacheLines(TempMemory::mapPages(destination, directMapPages, false), size);
+    Output::getDefault()->printf("Benchmark: copy %llu KiB: %llu ticks write back, %llu ticks uncached\n", size / 1Ki, cachedCopy, uncachedCopy);
+
+    uint64_t target = (uint64_t) kmalloc(16);
+    uint64_t cachedWalk = measureWalk(target, [](uint64_t physicalAddress) { return TempMemory::mapPages(physicalAddress, 1, false); });
+    uint64_t uncachedWalk = measureWalk(target, [](uint64_t physicalAddress) { return TempMemory::mapMMIO(physicalAddress, 1); });
+    Output::getDefault()->printf("Benchmark: page walk: %llu ticks write back, %llu ticks uncached\n", cachedWalk, uncachedWalk);
+    kfree((void*) target);
+
+    PhysicalAllocator::freePhysicalMemory(source, directMapPages);
+    PhysicalAllocator::freePhysicalMemory(destination, directMapPages);
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//---------------------------------------------------[Context Switch]----------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint64_t contextSwitchPages = 16;
+constexpr uint64_t contextSwitchRounds = 10000;
+constexpr uint64_t contextSwitchUserAddress = 4Mi;
+
+static void touchPages() {
+    for (uint64_t i = 0; i < contextSwitchPages; ++i) {
+        *(volatile uint64_t*) (contextSwitchUserAddress + i * pageSize);
+    }
+}
+
+static uint64_t measureSwitches(AddressSpace* first, AddressSpace* second, bool keepTLB) {
+    uint64_t start = readTimestamp();
+    for (uint64_t i = 0; i < contextSwitchRounds; ++i) {
+        first->activate(keepTLB);
+        touchPages();
+        second->activate(keepTLB);
+        touchPages();
+    }
+    return (readTimestamp() - start) / (contextSwitchRounds * 2);
+}
+
+void Benchmark::contextSwitch() {
+    AddressSpace* spaces[2] = {new AddressSpace(), new AddressSpace()};
+    uint64_t physical[2];
+    for (uint64_t i = 0; i < 2; ++i) {
+        physical[i] = PhysicalAllocator::allocatePhysicalMemory(contextSwitchPages);
+        spaces[i]->activate();
+        PageTable::mapRange(physical[i], (void*) contextSwitchUserAddress, contextSwitchPages * pageSize,
+                            {.writeEnable = true, .userAvailable = true, .memoryType = PageTable::MemoryType::WriteBack, .executeDisable = false});
+    }
+
+    uint64_t flushing = measureSwitches(spaces[0], spaces[1], false);
+    uint64_t tagged = measureSwitches(spaces[0], spaces[1], true);
+    AddressSpace::activateKernel();
+    Output::getDefault()->printf("Benchmark: address space switch + %llu page touches: %llu ticks flushing, %llu ticks with PCID (%s)\n",
+                                 contextSwitchPages, flushing, tagged, AddressSpace::isPCIDEnabled() ? "enabled" : "not supported");
+
+    for (uint64_t i = 0; i < 2; ++i) {
+        delete spaces[i];
+        PhysicalAllocator::freePhysicalMemory(physical[i], contextSwitchPages);
+    }
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//---------------------------------------------------[TLB Shootdown]-----------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint64_t shootdownRounds = 1000;
+
+void Benchmark::tlbShootdown() {
+    uint64_t addresses[TLB::maxAddresses];
+    for (uint64_t i = 0; i < TLB::maxAddresses; ++i) {
+        addresses[i] = 80Ti + i * pageSize;// kernel heap
+    }
+    for (uint64_t cpuCount = 2; cpuCount <= SMP::getCount(); cpuCount *= 2) {
+        uint64_t cpus = cpuCount == 64 ? ~0ull : (1ull << cpuCount) - 1;
+        uint64_t start = readTimestamp();
+        for (uint64_t i = 0; i < shootdownRounds; ++i) {
+            TLB::flushOn(cpus, addresses, 1, true);
+        }
+        uint64_t single = (readTimestamp() - start) / shootdownRounds;
+        start = readTimestamp();
+        for (uint64_t i = 0; i < shootdownRounds; ++i) {
+            TLB::flushOn(cpus, addresses, TLB::maxAddresses, true);
+        }
+        uint64_t batched = (readTimestamp() - start) / shootdownRounds;
+        Output::getDefault()->printf("Benchmark: tlb shootdown to %llu cpu(s): %llu ticks for 1 page, %llu ticks for %llu pages\n",
+                                     cpuCount - 1, single, batched, TLB::maxAddresses);
+    }
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//---------------------------------------------------[Mapping Tree]------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint64_t mappingLookups = 100000;
+constexpr uint64_t mappingBase = 1Gi;
+
+static uint64_t nextRandom(uint64_t& state) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return state >> 33;
+}
+
+void Benchmark::mappingTree() {
+    Mapping::Flags flags;
+    flags.writable = true;
+    flags.executable = false;
+    for (uint64_t regions = 1024; regions <= 16384; regions *= 4) {
+        Mapping* mapping = new Mapping();
+        uint64_t random = 1;
+        //every other page is a region, so neighbours can not be merged and lookups hit holes half of the time
+        uint64_t start = readTimestamp();
+        for (uint64_t i = 0; i < regions; ++i) {
+            uint64_t region = (i * 7919) % regions;// insert out of order
+            mapping->map(mappingBase + region * 2 * pageSize, region * 2 * pageSize, pageSize, flags);
+        }
+        uint64_t insert = (readTimestamp() - start) / regions;
+
+        start = readTimestamp();
+        uint64_t hits = 0;
+        for (uint64_t i = 0; i < mappingLookups; ++i) {
+            hits += mapping->isMapped(mappingBase + nextRandom(random) % (regions * 2) * pageSize);
+        }
+        uint64_t lookup = (readTimestamp() - start) / mappingLookups;
+
+        //punch a page into the middle of regions of three pages, each unmap splits one region into two
+        start = readTimestamp();
+        for (uint64_t i = 0; i < regions; i += 2) {
+            mapping->map(mappingBase + (i * 2 + 1) * pageSize, (i * 2 + 1) * pageSize, pageSize, flags);
+        }
+        mapping->compact();
+        uint64_t merged = mapping->getEntryCount();
+        for (uint64_t i = 0; i < regions; i += 2) {
+            mapping->unmap(mappingBase + (i * 2 + 1) * pageSize, pageSize);
+        }
+        uint64_t split = (readTimestamp() - start) / regions;
+
+        Output::getDefault()->printf("Benchmark: mapping with %llu regions: %llu ticks insert, %llu ticks lookup (%llu hits), %llu ticks map + compact + split (%llu merged)\n",
+                                     regions, insert, lookup, hits, split, merged);
+        delete mapping;
+    }
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------[Memory Functions]----------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint64_t memoryFunctionsMaxSize = 1Mi;
+constexpr uint64_t memoryFunctionsBytes = 64Mi;// bytes processed per size, so every size takes a similar time
+
+void Benchmark::memoryFunctions() {
+    uint8_t* source = (uint8_t*) kmalloc(memoryFunctionsMaxSize + 64);
+    uint8_t* destination = (uint8_t*) kmalloc(memoryFunctionsMaxSize + 64);
+    memset(source, 0x5A, memoryFunctionsMaxSize + 64);
+    memset(destination, 0x5A, memoryFunctionsMaxSize + 64);
+    Output::getDefault()->printf("Benchmark: rep movsb: ERMS %s, FSRM %s\n", hasEnhancedRepMovsb() ? "yes" : "no", hasFastShortRepMovsb() ? "yes" : "no");
+    for (uint64_t size = 8; size <= memoryFunctionsMaxSize; size *= 2) {
+        uint64_t rounds = memoryFunctionsBytes / size;
+        uint64_t start = readTimestamp();
+        for (uint64_t i = 0; i < rounds; ++i) {
+            memcpy(destination, source, size);
+        }
+        uint64_t copy = (readTimestamp() - start) / rounds;
+        start = readTimestamp();
+        for (uint64_t i = 0; i < rounds; ++i) {
+            memset(destination, (int) i, size);
+        }
+        uint64_t set = (readTimestamp() - start) / rounds;
+        memset(destination, 0x5A, size);
+        start = readTimestamp();
+        int result = 0;
+        for (uint64_t i = 0; i < rounds; ++i) {
+            result |= memcmp(destination, source, size);
+        }
+        uint64_t compare = (readTimestamp() - start) / rounds;
+        start = readTimestamp();
+        for (uint64_t i = 0; i < rounds; ++i) {
+            memmove(destination + 1 + i % 2, destination + 1 - i % 2, size);// overlapping, alternating direction
+        }
+        uint64_t move = (readTimestamp() - start) / rounds;
+        Output::getDefault()->printf("Benchmark: %llu bytes: memcpy %llu, memset %llu, memcmp %llu%s, memmove %llu ticks\n",
+                                     size, copy, set, compare, result ? " (mismatch)" : "", move);
+    }
+    kfree(source);
+    kfree(destination);
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------[CRC32C]----------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint64_t crc32cMaxSize = 64Ki;
+constexpr uint64_t crc32cBytes = 16Mi;// bytes processed per size and backend
+
+void Benchmark::crc32c() {
+    static constexpr CRC32C::Backend backends[] = {CRC32C::Backend::Table, CRC32C::Backend::SliceBy8, CRC32C::Backend::SSE42};
+    static constexpr const char* names[] = {"table", "slice by 8", "sse4.2"};
+    uint8_t* buffer = (uint8_t*) kmalloc(crc32cMaxSize);
+    for (uint64_t i = 0; i < crc32cMaxSize; ++i) {
+        buffer[i] = (uint8_t) (i * 131 + 7);
+    }
+    for (uint64_t size = 64; size <= crc32cMaxSize; size *= 4) {
+        uint64_t rounds = crc32cBytes / size;
+        Output::getDefault()->printf("Benchmark: crc32c %llu bytes:", size);
+        uint32_t reference = CRC32C::update(CRC32C::Backend::Table, ~0u, buffer, size);
+        for (uint64_t b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+            if (!CRC32C::isSupported(backends[b])) {
+                continue;
+            }
+            uint32_t crc = 0;
+            uint64_t start = readTimestamp();
+            for (uint64_t i = 0; i < rounds; ++i) {
+                crc = CRC32C::update(backends[b], ~0u, buffer, size);
+            }
+            uint64_t ticks = (readTimestamp() - start) / rounds;
+            Output::getDefault()->printf(" %s %llu ticks%s", names[b], ticks, crc != reference ? " (mismatch)" : "");
+        }
+        Output::getDefault()->printf("\n");
+    }
+    kfree(buffer);
+}
+
+void Benchmark::run() {
+    heapStress();
+    directMap();
+    contextSwitch();
+    tlbShootdown();
+    mappingTree();
+    memoryFunctions();
+    crc32c();
+}
@@ -5,12 +5,33 @@
 #include "Memory/pageTable.hpp"
 #include "Memory/physicalAllocator.hpp"
 #include "Memory/tempMapping.hpp"
+#include "Process/Process.hpp"
 
 void onPageFault(Interrupt& inter) {
+    uint64_t cr2 = getCR2();
+    //pages of the running process are filled on demand and copied on the first write while they are shared
+    Process* process = Process::getCurrent();
+    bool userAddress = cr2 < ((uint64_t) PageTable::kernelSpaceStartEntry << 39);
+    bool presentFault = inter.getErrorCode() & 1;
+    bool writeFault = inter.getErrorCode() & 2;
+    bool resolvable = !presentFault || (writeFault && !(inter.getErrorCode() & (1 << 3)));
+    if (userAddress && resolvable && process != nullptr) {
+        //filling a page may read a file and wait for the disk, this only holds interrupts off if the faulting code did
+        bool enable = inter.wereInterruptsEnabled();
+        if (enable) {
+            Interrupt::enableInterrupts();
+        }
+        bool handled = process->getProcessMemory().handlePageFault(cr2, writeFault);
+        if (enable) {
+            Interrupt::disableInterrupts();
+        }
+        if (handled) {
+            return;
+        }
+    }
     auto out = Output::getDefault();
     //out->clear();
     //out->setCursor(0, 0);
-    uint64_t cr2 = getCR2();
     out->printf("Page fault at %llx\n", cr2);
     out->printf("Error code: %llx\n", inter.getErrorCode());
     //decode error code
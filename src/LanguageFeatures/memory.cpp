@@ -5,17 +5,85 @@
 #include "Memory/heap.hpp"
 #include <stdint.h>
 
+// 8 byte accesses to byte buffers, may_alias keeps them legal for any underlying type
+typedef uint64_t __attribute__((__may_alias__)) Word;
+
+constexpr uint64_t lowBytes = 0x0101010101010101ull;
+constexpr uint64_t highBits = 0x8080808080808080ull;
+
+constexpr uint8_t featuresDetected = 1 << 0;
+constexpr uint8_t featureERMS = 1 << 1;// enhanced rep movsb/stosb, fast for larger sizes
+constexpr uint8_t featureFSRM = 1 << 2;// fast short rep movsb, fast for all sizes
+
+constexpr uint64_t repMinimumERMS = 256;// below this the startup of rep movsb costs more than the word loop
+constexpr uint64_t repMinimumFSRM = 16;
+
+static uint8_t stringFeatures;
+
+/**
+ * @brief Detects the rep movsb features on the first call, memcpy is used before any init code runs.
+ */
+static inline uint8_t getStringFeatures() {
+    uint8_t features = __atomic_load_n(&stringFeatures, __ATOMIC_RELAXED);
+    if (features & featuresDetected) {
+        return features;
+    }
+    features = featuresDetected;
+    uint32_t maxLeaf, b, c, d;
+    asm volatile("cpuid"
+                 : "=a"(maxLeaf), "=b"(b), "=c"(c), "=d"(d)
+                 : "a"(0));
+    if (maxLeaf >= 7) {
+        asm volatile("cpuid"
+                     : "=a"(maxLeaf), "=b"(b), "=c"(c), "=d"(d)
+                     : "a"(7), "c"(0));
+        if (b & (1 << 9)) {
+            features |= featureERMS;
+        }
+        if (d & (1 << 4)) {
+            features |= featureFSRM;
+        }
+    }
+    __atomic_store_n(&stringFeatures, features, __ATOMIC_RELAXED);
+    return features;
+}
+
+static inline uint64_t getRepMinimum() {
+    uint8_t features = getStringFeatures();
+    if (features & featureFSRM) {
+        return repMinimumFSRM;
+    }
+    if (features & featureERMS) {
+        return repMinimumERMS;
+    }
+    return ~0ull;
+}
+
+bool hasEnhancedRepMovsb() {
+    return getStringFeatures() & featureERMS;
+}
+
+bool hasFastShortRepMovsb() {
+    return getStringFeatures() & featureFSRM;
+}
+
 extern "C" void* memset(void* ptr, int v, uint64_t num) {
     uint8_t value = (uint8_t) v;
     uint8_t* p = reinterpret_cast<uint8_t*>(ptr);
-    uint64_t val = value | (value << 8) | (value << 16) | (value << 24);
-    val |= (val << 32);
+    if (num >= getRepMinimum()) {
+        asm volatile("rep stosb"
+                     : "+D"(p), "+c"(num)
+                     : "a"(value)
+                     : "memory");
+        return ptr;
+    }
+    uint64_t val = value * lowBytes;
     uint64_t i = 0;
-    for (; i < num && (i & 7); ++i) {// align to 8 bytes
+    for (; i < num && (((uint64_t) p + i) & 7); ++i) {// align to 8 bytes
         p[i] = value;
     }
     for (; i + 7 < num; i += 8) {// fill 8 bytes at a time
-        *reinterpret_cast<uint64_t*>(p + i) = val;
+        *reinterpret_cast<Word*>(p + i) = val;
     }
     for (; i < num; ++i) {// fill the rest
         p[i] = value;
@@ -23,19 +91,72 @@ extern "C" void* memset(void* ptr, int v, uint64_t num) {
     return ptr;
 }
 
+/**
+ * @brief Copies front to back, 8 bytes at a time once the destination is aligned (unaligned loads are cheap on x86).
+ */
+static inline void copyForward(uint8_t* d, const uint8_t* s, uint64_t num) {
+    uint64_t i = 0;
+    if (num >= 16) {
+        for (; ((uint64_t) d + i) & 7; ++i) {
+            d[i] = s[i];
+        }
+        for (; i + 7 < num; i += 8) {
+            *(Word*) (d + i) = *(const Word*) (s + i);
+        }
+    }
+    for (; i < num; ++i) {
+        d[i] = s[i];
+    }
+}
+
+static inline void copyBackward(uint8_t* d, const uint8_t* s, uint64_t num) {
+    if (num >= 16) {
+        for (; ((uint64_t) d + num) & 7; --num) {
+            d[num - 1] = s[num - 1];
+        }
+        for (; num >= 8; num -= 8) {
+            *(Word*) (d + num - 8) = *(const Word*) (s + num - 8);
+        }
+    }
+    for (; num > 0; --num) {
+        d[num - 1] = s[num - 1];
+    }
+}
+
 extern "C" void* memcpy(void* destination, const void* source, uint64_t num) {
     uint8_t* d = (uint8_t*) destination;
     const uint8_t* s = (const uint8_t*) source;
-    for (uint64_t i = 0; i < num; ++i) {
-        d[i] = s[i];
+    if (num >= getRepMinimum()) {
+        asm volatile("rep movsb"
+                     : "+D"(d), "+S"(s), "+c"(num)::"memory");
+        return destination;
+    }
+    copyForward(d, s, num);
+    return destination;
+}
+
+extern "C" void* memmove(void* destination, const void* source, uint64_t num) {
+    uint8_t* d = (uint8_t*) destination;
+    const uint8_t* s = (const uint8_t*) source;
+    if (d <= s || d >= s + num) {
+        return memcpy(destination, source, num);// a forward copy never overwrites source bytes it still needs
     }
+    copyBackward(d, s, num);// rep movsb backwards (std) is not covered by ERMS and slow
     return destination;
 }
 
 extern "C" int memcmp(const void* ptr1, const void* ptr2, uint64_t num) {
     const uint8_t* p1 = (const uint8_t*) ptr1;
     const uint8_t* p2 = (const uint8_t*) ptr2;
-    for (uint64_t i = 0; i < num; ++i) {
+    uint64_t i = 0;
+    for (; i + 7 < num; i += 8) {
+        uint64_t a = *(const Word*) (p1 + i);
+        uint64_t b = *(const Word*) (p2 + i);
+        if (a != b) {
+            break;// the byte loop below finds the first difference
+        }
+    }
+    for (; i < num; ++i) {
         if (p1[i] != p2[i]) {
             return p1[i] - p2[i];
         }
@@ -72,7 +193,20 @@ extern "C" int strcmp(const char* str1, const char* str2) {
 }
 
 extern "C" uint64_t strlen(const char* str) {
-    for (uint64_t i = 0;; ++i) {
+    uint64_t i = 0;
+    for (; ((uint64_t) str + i) & 7; ++i) {
+        if (str[i] == '\0') {
+            return i;
+        }
+    }
+    //aligned words never cross a page, so reading past the terminator is safe
+    for (;; i += 8) {
+        uint64_t word = *(const Word*) (str + i);
+        if ((word - lowBytes) & ~word & highBits) {
+            break;
+        }
+    }
+    for (;; ++i) {
         if (str[i] == '\0') {
             return i;
         }
@@ -0,0 +1,120 @@
+#include "Memory/addressSpace.hpp"
+#include "CPUControl/cpu.hpp"
+#include "CPUControl/smp.hpp"
+#include "CPUControl/spinlock.hpp"
+#include "LanguageFeatures/memory.hpp"
+#include "Memory/memory.hpp"
+#include "Memory/pageTable.hpp"
+#include "Memory/physicalAllocator.hpp"
+#include "Memory/tempMapping.hpp"
+#include "Memory/tlb.hpp"
+
+constexpr uint64_t pcidCount = 4096;
+constexpr uint64_t cr0WriteProtect = 1ull << 16;
+constexpr uint64_t cr3NoFlush = 1ull << 63;
+constexpr uint64_t cr4GlobalPages = 1ull << 7;
+constexpr uint64_t cr4PCID = 1ull << 17;
+
+static uint64_t kernelLevel4Address;
+static bool pcidEnabled;
+static SpinLock pcidLock;
+static uint64_t usedPCIDs[pcidCount / 64];// tag 0 belongs to the kernel address space
+
+static uint16_t allocatePCID() {
+    if (!pcidEnabled) {
+        return 0;
+    }
+    SpinLockGuard guard(pcidLock);
+    for (uint64_t i = 0; i < pcidCount / 64; ++i) {
+        uint64_t free = ~usedPCIDs[i];
+        if (i == 0) {
+            free &= ~1ull;
+        }
+        if (free) {
+            uint64_t bit = __builtin_ctzll(free);
+            usedPCIDs[i] |= 1ull << bit;
+            return i * 64 + bit;
+        }
+    }
+    return 0;
+}
+
+static void freePCID(uint16_t pcid) {
+    if (pcid == 0) {
+        return;
+    }
+    SpinLockGuard guard(pcidLock);
+    usedPCIDs[pcid / 64] &= ~(1ull << (pcid % 64));
+}
+
+void AddressSpace::init() {
+    kernelLevel4Address = getCR3() & ~(pageSize - 1);
+    PageTable::initKernelSpace();
+    initCPU();
+}
+
+void AddressSpace::initCPU() {
+    // read only user pages are also read only for the kernel, so kernel writes break copy on write sharing too
+    setCR0(getCR0() | cr0WriteProtect);
+    uint64_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    uint64_t cr4 = getCR4();
+    if (d & (1 << 13)) {
+        cr4 |= cr4GlobalPages;
+    }
+    // PCID can only be enabled while the tag in cr3 is 0, which is true for the kernel address space
+    pcidEnabled = (c & (1 << 17)) && (getCR3() & (pageSize - 1)) == 0;
+    if (pcidEnabled) {
+        cr4 |= cr4PCID;
+    }
+    setCR4(cr4);
+}
+
+void AddressSpace::activateKernel() {
+    InterruptGuard guard;
+    TLB::setActiveAddressSpace(nullptr);
+    setCR3(kernelLevel4Address);// tag 0 is flushed, it may be used by address spaces that got no tag of their own
+}
+
+bool AddressSpace::isPCIDEnabled() {
+    return pcidEnabled;
+}
+
+AddressSpace::AddressSpace() {
+    level4Address = PhysicalAllocator::allocatePhysicalMemory(1);
+    uint64_t* entries = (uint64_t*) TempMemory::mapPages(level4Address, 1, false);
+    uint64_t* kernelEntries = (uint64_t*) TempMemory::mapPages(kernelLevel4Address, 1, false);
+    memset(entries, 0, PageTable::kernelSpaceStartEntry * sizeof(uint64_t));
+    memcpy(entries + PageTable::kernelSpaceStartEntry, kernelEntries + PageTable::kernelSpaceStartEntry,
+           (512 - PageTable::kernelSpaceStartEntry) * sizeof(uint64_t));
+    pcid = allocatePCID();
+    validCPUs = 0;
+}
+
+AddressSpace::~AddressSpace() {
+    if ((getCR3() & ~(pageSize - 1)) == level4Address) {
+        activateKernel();
+    }
+    PageTable::releaseUserSpace(level4Address);
+    PhysicalAllocator::freePhysicalMemory(level4Address, 1);
+    freePCID(pcid);
+}
+
+void AddressSpace::activate(bool keepTLB) {
+    InterruptGuard guard;
+    uint64_t cpu = 1ull << SMP::getIndex();
+    uint64_t cr3 = level4Address | pcid;
+    TLB::setActiveAddressSpace(this);// before validCPUs, so a concurrent shootdown either sees this cpu or clears its bit
+    // the tlb entries of a tag are only kept if this cpu flushed them since the tag was given to this address space
+    if (pcid != 0 && (__atomic_fetch_or(&validCPUs, cpu, __ATOMIC_SEQ_CST) & cpu) && keepTLB) {
+        cr3 |= cr3NoFlush;
+    }
+    setCR3(cr3);
+}
+
+void AddressSpace::invalidate() {
+    InterruptGuard guard;
+    bool active = (getCR3() & ~(pageSize - 1)) == level4Address;
+    // seq_cst, so the store is ordered before the shootdown loads the active address spaces of the other cpus
+    __atomic_exchange_n(&validCPUs, active ? 1ull << SMP::getIndex() : 0, __ATOMIC_SEQ_CST);
+}
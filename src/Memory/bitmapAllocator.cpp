@@ -0,0 +1,168 @@
+#include "Memory/frameAllocator.hpp"
+
+#ifdef PHYSICAL_ALLOCATOR_BITMAP
+
+#include "Common/Math.hpp"
+#include "LanguageFeatures/memory.hpp"
+
+// one bit per frame (set = free) and a two level summary on top of it
+// level 1 has two bits per bitmap word (word has a free frame, word is completely free)
+// level 2 has one bit per level 1 word (level 1 word has a bitmap word with a free frame)
+// contiguous runs are searched one 64 bit word at a time, the summaries skip used memory 4096 or 262144 frames at once
+static uint64_t frameCount;
+static uint64_t wordCount;
+static uint64_t level1Count;
+static uint64_t level2Count;
+static uint64_t* freeBits;
+static uint64_t* usableBits;// frames that are managed by the allocator at all
+static uint64_t* anyFreeWords;
+static uint64_t* fullFreeWords;
+static uint64_t* anyFreeGroups;
+
+static inline void setBit(uint64_t* bits, uint64_t index, bool value) {
+    if (value) {
+        bits[index / 64] |= 1ull << (index % 64);
+    } else {
+        bits[index / 64] &= ~(1ull << (index % 64));
+    }
+}
+
+static inline void updateSummary(uint64_t word) {
+    setBit(anyFreeWords, word, freeBits[word] != 0);
+    setBit(fullFreeWords, word, freeBits[word] == ~0ull);
+    setBit(anyFreeGroups, word / 64, anyFreeWords[word / 64] != 0);
+}
+
+/**
+ * @brief Returns the mask of the bits [frame, end) that are part of the word that contains frame.
+ */
+static inline uint64_t getMask(uint64_t frame, uint64_t end) {
+    uint64_t offset = frame % 64;
+    uint64_t length = min(end - frame, 64 - offset);
+    uint64_t mask = length == 64 ? ~0ull : ((1ull << length) - 1);
+    return mask << offset;
+}
+
+static void setFree(uint64_t frame, uint64_t count, bool free) {
+    uint64_t end = min(frame + count, frameCount);
+    while (frame < end) {
+        uint64_t word = frame / 64;
+        uint64_t mask = getMask(frame, end);
+        if (free) {
+            freeBits[word] |= mask & usableBits[word];
+        } else {
+            freeBits[word] &= ~mask;
+        }
+        updateSummary(word);
+        frame = (word + 1) * 64;
+    }
+}
+
+/**
+ * @brief Returns the first bitmap word at or after word that has a free frame or wordCount if there is none.
+ */
+static uint64_t findFreeWord(uint64_t word) {
+    if (word >= wordCount) {
+        return wordCount;
+    }
+    uint64_t group = word / 64;
+    uint64_t bits = anyFreeWords[group] & (~0ull << (word % 64));
+    if (bits) {
+        return group * 64 + __builtin_ctzll(bits);
+    }
+    group++;
+    while (group < level1Count) {
+        uint64_t groups = anyFreeGroups[group / 64] & (~0ull << (group % 64));
+        if (groups) {
+            group = (group / 64) * 64 + __builtin_ctzll(groups);
+            return group * 64 + __builtin_ctzll(anyFreeWords[group]);
+        }
+        group = (group / 64 + 1) * 64;
+    }
+    return wordCount;
+}
+
+/**
+ * @brief Returns the first frame at or after frame that is not free (at most limit).
+ */
+static uint64_t findRunEnd(uint64_t frame, uint64_t limit) {
+    limit = min(limit, frameCount);
+    while (frame < limit) {
+        uint64_t word = frame / 64;
+        if (frame % 64 == 0 && (fullFreeWords[word / 64] & (1ull << (word % 64)))) {
+            frame += 64;
+            continue;
+        }
+        uint64_t used = ~freeBits[word] & (~0ull << (frame % 64));
+        if (used) {
+            return min(word * 64 + __builtin_ctzll(used), limit);
+        }
+        frame = (word + 1) * 64;
+    }
+    return limit;
+}
+
+uint64_t FrameAllocator::getMetadataSize(uint64_t count) {
+    uint64_t words = (count + 63) / 64;
+    uint64_t level1 = (words + 63) / 64;
+    uint64_t level2 = (level1 + 63) / 64;
+    return (words * 2 + level1 * 2 + level2) * sizeof(uint64_t);
+}
+
+void FrameAllocator::init(uint64_t count, uint8_t* metadata) {
+    frameCount = count;
+    wordCount = (count + 63) / 64;
+    level1Count = (wordCount + 63) / 64;
+    level2Count = (level1Count + 63) / 64;
+    memset(metadata, 0, getMetadataSize(count));
+    freeBits = (uint64_t*) metadata;
+    usableBits = freeBits + wordCount;
+    anyFreeWords = usableBits + wordCount;
+    fullFreeWords = anyFreeWords + level1Count;
+    anyFreeGroups = fullFreeWords + level1Count;
+}
+
+void FrameAllocator::addFrames(uint64_t frame, uint64_t count) {
+    uint64_t end = min(frame + count, frameCount);
+    for (uint64_t current = frame; current < end; current = (current / 64 + 1) * 64) {
+        usableBits[current / 64] |= getMask(current, end);
+    }
+    setFree(frame, count, true);
+}
+
+uint64_t FrameAllocator::allocate(uint64_t count, uint64_t alignment) {
+    if (count == 0) {
+        return ~0ull;
+    }
+    uint64_t frame = 0;
+    while (frame < frameCount) {
+        uint64_t word = findFreeWord(frame / 64);
+        if (word >= wordCount) {
+            return ~0ull;
+        }
+        uint64_t start = max(frame, word * 64);
+        uint64_t bits = freeBits[start / 64] & (~0ull << (start % 64));
+        if (!bits) {
+            frame = (start / 64 + 1) * 64;
+            continue;
+        }
+        start = (start / 64) * 64 + __builtin_ctzll(bits);
+        uint64_t aligned = (start + alignment - 1) & ~(alignment - 1);
+        uint64_t end = findRunEnd(start, aligned + count);
+        if (end >= aligned + count) {
+            setFree(aligned, count, false);
+            return aligned;
+        }
+        frame = end;
+        if (frame == start) {
+            frame++;// should not happen, start is free
+        }
+    }
+    return ~0ull;
+}
+
+void FrameAllocator::free(uint64_t frame, uint64_t count) {
+    setFree(frame, count, true);
+}
+
+#endif
@@ -0,0 +1,171 @@
+#include "Memory/frameAllocator.hpp"
+
+#ifndef PHYSICAL_ALLOCATOR_BITMAP
+
+#include "LanguageFeatures/memory.hpp"
+#include "Memory/memory.hpp"
+#include "Memory/tempMapping.hpp"
+
+// free blocks of 2^order pages are kept in one doubly linked list per order, the list nodes are stored in the free memory itself
+// every frame has one byte of metadata, the first frame of a free block stores freeFlag | order
+// so the buddy of a block can be checked and unlinked in O(1) when it is freed
+// all other frames (allocated frames and the inner frames of free blocks) store usedFrame
+constexpr uint8_t maxOrder = 18;// 1Gi blocks
+constexpr uint8_t freeFlag = 0x80;
+constexpr uint8_t reservedFrame = 0xFF;// not managed by the allocator (unusable, kernel, ...)
+constexpr uint8_t usedFrame = 0x00;
+
+struct FreeBlock {
+    uint64_t nextPhysicalAddress;// 0 = end of list (page 0 is never managed)
+    uint64_t prevPhysicalAddress;
+};
+
+static uint64_t freeLists[maxOrder + 1];// physical address of the first free block of each order
+static uint64_t frameCount;
+static uint8_t* frameInfo;// one byte per frame
+
+static inline FreeBlock* getFreeBlock(uint64_t physicalAddress) {
+    return (FreeBlock*) TempMemory::mapPages(physicalAddress, 1, false);
+}
+
+static void pushFreeBlock(uint64_t frame, uint8_t order) {
+    uint64_t address = frame * pageSize;
+    FreeBlock* block = getFreeBlock(address);
+    block->prevPhysicalAddress = 0;
+    block->nextPhysicalAddress = freeLists[order];
+    if (freeLists[order]) {
+        getFreeBlock(freeLists[order])->prevPhysicalAddress = address;
+    }
+    freeLists[order] = address;
+    frameInfo[frame] = freeFlag | order;
+}
+
+static void removeFreeBlock(uint64_t frame, uint8_t order) {
+    uint64_t address = frame * pageSize;
+    FreeBlock* block = getFreeBlock(address);
+    if (block->prevPhysicalAddress) {
+        getFreeBlock(block->prevPhysicalAddress)->nextPhysicalAddress = block->nextPhysicalAddress;
+    } else {
+        freeLists[order] = block->nextPhysicalAddress;
+    }
+    if (block->nextPhysicalAddress) {
+        getFreeBlock(block->nextPhysicalAddress)->prevPhysicalAddress = block->prevPhysicalAddress;
+    }
+    frameInfo[frame] = usedFrame;
+}
+
+/**
+ * @brief Frees one naturally aligned block and merges it with its buddies.
+ */
+static void freeBlock(uint64_t frame, uint8_t order) {
+    while (order < maxOrder) {
+        uint64_t buddy = frame ^ (1ull << order);
+        if (buddy >= frameCount || frameInfo[buddy] != (freeFlag | order)) {
+            break;
+        }
+        removeFreeBlock(buddy, order);
+        frame &= ~(1ull << order);// the merged block starts at the lower buddy
+        order++;
+    }
+    pushFreeBlock(frame, order);
+}
+
+static inline uint8_t largestOrderAt(uint64_t frame, uint64_t count) {
+    uint8_t order = 0;
+    while (order < maxOrder && (frame & (1ull << order)) == 0 && (2ull << order) <= count) {
+        order++;
+    }
+    return order;
+}
+
+/**
+ * @brief Frees a range of frames by splitting it into the largest naturally aligned blocks.
+ * @note Reserved frames and the first frames of free blocks are skipped, a frame inside a free block is not recognized, so the range must not contain free frames.
+ */
+static void freeFrames(uint64_t frame, uint64_t count) {
+    uint64_t end = frame + count;
+    while (frame < end) {
+        if (frame >= frameCount) {
+            return;
+        }
+        uint8_t info = frameInfo[frame];
+        if (info == reservedFrame || (info & freeFlag)) {
+            frame++;// never free unmanaged memory, catches a block freed twice as a whole
+            continue;
+        }
+        uint8_t order = largestOrderAt(frame, end - frame);
+        freeBlock(frame, order);
+        frame += 1ull << order;
+    }
+}
+
+/**
+ * @brief Takes a free block of exactly the given order, splitting a larger block if needed.
+ * @return the first frame of the block or ~0 if there is no free block large enough.
+ */
+static uint64_t takeBlock(uint8_t order) {
+    uint8_t current = order;
+    while (current <= maxOrder && freeLists[current] == 0) {
+        current++;
+    }
+    if (current > maxOrder) {
+        return ~0ull;
+    }
+    uint64_t frame = freeLists[current] / pageSize;
+    removeFreeBlock(frame, current);
+    while (current > order) {
+        current--;
+        pushFreeBlock(frame + (1ull << current), current);// upper half stays free
+    }
+    return frame;
+}
+
+static inline uint8_t orderFor(uint64_t count) {
+    uint8_t order = 0;
+    while ((1ull << order) < count) {
+        order++;
+    }
+    return order;
+}
+
+uint64_t FrameAllocator::getMetadataSize(uint64_t frameCount) {
+    return frameCount;
+}
+
+void FrameAllocator::init(uint64_t count, uint8_t* metadata) {
+    frameCount = count;
+    frameInfo = metadata;
+    for (uint8_t i = 0; i <= maxOrder; ++i) {
+        freeLists[i] = 0;
+    }
+    memset(frameInfo, reservedFrame, frameCount);
+}
+
+void FrameAllocator::addFrames(uint64_t frame, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i) {
+        frameInfo[frame + i] = usedFrame;
+    }
+    freeFrames(frame, count);
+}
+
+uint64_t FrameAllocator::allocate(uint64_t count, uint64_t alignment) {
+    uint8_t order = orderFor(count > alignment ? count : alignment);
+    if (order > maxOrder) {
+        return ~0ull;
+    }
+    uint64_t frame = takeBlock(order);
+    if (frame == ~0ull) {
+        return ~0ull;
+    }
+    //give back the pages that were only needed for the power of two
+    if ((1ull << order) > count) {
+        freeFrames(frame + count, (1ull << order) - count);
+    }
+    return frame;
+}
+
+void FrameAllocator::free(uint64_t frame, uint64_t count) {
+    freeFrames(frame, count);
+}
+
+#endif
@@ -1,173 +1,482 @@
 #include "Memory/heap.hpp"
 #include "BasicOutput/Output.hpp"
+#include "CPUControl/smp.hpp"
+#include "CPUControl/spinlock.hpp"
 #include "Common/Units.hpp"
+#include "LanguageFeatures/memory.hpp"
 #include "Memory/memory.hpp"
 #include "Memory/pageTable.hpp"
 #include "Memory/physicalAllocator.hpp"
+#include "Memory/virtualAllocator.hpp"
 
-constexpr uint64_t kernelHeapStart = 80Ti;
+// small allocations are served from slabs, every slab is one page that only holds objects of one size class
+// large allocations get their own pages with a LargeHeader at the start
+// in both cases the header is at the start of the page that contains the pointer, so kfree finds it in O(1)
+constexpr uint64_t minSizeClassShift = 4;// 16 bytes
+constexpr uint64_t maxSizeClassShift = 10;// 1024 bytes
+constexpr uint64_t sizeClassCount = maxSizeClassShift - minSizeClassShift + 1;
+constexpr uint64_t maxCachedPages = 64;// empty slab pages kept mapped for reuse
 
-struct PointerData {
-    uint64_t size;       // stores the real size (requested + sizeof(PointerData))
-    uint64_t nextVirtual;// linked list forwared pointer
-    uint64_t prevVirtual;// linked list backward pointer
+// every cpu keeps two magazines (stacks of free objects) per size class in front of the slabs
+// full and empty magazines are exchanged with the depot, which moves objects from freeing to allocating cpus
+// only the depot and the slab layer are shared, so most kmalloc/kfree calls only touch cpu local data
+constexpr uint64_t magazineSize = 30;// rounds per magazine, makes a Magazine 256 bytes
+constexpr uint64_t maxDepotFull = 16;// full magazines per size class before the depot returns objects to the slabs
+constexpr uint64_t maxDepotEmpty = 16;
+
+constexpr uint32_t slabMagic = 0x51AB51AB;
+constexpr uint32_t largeMagic = 0x1A26E000;
+
+struct FreeObject {
+    FreeObject* next;
+};
+
+struct SlabHeader {
+    uint32_t magic;
+    uint32_t sizeClass;
+    uint32_t usedCount;
+    uint32_t capacity;
+    FreeObject* freeList;
+    SlabHeader* next;// partial list
+    SlabHeader* prev;
+    uint8_t pad[24];
+};
+static_assert(sizeof(SlabHeader) == 64, "SlabHeader is not 64 bytes");
+
+struct LargeHeader {
+    uint32_t magic;
+    uint32_t rsv;
+    uint64_t pageCount;
+};
+static_assert(sizeof(LargeHeader) == 16, "LargeHeader is not 16 bytes");
+
+struct CachedPage {
+    CachedPage* next;
 };
 
-PointerData dummy;
+struct Magazine {
+    Magazine* next;
+    uint64_t rounds;
+    void* objects[magazineSize];
+};
+static_assert(sizeof(Magazine) == 256, "Magazine is not 256 bytes");
+
+struct CPUCache {
+    Magazine* loaded;
+    Magazine* previous;
+};
+
+struct Depot {
+    SpinLock lock;
+    Magazine* full;
+    Magazine* empty;
+    uint64_t fullCount;
+    uint64_t emptyCount;
+} __attribute__((aligned(64)));
+
+static SlabHeader* partialSlabs[sizeClassCount];
+static CachedPage* cachedPages;
+static uint64_t cachedPageCount;
+static CachedPage* retiredPages;// slab pages that are unmapped after heapLock is released (unmapping waits for the other cpus)
+static SpinLock heapLock;// protects the slab layer and the heap pages
+
+static CPUCache cpuCaches[SMP::maxCPUCount][sizeClassCount];
+static Depot depots[sizeClassCount];
+
+static constexpr PageTable::Option heapPageOption = {
+        .writeEnable = true,
+        .userAvailable = false,
+        .memoryType = PageTable::MemoryType::WriteBack,
+        .executeDisable = false,
+};
 
 void initHeap() {
-    dummy.size = sizeof(PointerData);
-    dummy.nextVirtual = 0;
-    dummy.prevVirtual = 0;
+    for (uint64_t i = 0; i < sizeClassCount; ++i) {
+        partialSlabs[i] = nullptr;
+    }
+    cachedPages = nullptr;
+    cachedPageCount = 0;
+    retiredPages = nullptr;
+    memset(cpuCaches, 0, sizeof(cpuCaches));
+    memset(depots, 0, sizeof(depots));
 }
 
-void* kmalloc(uint64_t requestedSize) {
-    uint64_t realSize = requestedSize + sizeof(PointerData);
-    uint64_t pageCount = (realSize + pageSize - 1) / pageSize;// round up
-    PointerData* data = &dummy;
-    //try to fit the requested size in an allocated page
-    //need to iterate through the linked list of PointerData
-    while (data->nextVirtual != 0) {
-        data = (PointerData*) data->nextVirtual;
-        if (realSize > pageSize / 2)
-            continue;// only insert in allocated block if realSize is smaller than half of the page
-
-        uint64_t startOfThisBlock = ((uint64_t) data);
-        uint64_t endOfThisBlock = startOfThisBlock + data->size;
-        uint64_t endOfThisBlockPage = endOfThisBlock & ~(pageSize - 1);// the last page that is part of this block
-        // if next entry is in same page as the end of this block continue
-        if (data->nextVirtual > endOfThisBlockPage && data->nextVirtual < endOfThisBlockPage + pageSize)
-            continue;
-
-        uint64_t remainingSize = endOfThisBlockPage + pageSize - endOfThisBlock;
-        if (remainingSize > realSize) {
-            PointerData* newData = (PointerData*) endOfThisBlock;
-            newData->size = realSize;
-            newData->nextVirtual = data->nextVirtual;
-            newData->prevVirtual = (uint64_t) data;
-            if (data->nextVirtual != 0) {
-                PointerData* nextData = (PointerData*) data->nextVirtual;
-                nextData->prevVirtual = (uint64_t) newData;
-            }
-            data->nextVirtual = (uint64_t) newData;
-            return (void*) (endOfThisBlock + sizeof(PointerData));
+static inline uint64_t getSizeClass(uint64_t size) {
+    if (size <= (1ull << minSizeClassShift)) {
+        return 0;
+    }
+    return (64 - __builtin_clzll(size - 1)) - minSizeClassShift;// round up to the next power of two
+}
+
+constexpr uint64_t freeBatchSize = 32;
+
+/**
+ * @brief Unmaps heap pages and frees their memory, the memory is collected in batches so every batch is unmapped with one walk.
+ * @note The virtual range stays reserved.
+ */
+static void unmapHeapPages(uint64_t virtualBase, uint64_t count) {
+    uint64_t end = virtualBase + count * pageSize;
+    for (uint64_t batchStart = virtualBase; batchStart < end;) {
+        uint64_t physicalMemory[freeBatchSize];
+        uint64_t sizes[freeBatchSize];
+        uint64_t batchCount = 0;
+        uint64_t address = batchStart;
+        for (; address < end && batchCount < freeBatchSize; ++batchCount) {
+            sizes[batchCount] = (uint64_t) PageTable::getPageSize(address);
+            physicalMemory[batchCount] = PageTable::getPhysicalAddress(address);
+            address += sizes[batchCount];
         }
+        PageTable::unmapRange(batchStart, address - batchStart);
+        for (uint64_t i = 0; i < batchCount; ++i) {
+            PhysicalAllocator::freePhysicalMemory(physicalMemory[i], sizes[i] / pageSize);
+        }
+        batchStart = address;
     }
-    //only reached if we are at the end of the linked list
-    //allocate a new page and find the needed pages of virtual memory
-    uint64_t physicalMemory = PhysicalAllocator::allocatePhysicalMemory(pageCount);
-    if (physicalMemory == ~0ull)
-        return nullptr;
-    data = &dummy;
-    while (data->nextVirtual != 0) {
-        data = (PointerData*) data->nextVirtual;
-        if (data->nextVirtual == 0) {
-            break;
+}
+
+static void freeHeapPages(uint64_t virtualBase, uint64_t count) {
+    unmapHeapPages(virtualBase, count);
+    VirtualAllocator::release(virtualBase, count);
+}
+
+/**
+ * @brief Maps count new pages into the heap.
+ * @return the virtual address of the first page or 0 if there is no virtual or physical memory left.
+ * @note The pages are only virtually contiguous, allocations of at least 2Mi are 2Mi aligned and use 2Mi pages where the physical memory allows it.
+ * @note Must not be called with heapLock held, mapping may shoot down tlb entries and wait for the other cpus.
+ */
+static uint64_t allocateHeapPages(uint64_t count) {
+    uint64_t alignment = count * pageSize >= 2Mi ? 2Mi : pageSize;
+    uint64_t virtualBase = VirtualAllocator::reserve(count, alignment);
+    if (virtualBase == 0) {
+        return 0;
+    }
+    uint64_t end = virtualBase + count * pageSize;
+    for (uint64_t address = virtualBase; address < end;) {
+        uint64_t size = address % 2Mi == 0 && end - address >= 2Mi ? 2Mi : pageSize;
+        uint64_t physicalMemory = PhysicalAllocator::tryAllocatePhysicalMemory(size / pageSize, size);
+        if (physicalMemory == 0 && size != pageSize) {
+            size = pageSize;// no free 2Mi block, this part uses single frames
+            physicalMemory = PhysicalAllocator::tryAllocatePhysicalMemory(1);
         }
-        uint64_t startOfThisBlock = ((uint64_t) data);
-        uint64_t endOfThisBlock = startOfThisBlock + data->size;
-        uint64_t lastUsedPageIndex = (endOfThisBlock + pageSize - 1) / pageSize;// for example 45
-        uint64_t startOfNextBlockPageIndex = data->nextVirtual / pageSize;      // for example 60
-        uint64_t unusedPages = startOfNextBlockPageIndex - lastUsedPageIndex;   // should be 15
-        if (unusedPages >= pageCount) {
-            // we can fit the requested size in the current block
-
-            // map the needed pages of virtual memory
-            uint64_t virtualBase = lastUsedPageIndex * pageSize;
-            for (uint64_t i = 0; i < pageCount; i++) {
-                uint64_t virtualPage = virtualBase + i * pageSize;
-                uint64_t physicalPage = physicalMemory + i * pageSize;
-                PageTable::map(physicalPage, (void*) virtualPage, {
-                                                                          .writeEnable = true,
-                                                                          .userAvailable = false,
-                                                                          .writeThrough = false,
-                                                                          .cacheDisable = false,
-                                                                          .executeDisable = false,
-                                                                  });
-            }
-            PointerData* newData = (PointerData*) virtualBase;
-            newData->size = realSize;
-            newData->nextVirtual = data->nextVirtual;
-            newData->prevVirtual = (uint64_t) data;
-            if (data->nextVirtual != 0) {
-                PointerData* nextData = (PointerData*) data->nextVirtual;
-                nextData->prevVirtual = (uint64_t) newData;
-            }
-            data->nextVirtual = (uint64_t) newData;
-            return (void*) (virtualBase + sizeof(PointerData));
+        if (physicalMemory == 0) {
+            unmapHeapPages(virtualBase, (address - virtualBase) / pageSize);
+            VirtualAllocator::release(virtualBase, count);
+            return 0;
         }
+        PageTable::mapRange(physicalMemory, (void*) address, size, heapPageOption);
+        address += size;
     }
-    //there is not enough virtual memory between the allready allocated pointers
-    //we need to allocate virtual memory behind the last pointer
-    uint64_t virtualBase = ((uint64_t) data + data->size + pageSize - 1) & ~(pageSize - 1);
-    if (data == &dummy) {
-        virtualBase = kernelHeapStart;
-    }
-    for (uint64_t i = 0; i < pageCount; i++) {
-        uint64_t virtualPage = virtualBase + i * pageSize;
-        uint64_t physicalPage = physicalMemory + i * pageSize;
-        PageTable::map(physicalPage, (void*) virtualPage, {
-                                                                  .writeEnable = true,
-                                                                  .userAvailable = false,
-                                                                  .writeThrough = false,
-                                                                  .cacheDisable = false,
-                                                                  .executeDisable = false,
-                                                          });
-    }
-    PointerData* newData = (PointerData*) virtualBase;
-    newData->size = realSize;
-    newData->nextVirtual = 0;
-    newData->prevVirtual = (uint64_t) data;
-    data->nextVirtual = (uint64_t) newData;
-    return (void*) (virtualBase + sizeof(PointerData));
+    return virtualBase;
 }
-void kfree(void* ptr) {
-    PointerData* data = (PointerData*) ((uint64_t) ptr - sizeof(PointerData));
-    if (data->nextVirtual == 0 && data->prevVirtual == 0) {
+
+static uint64_t takeSlabPage() {
+    if (cachedPages) {
+        CachedPage* page = cachedPages;
+        cachedPages = page->next;
+        cachedPageCount--;
+        return (uint64_t) page;
+    }
+    return 0;// mapped by allocateObject without heapLock
+}
+
+static void releaseSlabPage(uint64_t page) {
+    CachedPage* cached = (CachedPage*) page;
+    if (cachedPageCount >= maxCachedPages) {
+        cached->next = retiredPages;
+        retiredPages = cached;
         return;
     }
-    uint64_t startOfThisBlock = ((uint64_t) data);
-    uint64_t endOfThisBlock = startOfThisBlock + data->size;
-    uint64_t extendedEndOfThisBlock = (endOfThisBlock | (pageSize - 1)) + 1;        // example: (0x1555 | 0xfff) + 1 = 0x1fff + 1 = 0x2000
-    uint64_t pageStartOfThisBlock = startOfThisBlock & ~(pageSize - 1);             // example: 0x1000
-    uint64_t pageCount = (extendedEndOfThisBlock - pageStartOfThisBlock) / pageSize;// example: 0x2000 - 0x1000 = 0x1000 / 0x1000 = 0x1
-    bool endPageUsed = false;
-    bool beginPageUsed = false;
-    if (data->nextVirtual != 0) {
-        if (data->nextVirtual < extendedEndOfThisBlock && data->nextVirtual >= extendedEndOfThisBlock - pageSize) {
-            endPageUsed = true;
+    cached->next = cachedPages;
+    cachedPages = cached;
+    cachedPageCount++;
+}
+
+static void removePartial(SlabHeader* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        partialSlabs[slab->sizeClass] = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = nullptr;
+    slab->prev = nullptr;
+}
+
+static void pushPartial(SlabHeader* slab) {
+    slab->prev = nullptr;
+    slab->next = partialSlabs[slab->sizeClass];
+    if (slab->next) {
+        slab->next->prev = slab;
+    }
+    partialSlabs[slab->sizeClass] = slab;
+}
+
+static SlabHeader* createSlab(uint64_t sizeClass) {
+    uint64_t page = takeSlabPage();
+    if (page == 0) {
+        return nullptr;
+    }
+    uint64_t objectSize = 1ull << (sizeClass + minSizeClassShift);
+    SlabHeader* slab = (SlabHeader*) page;
+    slab->magic = slabMagic;
+    slab->sizeClass = sizeClass;
+    slab->usedCount = 0;
+    slab->capacity = (pageSize - sizeof(SlabHeader)) / objectSize;
+    slab->freeList = nullptr;
+    //build the free list back to front so objects are handed out in address order
+    for (uint64_t i = slab->capacity; i > 0; --i) {
+        FreeObject* object = (FreeObject*) (page + sizeof(SlabHeader) + (i - 1) * objectSize);
+        object->next = slab->freeList;
+        slab->freeList = object;
+    }
+    pushPartial(slab);
+    return slab;
+}
+
+static void* allocateLarge(uint64_t requestedSize) {
+    uint64_t pageCount = (requestedSize + sizeof(LargeHeader) + pageSize - 1) / pageSize;// round up
+    uint64_t virtualBase = allocateHeapPages(pageCount);
+    if (virtualBase == 0) {
+        return nullptr;
+    }
+    LargeHeader* header = (LargeHeader*) virtualBase;
+    header->magic = largeMagic;
+    header->pageCount = pageCount;
+    return (void*) (virtualBase + sizeof(LargeHeader));
+}
+
+static void* slabAllocate(uint64_t sizeClass) {
+    SlabHeader* slab = partialSlabs[sizeClass];
+    if (slab == nullptr) {
+        slab = createSlab(sizeClass);
+        if (slab == nullptr) {
+            return nullptr;
+        }
+    }
+    FreeObject* object = slab->freeList;
+    slab->freeList = object->next;
+    slab->usedCount++;
+    if (slab->usedCount == slab->capacity) {
+        removePartial(slab);// slab is full
+    }
+    return object;
+}
+
+static void slabFree(SlabHeader* slab, void* ptr) {
+    bool wasFull = slab->usedCount == slab->capacity;
+    FreeObject* object = (FreeObject*) ptr;
+    object->next = slab->freeList;
+    slab->freeList = object;
+    slab->usedCount--;
+    if (wasFull) {
+        pushPartial(slab);
+    }
+    //give the page back if it is empty and not the only slab of its size class
+    if (slab->usedCount == 0 && (slab->next || slab->prev)) {
+        removePartial(slab);
+        slab->magic = 0;
+        releaseSlabPage((uint64_t) slab);
+    }
+}
+
+static inline SlabHeader* getSlab(void* ptr) {
+    return (SlabHeader*) (((uint64_t) ptr) & ~(pageSize - 1));
+}
+
+/**
+ * @brief Allocates an object from the slabs, a missing slab page is mapped without heapLock.
+ */
+static void* allocateObject(uint64_t sizeClass) {
+    while (true) {
+        {
+            SpinLockGuard guard(heapLock);
+            void* object = slabAllocate(sizeClass);
+            if (object) {
+                return object;
+            }
+        }
+        uint64_t page = allocateHeapPages(1);
+        if (page == 0) {
+            return nullptr;
         }
+        SpinLockGuard guard(heapLock);
+        CachedPage* cached = (CachedPage*) page;
+        cached->next = cachedPages;
+        cachedPages = cached;
+        cachedPageCount++;
     }
-    if (data->prevVirtual < startOfThisBlock + pageSize && data->prevVirtual >= startOfThisBlock) {
-        beginPageUsed = true;
+}
+
+static Magazine* allocateMagazine() {
+    Magazine* magazine = (Magazine*) allocateObject(getSizeClass(sizeof(Magazine)));
+    if (magazine) {
+        magazine->next = nullptr;
+        magazine->rounds = 0;
+    }
+    return magazine;
+}
+
+static void freeMagazine(Magazine* magazine) {
+    SpinLockGuard guard(heapLock);
+    slabFree(getSlab(magazine), magazine);
+}
+
+/**
+ * @brief Returns all objects of the magazine to their slabs, the magazine is empty afterwards.
+ */
+static void drainMagazine(Magazine* magazine) {
+    SpinLockGuard guard(heapLock);
+    for (uint64_t i = 0; i < magazine->rounds; ++i) {
+        slabFree(getSlab(magazine->objects[i]), magazine->objects[i]);
     }
+    magazine->rounds = 0;
+}
 
-    //remove data from linked list
-    if (data->nextVirtual) {
-        PointerData* nextData = (PointerData*) data->nextVirtual;
-        nextData->prevVirtual = data->prevVirtual;
+static Magazine* depotTakeFull(Depot& depot) {
+    SpinLockGuard guard(depot.lock);
+    Magazine* magazine = depot.full;
+    if (magazine) {
+        depot.full = magazine->next;
+        depot.fullCount--;
     }
-    if (data->prevVirtual) {
-        PointerData* prevData = (PointerData*) data->prevVirtual;
-        prevData->nextVirtual = data->nextVirtual;
+    return magazine;
+}
+
+static Magazine* depotTakeEmpty(Depot& depot) {
+    SpinLockGuard guard(depot.lock);
+    Magazine* magazine = depot.empty;
+    if (magazine) {
+        depot.empty = magazine->next;
+        depot.emptyCount--;
     }
-    data->nextVirtual = 0;
-    data->prevVirtual = 0;
+    return magazine;
+}
 
-    if (pageCount == 1) {
-        if (!endPageUsed && !beginPageUsed) {
-            PhysicalAllocator::freePhysicalMemory(pageStartOfThisBlock, 1);
+static void depotPutEmpty(Depot& depot, Magazine* magazine) {
+    {
+        SpinLockGuard guard(depot.lock);
+        if (depot.emptyCount < maxDepotEmpty) {
+            magazine->next = depot.empty;
+            depot.empty = magazine;
+            depot.emptyCount++;
+            return;
         }
-    } else {
-        uint64_t start = pageStartOfThisBlock + pageSize;
-        uint64_t count = pageCount - 2;
-        if (!beginPageUsed) {
-            start -= pageSize;
-            count += 1;
+    }
+    freeMagazine(magazine);
+}
+
+static void depotPutFull(Depot& depot, Magazine* magazine) {
+    {
+        SpinLockGuard guard(depot.lock);
+        if (depot.fullCount < maxDepotFull) {
+            magazine->next = depot.full;
+            depot.full = magazine;
+            depot.fullCount++;
+            return;
         }
-        if (!endPageUsed) {
-            count += 1;
+    }
+    //the depot holds enough objects, give them back to the slabs
+    drainMagazine(magazine);
+    depotPutEmpty(depot, magazine);
+}
+
+static void* cacheAllocate(uint64_t sizeClass) {
+    InterruptGuard interruptGuard;// the cpu cache must not be changed by an interrupt handler
+    CPUCache& cache = cpuCaches[SMP::getIndex()][sizeClass];
+    if (cache.loaded && cache.loaded->rounds > 0) {
+        return cache.loaded->objects[--cache.loaded->rounds];
+    }
+    if (cache.previous && cache.previous->rounds > 0) {
+        Magazine* magazine = cache.previous;
+        cache.previous = cache.loaded;
+        cache.loaded = magazine;
+        return cache.loaded->objects[--cache.loaded->rounds];
+    }
+    Magazine* full = depotTakeFull(depots[sizeClass]);
+    if (full) {
+        if (cache.previous) {
+            depotPutEmpty(depots[sizeClass], cache.previous);
         }
-        PhysicalAllocator::freePhysicalMemory(start, count);
+        cache.previous = cache.loaded;
+        cache.loaded = full;
+        return cache.loaded->objects[--cache.loaded->rounds];
     }
-}
\ No newline at end of file
+    return allocateObject(sizeClass);
+}
+
+static void cacheFree(uint64_t sizeClass, void* ptr) {
+    InterruptGuard interruptGuard;
+    CPUCache& cache = cpuCaches[SMP::getIndex()][sizeClass];
+    if (cache.loaded && cache.loaded->rounds < magazineSize) {
+        cache.loaded->objects[cache.loaded->rounds++] = ptr;
+        return;
+    }
+    if (cache.previous && cache.previous->rounds == 0) {
+        Magazine* magazine = cache.previous;
+        cache.previous = cache.loaded;
+        cache.loaded = magazine;
+        cache.loaded->objects[cache.loaded->rounds++] = ptr;
+        return;
+    }
+    Magazine* empty = depotTakeEmpty(depots[sizeClass]);
+    if (empty == nullptr) {
+        empty = allocateMagazine();
+    }
+    if (empty == nullptr) {
+        SpinLockGuard guard(heapLock);
+        slabFree(getSlab(ptr), ptr);
+        return;
+    }
+    if (cache.previous) {
+        depotPutFull(depots[sizeClass], cache.previous);
+    }
+    cache.previous = cache.loaded;
+    cache.loaded = empty;
+    cache.loaded->objects[cache.loaded->rounds++] = ptr;
+}
+
+static void freeRetiredPages() {
+    CachedPage* pages;
+    {
+        SpinLockGuard guard(heapLock);
+        pages = retiredPages;
+        retiredPages = nullptr;
+    }
+    while (pages) {
+        CachedPage* next = pages->next;
+        freeHeapPages((uint64_t) pages, 1);
+        pages = next;
+    }
+}
+
+void* kmalloc(uint64_t requestedSize) {
+    if (requestedSize > (1ull << maxSizeClassShift)) {
+        return allocateLarge(requestedSize);// the pages belong to this allocation only, so this needs no lock
+    }
+    return cacheAllocate(getSizeClass(requestedSize));
+}
+
+void kfree(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    uint64_t page = ((uint64_t) ptr) & ~(pageSize - 1);
+    uint32_t magic = *(uint32_t*) page;
+    if (magic == largeMagic) {
+        LargeHeader* header = (LargeHeader*) page;
+        header->magic = 0;
+        freeHeapPages(page, header->pageCount);// the range is only handed out again after it is unmapped, so this needs no lock
+        return;
+    }
+    if (magic != slabMagic) {
+        Output::getDefault()->printf("kfree: invalid pointer %p\n", ptr);
+        return;
+    }
+    cacheFree(getSlab(ptr)->sizeClass, ptr);
+    if (__atomic_load_n(&retiredPages, __ATOMIC_RELAXED)) {
+        freeRetiredPages();
+    }
+}
@@ -1,12 +1,14 @@
 #include "Memory/pageTable.hpp"
 #include "BasicOutput/Output.hpp"
 #include "CPUControl/cpu.hpp"
+#include "Common/Math.hpp"
 #include "Common/Symbols.hpp"
 #include "Common/Units.hpp"
 #include "LanguageFeatures/memory.hpp"
 #include "Memory/memory.hpp"
 #include "Memory/physicalAllocator.hpp"
 #include "Memory/tempMapping.hpp"
+#include "Memory/tlb.hpp"
 
 struct PageEntry {
     union {
@@ -53,8 +55,21 @@ struct PagingAddress {
 
 static_assert(sizeof(PagingPage) == pageSize, "PagingPage size is not pageSize");
 
-static uint64_t virtualLevel4Address;
 static bool inInit;// use physical address in init
+static bool patSupported;
+static bool hugePageSupported;// 1Gi pages
+
+constexpr uint64_t pageEntryAddressMask = 0x000FFFFFFFFFF000ull;
+
+static inline bool isKernelAddress(uint64_t virtualAddress) {
+    return ((virtualAddress >> 39) & 0x1FF) >= PageTable::kernelSpaceStartEntry;
+}
+constexpr uint64_t bigPagePAT = 1ull << 12;// the pat bit of 2Mi and 1Gi entries
+
+constexpr uint32_t patMSR = 0x277;
+// PA0 - PA3 keep the power on defaults (WB, WT, UC-, UC) so the pwt and pcd bits mean the same as without PAT
+// PA4 is write combining, PA5 - PA7 repeat the defaults
+constexpr uint64_t patValue = 0x00'07'04'01'00'07'04'06ull;
 
 alignas(4096) static char pagingInitPageBuffer[4096 * 6]{};
 static uint8_t pagingInitPageIndex;
@@ -67,10 +82,10 @@ static PagingPage* allocatePage() {
             stop();
         }
         page = (PagingPage*) (((uint64_t) pagingInitPageBuffer) + (pagingInitPageIndex++) * pageSize);
+        memset(page, 0, pageSize);
     } else {
-        page = (PagingPage*) TempMemory::mapPages(PhysicalAllocator::allocatePhysicalMemory(1), 1, false);
+        page = (PagingPage*) TempMemory::mapPages(PhysicalAllocator::allocatePhysicalMemory(1, pageSize, PhysicalAllocator::Flags::Zeroed), 1, false);
     }
-    memset(page, 0, pageSize);
     return page;
 }
 
@@ -79,7 +94,7 @@ static PagingPage* getLevel4Page() {
         uint64_t address = getCR3();
         return (PagingPage*) address;
     }
-    return (PagingPage*) virtualLevel4Address;
+    return (PagingPage*) TempMemory::mapPages(getCR3() & pageEntryAddressMask, 1, false);// the active address space
 }
 
 static PagingPage* getLinkedPage(PageEntry& entry, bool allocating) {
@@ -95,7 +110,6 @@ static PagingPage* getLinkedPage(PageEntry& entry, bool allocating) {
             PagingPage* page = allocatePage();
             *((uint64_t*) &page) &= ~(pageSize - 1);// shouldn't be necessary
             uint64_t physical = PageTable::getPhysicalAddress((uint64_t) page);
-            memset(page, 0, sizeof(PagingPage));
             entry.raw = (uint64_t) physical;
             entry.present = true;
             entry.executeDisable = false;
@@ -118,25 +132,22 @@ static PagingPage* getLinkedPage(PageEntry& entry, bool allocating) {
     }
 }
 
-void PageTable::init() {
-    uint64_t level4Address = getCR3();
-    //map level 4 page to virtual
-    inInit = true;
-    virtualLevel4Address = level4Address + 96Ti;
-    memset(pagingInitPageBuffer, 0, sizeof(pagingInitPageBuffer));
-    // map 0 - 512Gi to 96Ti - 96.5Ti
-    PagingAddress baseAddress;
-    baseAddress.pointer = (void*) 96Ti;
-    PagingPage* level4Page = (PagingPage*) level4Address;
-    PagingPage* level3Page = getLinkedPage(level4Page->entries[baseAddress.level4], true);
+/**
+ * @brief Maps 0 - 512Gi with 1Gi pages to baseAddress (only used in init).
+ * @param uncached whether the mapping is uncached (for memory mapped io) or write back.
+ */
+static void mapDirectRegion(PagingPage* level4Page, uint64_t baseAddress, bool uncached) {
+    PagingAddress address;
+    address.pointer = (void*) baseAddress;
+    PagingPage* level3Page = getLinkedPage(level4Page->entries[address.level4], true);
     for (uint64_t i = 0; i < 512; ++i) {
         level3Page->entries[i].raw = 1Gi * i;
         level3Page->entries[i].bigPage = true;// 1Gi page
         level3Page->entries[i].present = true;
         level3Page->entries[i].writeEnable = true;
         level3Page->entries[i].userModeEnable = false;
-        level3Page->entries[i].writeThrough = true;
-        level3Page->entries[i].cacheDisable = true;
+        level3Page->entries[i].writeThrough = uncached;
+        level3Page->entries[i].cacheDisable = uncached;
         level3Page->entries[i].dirty = false;
         level3Page->entries[i].accessed = false;
         level3Page->entries[i].global = false;
@@ -144,57 +155,411 @@ void PageTable::init() {
         level3Page->entries[i].available2 = 0;
         level3Page->entries[i].protectionKey = 0;
         level3Page->entries[i].executeDisable = false;
-        invalidatePage(96Ti + (1Gi * i));
+        invalidatePage(baseAddress + (1Gi * i));
+    }
+}
+
+void PageTable::initPAT() {
+    uint64_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    patSupported = d & (1 << 16);
+    if (patSupported) {
+        writeMSR(patMSR, patValue);
+        asm volatile("wbinvd" ::
+                             : "memory");
     }
+}
+
+void PageTable::init() {
+    initPAT();
+    uint64_t a, b, c, d;
+    cpuid(0x80000001, &a, &b, &c, &d);
+    hugePageSupported = d & (1 << 26);
+    uint64_t level4Address = getCR3();
+    //map level 4 page to virtual
+    inInit = true;
+    memset(pagingInitPageBuffer, 0, sizeof(pagingInitPageBuffer));
+    PagingPage* level4Page = (PagingPage*) level4Address;
+    // map 0 - 512Gi to 96Ti - 96.5Ti (write back, used for ram)
+    mapDirectRegion(level4Page, 96Ti, false);
+    // map 0 - 512Gi to 97Ti - 97.5Ti (uncached, used for memory mapped io)
+    mapDirectRegion(level4Page, 97Ti, true);
     inInit = false;
 }
 
-void PageTable::unmap(uint64_t virtualAddress) {
+/**
+ * @brief Frees the paging structures below entry, no tlb may use them anymore.
+ * @param level the level of the page entry points to.
+ */
+static void freeLinkedPages(PageEntry& entry, uint8_t level) {
+    if (!entry.present || entry.bigPage) {
+        return;
+    }
+    if (level > 1) {
+        PagingPage* page = getLinkedPage(entry, false);
+        for (uint64_t i = 0; i < 512; ++i) {
+            freeLinkedPages(page->entries[i], level - 1);
+        }
+    }
+    PhysicalAllocator::freePhysicalMemory(entry.encAddress << 12, 1);
+    entry.present = false;
+}
+
+/**
+ * @brief Replaces a big page with a page of 512 entries that map the same memory.
+ * @param childSize the size of the new entries (2Mi for a 1Gi page, 4Ki for a 2Mi page).
+ */
+static void splitBigPage(PageEntry& entry, uint64_t childSize) {
+    if (!entry.present || !entry.bigPage) {
+        return;
+    }
+    PageEntry big = entry;
+    uint64_t pat = big.raw & bigPagePAT;
+    uint64_t base = big.raw & pageEntryAddressMask & ~bigPagePAT;
+    uint64_t flags = big.raw & ~pageEntryAddressMask & ~(1ull << 7);
+    entry.present = false;
+    PagingPage* page = getLinkedPage(entry, true);
+    for (uint64_t i = 0; i < 512; ++i) {
+        PageEntry& child = page->entries[i];
+        child.raw = flags | (base + i * childSize);
+        if (childSize == pageSize) {
+            child.bigPage = pat != 0;// the pat bit in a level 1 entry
+        } else {
+            child.bigPage = true;
+            child.raw |= pat;
+        }
+    }
+}
+
+/**
+ * @brief Writes a leaf entry.
+ * @param big whether the entry is a 2Mi or 1Gi page.
+ */
+static void setLeafEntry(PageEntry& entry, uint64_t physicalAddress, uint64_t virtualAddress, PageTable::Option option, bool big) {
+    option.executeDisable = false;//TODO check if execute disable is supported and enable it else disable executeDisable
+    uint8_t patIndex = (uint8_t) option.memoryType;
+    if (!patSupported && patIndex >= 4) {
+        patIndex = (uint8_t) PageTable::MemoryType::UncachedMinus;
+    }
+    bool pat = (patIndex >> 2) & 0b1;
+
+    entry.raw = physicalAddress & ~(pageSize - 1);
+    entry.writeEnable = option.writeEnable;
+    entry.userModeEnable = option.userAvailable;
+    entry.writeThrough = patIndex & 0b1;
+    entry.cacheDisable = (patIndex >> 1) & 0b1;
+    entry.executeDisable = option.executeDisable;
+    entry.present = true;
+    entry.dirty = false;
+    entry.accessed = false;
+    entry.bigPage = big || pat;// the pat bit in a level 1 entry
+    entry.global = isKernelAddress(virtualAddress) && !option.userAvailable;// shared by all address spaces
+    entry.zero = 0;
+    entry.available1 = 0;
+    entry.protectionKey = 0;
+    entry.available2 = 0;
+    if (big && pat) {
+        entry.raw |= bigPagePAT;
+    }
+}
+
+/**
+ * @brief Remembers the paging structures of the last walk, so a range only walks again when it crosses into another structure.
+ */
+struct WalkCursor {
+    uint64_t level3Tag = ~0ull;// virtual address >> 39 of level3Page
+    uint64_t level2Tag = ~0ull;// virtual address >> 30 of level2Page
+    uint64_t level1Tag = ~0ull;// virtual address >> 21 of level1Page
+    PagingPage* level3Page = nullptr;
+    PagingPage* level2Page = nullptr;
+    PagingPage* level1Page = nullptr;
+
+    PagingPage* getLevel3(uint64_t virtualAddress, bool allocating) {
+        if (level3Tag != virtualAddress >> 39) {
+            PagingAddress address;
+            address.pointer = (void*) virtualAddress;
+            level3Page = getLinkedPage(getLevel4Page()->entries[address.level4], allocating);
+            level3Tag = level3Page ? virtualAddress >> 39 : ~0ull;
+            level2Tag = ~0ull;
+            level1Tag = ~0ull;
+        }
+        return level3Page;
+    }
+
+    PagingPage* getLevel2(uint64_t virtualAddress, bool allocating) {
+        if (level2Tag != virtualAddress >> 30) {
+            PagingAddress address;
+            address.pointer = (void*) virtualAddress;
+            PagingPage* level3 = getLevel3(virtualAddress, allocating);
+            if (!level3) {
+                return nullptr;
+            }
+            PageEntry& entry = level3->entries[address.level3];
+            if (allocating) {
+                splitBigPage(entry, 2Mi);
+            } else if (entry.bigPage) {
+                return nullptr;
+            }
+            level2Page = getLinkedPage(entry, allocating);
+            level2Tag = level2Page ? virtualAddress >> 30 : ~0ull;
+            level1Tag = ~0ull;
+        }
+        return level2Page;
+    }
+
+    PagingPage* getLevel1(uint64_t virtualAddress, bool allocating) {
+        if (level1Tag != virtualAddress >> 21) {
+            PagingAddress address;
+            address.pointer = (void*) virtualAddress;
+            PagingPage* level2 = getLevel2(virtualAddress, allocating);
+            if (!level2) {
+                return nullptr;
+            }
+            PageEntry& entry = level2->entries[address.level2];
+            if (allocating) {
+                splitBigPage(entry, pageSize);
+            } else if (entry.bigPage) {
+                return nullptr;
+            }
+            level1Page = getLinkedPage(entry, allocating);
+            level1Tag = level1Page ? virtualAddress >> 21 : ~0ull;
+        }
+        return level1Page;
+    }
+
+    // a big page replaced the structures below level 3 or level 2
+    void invalidateBelow(uint8_t level) {
+        if (level >= 3) {
+            level2Tag = ~0ull;
+        }
+        level1Tag = ~0ull;
+    }
+};
+
+constexpr uint64_t flushAllThreshold = TLB::maxAddresses;// more changed entries reload cr3 instead of using invlpg for every entry
+
+/**
+ * @brief Collects the changed entries of a range and flushes the tlb once at the end (on all cpus that can cache them).
+ */
+struct FlushBatch {
+    uint64_t count = 0;
+    bool global = false;// kernel entries are global and survive a cr3 reload
+    uint64_t addresses[flushAllThreshold];
+
+    void add(uint64_t virtualAddress) {
+        if (count < flushAllThreshold) {
+            addresses[count] = virtualAddress;
+        }
+        global |= isKernelAddress(virtualAddress);
+        count++;
+    }
+
+    // the change is not limited to one page (a big page replaced paging structures), so everything is flushed
+    void addAll(uint64_t virtualAddress) {
+        global |= isKernelAddress(virtualAddress);
+        count = flushAllThreshold + 1;
+    }
+
+    void flush() {
+        if (count > flushAllThreshold && global) {
+            uint64_t cr4 = getCR4();
+            setCR4(cr4 & ~(1ull << 7));// toggling global pages flushes everything
+            setCR4(cr4);
+        } else if (count > flushAllThreshold) {
+            setCR3(getCR3());
+        } else {
+            for (uint64_t i = 0; i < count; ++i) {
+                invalidatePage(addresses[i]);
+            }
+        }
+        TLB::shootdown(addresses, count, global);
+        count = 0;
+    }
+};
+
+/**
+ * @brief Replaces an entry with a big page, paging structures below it are freed once no tlb can use them anymore.
+ * @param level the level of the paging structure the entry points to.
+ * @return true if the entry was a present leaf before (then the tlb has to be flushed).
+ */
+static bool replaceWithBigPage(PageEntry& entry, uint8_t level, FlushBatch& batch, uint64_t physicalAddress, uint64_t virtualAddress,
+                               PageTable::Option option) {
+    PageEntry old = entry;
+    setLeafEntry(entry, physicalAddress, virtualAddress, option, true);
+    if (!old.present || old.bigPage) {
+        return old.present;
+    }
+    // every page below the entry and the cached paging structures may be stale, they are flushed before the structures are reused
+    batch.addAll(virtualAddress);
+    batch.flush();
+    freeLinkedPages(old, level);
+    return false;
+}
+
+/**
+ * @brief Writes one leaf entry of the given size, the tlb is only flushed if paging structures below the entry are replaced.
+ * @return true if the entry was present before (then the tlb has to be flushed).
+ */
+static bool mapEntry(WalkCursor& cursor, FlushBatch& batch, uint64_t physicalAddress, uint64_t virtualAddress, PageTable::PageSize size,
+                     PageTable::Option option) {
     PagingAddress address;
     address.pointer = (void*) virtualAddress;
-    PagingPage* level4Page = getLevel4Page();
-    PagingPage* level3Page = getLinkedPage(level4Page->entries[address.level4], false);
-    if (!level3Page) { return; }
-    if (level3Page->entries[address.level3].bigPage) {
-        level3Page->entries[address.level3].present = false;
+    if (size == PageTable::PageSize::Size1Gi) {
+        PageEntry& entry = cursor.getLevel3(virtualAddress, true)->entries[address.level3];
+        cursor.invalidateBelow(3);
+        return replaceWithBigPage(entry, 2, batch, physicalAddress, virtualAddress, option);
     }
-    PagingPage* level2Page = getLinkedPage(level3Page->entries[address.level3], false);
-    if (!level2Page) { return; }
-    if (level2Page->entries[address.level2].bigPage) {
-        level2Page->entries[address.level2].present = false;
+    if (size == PageTable::PageSize::Size2Mi) {
+        PageEntry& entry = cursor.getLevel2(virtualAddress, true)->entries[address.level2];
+        cursor.invalidateBelow(2);
+        return replaceWithBigPage(entry, 1, batch, physicalAddress, virtualAddress, option);
     }
-    PagingPage* level1Page = getLinkedPage(level2Page->entries[address.level2], false);
-    if (!level1Page) { return; }
-    level1Page->entries[address.level1].present = false;
+    PageEntry& entry = cursor.getLevel1(virtualAddress, true)->entries[address.level1];
+    bool present = entry.present;
+    setLeafEntry(entry, physicalAddress, virtualAddress, option, false);
+    return present;
+}
+
+/**
+ * @brief Returns the largest page size that fits the alignment of both addresses and the remaining size.
+ */
+static PageTable::PageSize choosePageSize(uint64_t physicalAddress, uint64_t virtualAddress, uint64_t remaining) {
+    if (hugePageSupported && remaining >= 1Gi && (physicalAddress | virtualAddress) % 1Gi == 0) {
+        return PageTable::PageSize::Size1Gi;
+    }
+    if (remaining >= 2Mi && (physicalAddress | virtualAddress) % 2Mi == 0) {
+        return PageTable::PageSize::Size2Mi;
+    }
+    return PageTable::PageSize::Size4Ki;
 }
 
+void PageTable::unmap(uint64_t virtualAddress) {
+    uint64_t size = (uint64_t) getPageSize(virtualAddress);
+    unmapRange(virtualAddress & ~(size - 1), size);
+}
+
+void PageTable::unmapRange(uint64_t virtualAddress, uint64_t size) {
+    WalkCursor cursor;
+    FlushBatch batch;
+    uint64_t end = virtualAddress + size;
+    for (uint64_t current = virtualAddress & ~(pageSize - 1); current < end;) {
+        PagingAddress address;
+        address.pointer = (void*) current;
+        PagingPage* level3Page = cursor.getLevel3(current, false);
+        if (!level3Page) {
+            current = ((current >> 39) + 1) << 39;
+            continue;
+        }
+        PageEntry& level3Entry = level3Page->entries[address.level3];
+        if (!level3Entry.present) {
+            current = ((current >> 30) + 1) << 30;
+            continue;
+        }
+        if (level3Entry.bigPage) {
+            if (current % 1Gi == 0 && end - current >= 1Gi) {
+                level3Entry.present = false;
+                batch.add(current);
+                current += 1Gi;
+                continue;
+            }
+            splitBigPage(level3Entry, 2Mi);// only a part of the page is unmapped
+        }
+        PagingPage* level2Page = cursor.getLevel2(current, false);
+        PageEntry& level2Entry = level2Page->entries[address.level2];
+        if (!level2Entry.present) {
+            current = ((current >> 21) + 1) << 21;
+            continue;
+        }
+        if (level2Entry.bigPage) {
+            if (current % 2Mi == 0 && end - current >= 2Mi) {
+                level2Entry.present = false;
+                batch.add(current);
+                current += 2Mi;
+                continue;
+            }
+            splitBigPage(level2Entry, pageSize);
+        }
+        PagingPage* level1Page = cursor.getLevel1(current, false);
+        // clear the entries of this level 1 page in one loop
+        uint64_t last = min(end, ((current >> 21) + 1) << 21);
+        for (uint64_t index = address.level1; current < last; ++index, current += pageSize) {
+            if (level1Page->entries[index].present) {
+                level1Page->entries[index].present = false;
+                batch.add(current);
+            }
+        }
+    }
+    batch.flush();
+}
 
 void PageTable::map(uint64_t physicalAddress, void* virtualAddress, Option option) {
-    PagingAddress address;
-    address.pointer = virtualAddress;
-    PagingPage* level4Page = getLevel4Page();
-    PagingPage* level3Page = getLinkedPage(level4Page->entries[address.level4], true);
-    PagingPage* level2Page = getLinkedPage(level3Page->entries[address.level3], true);
-    PagingPage* level1Page = getLinkedPage(level2Page->entries[address.level2], true);
+    map(physicalAddress, virtualAddress, PageSize::Size4Ki, option);
+}
 
-    option.executeDisable = false;//TODO check if execute disable is supported and enable it else disable executeDisable
+void PageTable::map(uint64_t physicalAddress, void* virtualAddress, PageSize size, Option option) {
+    if (size == PageSize::Size1Gi && !hugePageSupported) {
+        mapRange(physicalAddress, virtualAddress, 1Gi, option);
+        return;
+    }
+    WalkCursor cursor;
+    FlushBatch batch;
+    if (mapEntry(cursor, batch, physicalAddress, (uint64_t) virtualAddress, size, option)) {
+        batch.add((uint64_t) virtualAddress);// the tlb does not cache entries that were not present
+    }
+    batch.flush();
+}
 
-    level1Page->entries[address.level1].raw = physicalAddress & ~(pageSize - 1);
-    level1Page->entries[address.level1].writeEnable = option.writeEnable;
-    level1Page->entries[address.level1].userModeEnable = option.userAvailable;
-    level1Page->entries[address.level1].writeThrough = option.writeThrough;
-    level1Page->entries[address.level1].cacheDisable = option.cacheDisable;
-    level1Page->entries[address.level1].executeDisable = option.executeDisable;
-    level1Page->entries[address.level1].present = true;
-    level1Page->entries[address.level1].dirty = false;
-    level1Page->entries[address.level1].accessed = false;
-    level1Page->entries[address.level1].bigPage = false;
-    level1Page->entries[address.level1].global = false;
-    level1Page->entries[address.level1].zero = 0;
-    level1Page->entries[address.level1].available1 = 0;
-    level1Page->entries[address.level1].protectionKey = 0;
-    level1Page->entries[address.level1].available2 = 0;
-    invalidatePage((uint64_t) virtualAddress);
+void PageTable::mapRange(uint64_t physicalAddress, void* virtualAddress, uint64_t size, Option option) {
+    WalkCursor cursor;
+    FlushBatch batch;
+    uint64_t virtualBase = (uint64_t) virtualAddress;
+    uint64_t offset = 0;
+    while (offset < size) {
+        uint64_t physical = physicalAddress + offset;
+        uint64_t virtualPage = virtualBase + offset;
+        PageSize step = choosePageSize(physical, virtualPage, size - offset);
+        if (step == PageSize::Size4Ki) {
+            // fill the entries of this level 1 page in one loop
+            PagingAddress address;
+            address.pointer = (void*) virtualPage;
+            PagingPage* level1Page = cursor.getLevel1(virtualPage, true);
+            uint64_t last = min(size, offset + ((((virtualPage >> 21) + 1) << 21) - virtualPage));
+            for (uint64_t index = address.level1; offset < last; ++index, offset += pageSize) {
+                // stop early if the rest of the range can use a 2Mi page
+                if (index != address.level1 && choosePageSize(physicalAddress + offset, virtualBase + offset, size - offset) != PageSize::Size4Ki) {
+                    break;
+                }
+                bool present = level1Page->entries[index].present;
+                setLeafEntry(level1Page->entries[index], physicalAddress + offset, virtualBase + offset, option, false);
+                if (present) {
+                    batch.add(virtualBase + offset);// the tlb does not cache entries that were not present
+                }
+            }
+            continue;
+        }
+        if (mapEntry(cursor, batch, physical, virtualPage, step, option)) {
+            batch.add(virtualPage);
+        }
+        offset += (uint64_t) step;
+    }
+    batch.flush();
+}
+
+PageTable::PageSize PageTable::getPageSize(uint64_t virtualAddress) {
+    PagingAddress address;
+    address.pointer = (void*) virtualAddress;
+    PagingPage* level4Page = getLevel4Page();
+    PagingPage* level3Page = getLinkedPage(level4Page->entries[address.level4], false);
+    if (!level3Page) { return PageSize::Size4Ki; }
+    if (level3Page->entries[address.level3].present && level3Page->entries[address.level3].bigPage) {
+        return PageSize::Size1Gi;
+    }
+    PagingPage* level2Page = getLinkedPage(level3Page->entries[address.level3], false);
+    if (!level2Page) { return PageSize::Size4Ki; }
+    if (level2Page->entries[address.level2].present && level2Page->entries[address.level2].bigPage) {
+        return PageSize::Size2Mi;
+    }
+    return PageSize::Size4Ki;
 }
 
 uint64_t PageTable::getPhysicalAddress(uint64_t virtualAddress) {
@@ -204,12 +569,12 @@ uint64_t PageTable::getPhysicalAddress(uint64_t virtualAddress) {
     PagingPage* level3Page = getLinkedPage(level4Page->entries[address.level4], false);
     if (!level3Page) { return 0; }
     if (level3Page->entries[address.level3].bigPage) {
-        return (level3Page->entries[address.level3].encAddress << 12) | address.inPage | (address.level2 << 21) | (address.level1 << 12);
+        return (level3Page->entries[address.level3].raw & pageEntryAddressMask & ~(1Gi - 1)) | address.inPage | (address.level2 << 21) | (address.level1 << 12);
     }
     PagingPage* level2Page = getLinkedPage(level3Page->entries[address.level3], false);
     if (!level2Page) { return 0; }
     if (level2Page->entries[address.level2].bigPage) {
-        return (level2Page->entries[address.level2].encAddress << 12) | address.inPage | (address.level1 << 12);
+        return (level2Page->entries[address.level2].raw & pageEntryAddressMask & ~(2Mi - 1)) | address.inPage | (address.level1 << 12);
     }
     PagingPage* level1Page = getLinkedPage(level2Page->entries[address.level2], false);
     if (!level1Page) { return 0; }
@@ -217,4 +582,18 @@ uint64_t PageTable::getPhysicalAddress(uint64_t virtualAddress) {
         return (level1Page->entries[address.level1].encAddress << 12) | address.inPage;
     }
     return 0;
+}
+
+void PageTable::initKernelSpace() {
+    PagingPage* level4Page = getLevel4Page();
+    for (uint64_t i = kernelSpaceStartEntry; i < 512; ++i) {
+        getLinkedPage(level4Page->entries[i], true);
+    }
+}
+
+void PageTable::releaseUserSpace(uint64_t level4Address) {
+    PagingPage* level4Page = (PagingPage*) TempMemory::mapPages(level4Address, 1, false);
+    for (uint64_t i = 0; i < kernelSpaceStartEntry; ++i) {
+        freeLinkedPages(level4Page->entries[i], 3);
+    }
 }
\ No newline at end of file
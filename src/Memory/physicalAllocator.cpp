@@ -1,9 +1,13 @@
 #include "Memory/physicalAllocator.hpp"
 #include "BasicOutput/Output.hpp"
 #include "CPUControl/cpu.hpp"
+#include "CPUControl/smp.hpp"
+#include "CPUControl/spinlock.hpp"
+#include "Common/Math.hpp"
 #include "Common/Symbols.hpp"
 #include "Common/Units.hpp"
 #include "LanguageFeatures/memory.hpp"
+#include "Memory/frameAllocator.hpp"
 #include "Memory/memory.hpp"
 #include "Memory/pageTable.hpp"
 #include "Memory/tempMapping.hpp"
@@ -13,6 +17,7 @@ static uint64_t totalMemorySize;
 static uint64_t usedMemorySize;
 static uint64_t unusableRegionCount;
 static uint64_t usableRegionsCount;
+static SpinLock allocatorLock;
 
 struct MemoryTag {
     uint32_t type;
@@ -76,253 +81,393 @@ uint64_t PhysicalAllocator::getTotalMemorySize() {
 uint64_t PhysicalAllocator::getMaxAddress() {
     return maxAddress;
 }
+constexpr uint64_t maxManagedAddress = 512Gi;// limit of TempMemory::mapPages
+
+static uint64_t frameCount;
+static uint16_t* frameShares;// references to each frame beyond the first one
+static uint16_t* framePins;  // references of running device transfers, included in frameShares
+static uint64_t* frameUsed;  // one bit per frame that was handed out by allocatePhysicalMemory and not freed yet
+
+// per cpu lists of free single frames, only touched by the owning cpu with interrupts disabled
+// they are refilled from and drained to the global allocator in batches of pageCacheBatch frames
+constexpr uint64_t pageCacheSize = 64;
+constexpr uint64_t pageCacheBatch = 32;
+
+struct alignas(64) PageCache {
+    uint64_t count;
+    uint64_t frames[pageCacheSize];
+};
+
+static PageCache pageCaches[SMP::maxCPUCount];
+
+// frames that are already zero filled, shared by all cpus
+static SpinLock zeroPoolLock;
+static uint64_t zeroPoolCount;
+static uint64_t zeroPool[PhysicalAllocator::zeroPoolSize];
+
 uint64_t PhysicalAllocator::getUsedMemorySize() {
-    return usedMemorySize;
+    uint64_t cached = __atomic_load_n(&zeroPoolCount, __ATOMIC_RELAXED);
+    for (uint64_t i = 0; i < SMP::maxCPUCount; ++i) {
+        cached += __atomic_load_n(&pageCaches[i].count, __ATOMIC_RELAXED);
+    }
+    return usedMemorySize - min(usedMemorySize, cached * pageSize);
 }
 
-struct MemoryRegionDescriptor {
-    enum class Type {
-        Unclaimed,     // Free to use
-        UnusableMemory,// Not usable because the bios or uefi is using it or the memory is defective
-        AcpiTable,     // Used by the acpi tables (e.g. the memory map) can be read and written but not allocated
-        Claimed,       // Used but was allocated using allocatePhysicalMemory
-        Ignore         // Ignore this entry
-    };
-    uint64_t startPageIndex;
-    uint64_t pageCount;
-    Type type;
-    uint64_t nextPhysicalAddress;
-};
+static void markUsed(uint64_t frame, uint64_t count) {
+    for (uint64_t i = frame; i < frame + count; ++i) {
+        __atomic_or_fetch(&frameUsed[i / 64], 1ull << (i % 64), __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Marks frames as not handed out anymore.
+ * @return false if one of them is not managed or not in use (reserved, never allocated or a double free), nothing is changed then.
+ */
+static bool markFree(uint64_t frame, uint64_t count) {
+    if (frame + count > frameCount || frame + count < frame) {
+        return false;
+    }
+    if (count == 1) {
+        uint64_t bit = 1ull << (frame % 64);
+        return __atomic_fetch_and(&frameUsed[frame / 64], ~bit, __ATOMIC_RELAXED) & bit;
+    }
+    for (uint64_t i = frame; i < frame + count; ++i) {
+        if (!(__atomic_load_n(&frameUsed[i / 64], __ATOMIC_RELAXED) & (1ull << (i % 64)))) {
+            return false;
+        }
+    }
+    for (uint64_t i = frame; i < frame + count; ++i) {
+        __atomic_and_fetch(&frameUsed[i / 64], ~(1ull << (i % 64)), __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+static bool refillPageCache(PageCache& cache) {
+    SpinLockGuard guard(allocatorLock);
+    while (cache.count < pageCacheBatch) {
+        uint64_t frame = FrameAllocator::allocate(1, 1);
+        if (frame == ~0ull) {
+            break;
+        }
+        cache.frames[cache.count++] = frame;
+        usedMemorySize += pageSize;
+    }
+    return cache.count > 0;
+}
 
-uint64_t PhysicalAllocator::allocatePhysicalMemory(uint64_t count) {
-    //iterate over free memory regions
-    MemoryRegionDescriptor* region = (MemoryRegionDescriptor*) TempMemory::mapPages(0, 1, false);
-    MemoryRegionDescriptor* last = region;
-    region = (MemoryRegionDescriptor*) TempMemory::mapPages(region->nextPhysicalAddress, 1, false);
-    while (region->nextPhysicalAddress) {// can only find usable memory regions
-        if (region->pageCount >= count) {
-            //found a region
-            region->pageCount -= count;// remove memory from the back
-            uint64_t physicalAddress = region->startPageIndex + region->pageCount;
-            usedMemorySize += count;
-            if (region->pageCount == 0) {
-                //remove the region
-                last->nextPhysicalAddress = region->nextPhysicalAddress;
-                region->nextPhysicalAddress = 0;
+static void drainPageCache(PageCache& cache, uint64_t keep) {
+    SpinLockGuard guard(allocatorLock);
+    while (cache.count > keep) {
+        FrameAllocator::free(cache.frames[--cache.count], 1);
+        usedMemorySize -= min(usedMemorySize, pageSize);
+    }
+}
+
+static uint64_t allocateCachedFrame() {
+    InterruptGuard guard;
+    PageCache& cache = pageCaches[SMP::getIndex()];
+    if (cache.count == 0 && !refillPageCache(cache)) {
+        return ~0ull;
+    }
+    return cache.frames[--cache.count];
+}
+
+static void freeCachedFrame(uint64_t frame) {
+    InterruptGuard guard;
+    PageCache& cache = pageCaches[SMP::getIndex()];
+    if (cache.count == pageCacheSize) {
+        drainPageCache(cache, pageCacheSize - pageCacheBatch);
+    }
+    cache.frames[cache.count++] = frame;
+}
+
+/**
+ * @brief Zeroes memory through the direct map with non temporal stores, so the zeros do not push other data out of the cache.
+ */
+static void zeroFrames(uint64_t frame, uint64_t count) {
+    uint64_t* memory = (uint64_t*) TempMemory::mapPages(frame * pageSize, count, false);
+    uint64_t* end = memory + count * pageSize / sizeof(uint64_t);
+    for (; memory < end; memory += 4) {
+        asm volatile("movnti %1, 0(%0); movnti %1, 8(%0); movnti %1, 16(%0); movnti %1, 24(%0)" ::"r"(memory), "r"(0ull)
+                     : "memory");
+    }
+    asm volatile("sfence" ::
+                         : "memory");
+}
+
+static uint64_t takeZeroedFrame() {
+    if (__atomic_load_n(&zeroPoolCount, __ATOMIC_RELAXED) == 0) {
+        return ~0ull;
+    }
+    SpinLockGuard guard(zeroPoolLock);
+    if (zeroPoolCount == 0) {
+        return ~0ull;
+    }
+    return zeroPool[--zeroPoolCount];
+}
+
+bool PhysicalAllocator::prepareZeroedPage() {
+    if (__atomic_load_n(&zeroPoolCount, __ATOMIC_RELAXED) >= zeroPoolSize || frameCount == 0) {
+        return false;
+    }
+    uint64_t frame = allocateCachedFrame();
+    if (frame == ~0ull) {
+        return false;
+    }
+    zeroFrames(frame, 1);
+    {
+        SpinLockGuard guard(zeroPoolLock);
+        if (zeroPoolCount < zeroPoolSize) {
+            zeroPool[zeroPoolCount++] = frame;
+            return true;
+        }
+    }
+    freeCachedFrame(frame);
+    return false;
+}
+
+uint64_t PhysicalAllocator::getZeroedPageCount() {
+    return __atomic_load_n(&zeroPoolCount, __ATOMIC_RELAXED);
+}
+
+uint64_t PhysicalAllocator::allocatePhysicalMemory(uint64_t count, uint64_t alignment, Flags flags) {
+    uint64_t address = tryAllocatePhysicalMemory(count, alignment, flags);
+    if (address == 0) {
+        Output::getDefault()->printf("Unable to allocate %lu pages (out of physical memory)\n", count);
+        stop();
+    }
+    return address;
+}
+
+uint64_t PhysicalAllocator::tryAllocatePhysicalMemory(uint64_t count, uint64_t alignment, Flags flags) {
+    uint64_t alignmentFrames = alignment > pageSize ? alignment / pageSize : 1;
+    bool zeroed = flags == Flags::Zeroed;
+    if (count == 1 && alignmentFrames == 1) {
+        uint64_t frame = zeroed ? takeZeroedFrame() : ~0ull;
+        if (frame == ~0ull) {
+            frame = allocateCachedFrame();
+            if (frame != ~0ull && zeroed) {
+                zeroFrames(frame, 1);
             }
-            return physicalAddress * pageSize;
         }
-        last = region;
-        region = (MemoryRegionDescriptor*) TempMemory::mapPages(region->nextPhysicalAddress, 1, false);
+        if (frame == ~0ull && !zeroed) {
+            frame = takeZeroedFrame();// the pool is the last reserve
+        }
+        if (frame != ~0ull) {
+            markUsed(frame, 1);
+            return frame * pageSize;
+        }
+    } else {
+        uint64_t frame;
+        {
+            SpinLockGuard guard(allocatorLock);
+            frame = FrameAllocator::allocate(count, alignmentFrames);
+            if (frame != ~0ull) {
+                usedMemorySize += count * pageSize;
+            }
+        }
+        if (frame != ~0ull) {
+            markUsed(frame, count);
+            if (zeroed) {
+                zeroFrames(frame, count);
+            }
+            return frame * pageSize;
+        }
     }
-    Output::getDefault()->printf("Unable to allocate %lu pages (out of physical memory)\n", count);
-    stop();
-    return ~0;
+    return 0;// frame 0 is never handed out
 }
+
 void PhysicalAllocator::freePhysicalMemory(uint64_t address, uint64_t count) {
-    //check if given memory region is in unusable memory
-    MemoryRegionDescriptor* region = (MemoryRegionDescriptor*) TempMemory::mapPages(0, 1, false);
-    MemoryRegionDescriptor* start = region;
-    uint64_t pageIndex = address / pageSize;
-    if (pageIndex == 0) {
+    uint64_t frame = address / pageSize;
+    if (frame == 0) {
         //the first page is unusable
         return;
     }
-    for (uint64_t i = 1; i < unusableRegionCount + 1; ++i) {// index 0 is our special region
-        if (pageIndex <= region[i].startPageIndex + region[i].pageCount && region[i].startPageIndex <= pageIndex + count) {
-            return;
+    if (count == 1) {
+        if (markFree(frame, 1)) {
+            freeCachedFrame(frame);
         }
+        return;
     }
+    SpinLockGuard guard(allocatorLock);
+    if (!markFree(frame, count)) {
+        return;
+    }
+    FrameAllocator::free(frame, count);
+    usedMemorySize -= min(usedMemorySize, count * pageSize);
+}
 
-    MemoryRegionDescriptor* last = nullptr;
-    region = start;
+void PhysicalAllocator::addReference(uint64_t address) {
+    uint64_t frame = address / pageSize;
+    if (frame >= frameCount) {
+        return;
+    }
+    __atomic_add_fetch(&frameShares[frame], 1, __ATOMIC_RELAXED);
+}
 
-    while (region->nextPhysicalAddress) {
-        //[a1,a2) and [b1,b2)
-        //a1 <= b2 && b1 <= a2
-        if (pageIndex <= region->startPageIndex + region->pageCount && region->startPageIndex <= pageIndex + count) {
-            // the region we are trying to free can not be freed because it already is
+void PhysicalAllocator::releaseReference(uint64_t address) {
+    uint64_t frame = address / pageSize;
+    if (frame >= frameCount) {
+        return;
+    }
+    uint16_t shares = __atomic_load_n(&frameShares[frame], __ATOMIC_ACQUIRE);
+    while (shares != 0) {
+        if (__atomic_compare_exchange_n(&frameShares[frame], &shares, shares - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
             return;
         }
+    }
+    //the caller held the last reference, nobody else can add one
+    freePhysicalMemory(frame * pageSize, 1);
+}
 
-        if (last != nullptr) {
-            //check if the region start is after the last regions end and the region end is before the start of the region we are looking at
-            if (last->startPageIndex + last->pageCount < pageIndex && pageIndex + count < region->startPageIndex + region->pageCount) {
-                MemoryRegionDescriptor* newRegion = (MemoryRegionDescriptor*) TempMemory::mapPages(pageIndex * pageSize, 1, false);
-                newRegion->startPageIndex = pageIndex;
-                newRegion->pageCount = count;
-                newRegion->type = MemoryRegionDescriptor::Type::Unclaimed;
-                newRegion->nextPhysicalAddress = PageTable::getPhysicalAddress((uint64_t) region);
-                last->nextPhysicalAddress = pageIndex * pageSize;
-                break;
-            }
-        }
-        last = region;
-        region = (MemoryRegionDescriptor*) TempMemory::mapPages(region->nextPhysicalAddress, 1, false);
-    }
-
-    // connect adjacent regions
-    last = nullptr;
-    region = start;
-    while (region->nextPhysicalAddress) {
-        if (last != nullptr) {
-            if (last->startPageIndex + last->pageCount + 1 == region->startPageIndex) {
-                last->pageCount += region->pageCount;
-                last->nextPhysicalAddress = region->nextPhysicalAddress;
-                region->nextPhysicalAddress = 0;
-                //only load next region as there could be 3 or more regions adjacent to each other
-                region = (MemoryRegionDescriptor*) TempMemory::mapPages(last->nextPhysicalAddress, 1, false);
-                continue;
-            }
-        }
-        last = region;
-        region = (MemoryRegionDescriptor*) TempMemory::mapPages(region->nextPhysicalAddress, 1, false);
+uint64_t PhysicalAllocator::getReferenceCount(uint64_t address) {
+    uint64_t frame = address / pageSize;
+    if (frame >= frameCount) {
+        return 1;
     }
+    return __atomic_load_n(&frameShares[frame], __ATOMIC_ACQUIRE) + 1ull;
 }
 
-struct Context1 {
-    MemoryRegionDescriptor* regions;
-};
-struct Context2 {
-    MemoryRegionDescriptor* last;
+void PhysicalAllocator::pin(uint64_t address) {
+    addReference(address);
+    uint64_t frame = address / pageSize;
+    if (frame < frameCount) {
+        __atomic_add_fetch(&framePins[frame], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void PhysicalAllocator::unpin(uint64_t address) {
+    uint64_t frame = address / pageSize;
+    if (frame < frameCount) {
+        __atomic_sub_fetch(&framePins[frame], 1, __ATOMIC_RELAXED);
+    }
+    releaseReference(address);
+}
+
+bool PhysicalAllocator::isPinned(uint64_t address) {
+    uint64_t frame = address / pageSize;
+    return frame < frameCount && __atomic_load_n(&framePins[frame], __ATOMIC_ACQUIRE) != 0;
+}
+
+uint64_t PhysicalAllocator::getShareCount(uint64_t address) {
+    uint64_t frame = address / pageSize;
+    if (frame >= frameCount) {
+        return 1;
+    }
+    // the pins are read first, so a pin that is added in between can only make the count larger
+    uint64_t pins = __atomic_load_n(&framePins[frame], __ATOMIC_ACQUIRE);
+    uint64_t references = __atomic_load_n(&frameShares[frame], __ATOMIC_ACQUIRE) + 1ull;
+    return references - min(pins, references - 1);
+}
+
+struct ReservedRange {
+    uint64_t start;// first frame
+    uint64_t end;  // first frame after the range
 };
 
-static void initMemoryInfos(uint8_t* ptr) {
-    if (sizeof(MemoryRegionDescriptor) * (unusableRegionCount + 1) > pageSize) {
-        Output::getDefault()->print("Too many unusable memory regions\n");
+constexpr uint64_t maxReservedRanges = 4;
+static ReservedRange reservedRanges[maxReservedRanges];
+static uint64_t reservedRangeCount;
+
+static void reserve(uint64_t start, uint64_t length) {
+    if (reservedRangeCount >= maxReservedRanges) {
+        Output::getDefault()->print("Memory: Too many reserved ranges\n");
         stop();
     }
-    uint8_t* staticInfoPage = TempMemory::mapPages(0, 1, false);
-
-    // leave space for pointer to first descriptor of usable memory
-    MemoryRegionDescriptor* regions = (MemoryRegionDescriptor*) (staticInfoPage);
-    regions[0].startPageIndex = 0;
-    regions[0].pageCount = 0;
-    regions[0].type = MemoryRegionDescriptor::Type::Ignore;
-    regions[0].nextPhysicalAddress = 0;
-    regions++;
-    Context1 context1;
-    context1.regions = regions;
-    readMemoryInfos(ptr, &context1, [](void* context, uint64_t baseAddress, uint64_t length, uint32_t type) {
-        Context1* ctx = (Context1*) context;
-        if (type == 1) {
+    reservedRanges[reservedRangeCount].start = start / pageSize;
+    reservedRanges[reservedRangeCount].end = (start + length + pageSize - 1) / pageSize + 1;// add one page to be save
+    reservedRangeCount++;
+}
+
+/**
+ * @brief Hands the frames [start, end) to the allocator, skipping the reserved ranges.
+ */
+static void addUsableFrames(uint64_t start, uint64_t end) {
+    for (uint64_t i = 0; i < reservedRangeCount && start < end; ++i) {
+        ReservedRange& range = reservedRanges[i];
+        if (range.end <= start || end <= range.start) {
+            continue;
+        }
+        if (start < range.start) {
+            addUsableFrames(start, range.start);
+        }
+        start = range.end;
+    }
+    if (start >= end) {
+        return;
+    }
+    FrameAllocator::addFrames(start, end - start);
+}
+
+/**
+ * @brief Finds space for the frame metadata and reference counts in a usable region that does not overlap a reserved range.
+ */
+static void placeFrameInfo(uint8_t* ptr) {
+    static uint64_t neededFrames;
+    static uint64_t foundFrame;
+    uint64_t allocatorSize = (FrameAllocator::getMetadataSize(frameCount) + 7) & ~7ull;
+    uint64_t sharesSize = frameCount * sizeof(uint16_t);
+    uint64_t usedOffset = (allocatorSize + 2 * sharesSize + 7) & ~7ull;
+    uint64_t usedSize = (frameCount + 63) / 64 * sizeof(uint64_t);
+    neededFrames = (usedOffset + usedSize + pageSize - 1) / pageSize;
+    foundFrame = 0;
+    readMemoryInfos(ptr, nullptr, [](void* context, uint64_t baseAddress, uint64_t length, uint32_t type) {
+        if (type != 1 || foundFrame != 0) {
             return;
         }
-        if (type == 3) {
-            ctx->regions->type = MemoryRegionDescriptor::Type::AcpiTable;
-        } else {
-            ctx->regions->type = MemoryRegionDescriptor::Type::UnusableMemory;
+        uint64_t start = (baseAddress + pageSize - 1) / pageSize;
+        uint64_t end = min((baseAddress + length) / pageSize, frameCount);
+        bool moved = true;
+        while (moved) {
+            moved = false;
+            for (uint64_t i = 0; i < reservedRangeCount; ++i) {
+                if (start < reservedRanges[i].end && reservedRanges[i].start < start + neededFrames) {
+                    start = reservedRanges[i].end;
+                    moved = true;
+                }
+            }
+        }
+        if (start + neededFrames <= end) {
+            foundFrame = start;
         }
-        ctx->regions->startPageIndex = baseAddress / pageSize;
-        ctx->regions->pageCount = length / pageSize;
-        ctx->regions++;
     });
+    if (foundFrame == 0) {
+        Output::getDefault()->print("Memory: No space for the frame metadata\n");
+        stop();
+    }
+    uint8_t* metadata = TempMemory::mapPages(foundFrame * pageSize, neededFrames, false);
+    FrameAllocator::init(frameCount, metadata);
+    frameShares = (uint16_t*) (metadata + allocatorSize);
+    memset(frameShares, 0, sharesSize);
+    framePins = frameShares + frameCount;
+    memset(framePins, 0, sharesSize);
+    frameUsed = (uint64_t*) (metadata + usedOffset);
+    memset(frameUsed, 0, usedSize);
+    reserve(foundFrame * pageSize, neededFrames * pageSize);
+}
 
-    // iterate over usable memory regions and create a MemoryRegionDescriptor in the first page and link them like a unidirectional linked list
-    // special case is the memory region that starts with the null page, because that first page is used for the static info
-    // the pointer to the linked list is at the beginning of the static info page
+static void initMemoryInfos(uint8_t* ptr) {
+    frameCount = min(maxAddress, maxManagedAddress) / pageSize;
+    placeFrameInfo(ptr);
 
-    Context2 context2;
-    regions = (MemoryRegionDescriptor*) (staticInfoPage);
-    context2.last = regions;
-    readMemoryInfos(ptr, &context2, [](void* context, uint64_t baseAddress, uint64_t length, uint32_t type) {
-        Context2* ctx = (Context2*) context;
+    readMemoryInfos(ptr, nullptr, [](void* context, uint64_t baseAddress, uint64_t length, uint32_t type) {
         if (type != 1) {
             return;
         }
-        if (baseAddress == 0) {
-            baseAddress += pageSize;
-            length -= pageSize;
+        uint64_t start = (baseAddress + pageSize - 1) / pageSize;
+        uint64_t end = min((baseAddress + length) / pageSize, frameCount);
+        if (start == 0) {
+            start = 1;// the null page is never handed out
         }
-        MemoryRegionDescriptor* descriptor = (MemoryRegionDescriptor*) TempMemory::mapPages(baseAddress, 1, false);
-        descriptor->startPageIndex = baseAddress / pageSize;
-        descriptor->pageCount = length / pageSize;
-        descriptor->type = MemoryRegionDescriptor::Type::Unclaimed;
-        descriptor->nextPhysicalAddress = 0;
-        ctx->last->nextPhysicalAddress = baseAddress;
-        ctx->last = descriptor;
-        Output::getDefault()->printf("Found usable memory region at 0x%llx with size 0x%llx\n", baseAddress, length);
-    });
-}
-
-static void setUsed(uint64_t start, uint64_t length) {
-    MemoryRegionDescriptor* region = (MemoryRegionDescriptor*) TempMemory::mapPages(0, 1, false);
-    MemoryRegionDescriptor* last = region;
-    region = (MemoryRegionDescriptor*) TempMemory::mapPages(region->nextPhysicalAddress, 1, false);
-    while ((uint64_t) region != 96Ti) {// can only find usable memory regions
-        // Output::getDefault()->printf("Memory: Looking at region at 0x%llx with size 0x%llx\n", region->startPageIndex * pageSize, region->pageCount * pageSize);
-        // [a1,a2] and [b1,b2] // start and end inclusive
-        // a1 = start / pageSize, a2 = (start + length + pageSize - 1) / pageSize
-        // b1 = region->startPageIndex, b2 = region->startPageIndex + region->pageCount
-        // case 1a: a1----a2----b1----b2 -> do nothing
-        // case 1b: b1----b2----a1----a2 -> do nothing
-        // case 2:  a1----b1----b2----a2 -> delete region b1----b2
-        // case 3:  a1----b1----a2----b2 -> change start of region to a2
-        // case 4:  b1----a1----b2----a2 -> change end of region to a1
-        // case 5:  b1----a1----a2----b2 -> change end of region to a1 and create region a2----b2
-        uint64_t a1 = start / pageSize;
-        uint64_t a2 = (start + length + pageSize - 1) / pageSize;
-        a2 += 1;// add one page to be save
-        uint64_t b1 = region->startPageIndex;
-        uint64_t b2 = region->startPageIndex + region->pageCount;
-        if (a2 <= b1 || b2 <= a1) {
-            // case 1
-            // do nothing
-        } else if (a1 <= b1 && b2 <= a2) {
-            // case 2
-            // delete region b1----b2
-            // Output::getDefault()->printf("Memory: Case2: Deleting region at 0x%llx with size 0x%llx\n", b1 * pageSize, b2 * pageSize);
-            last->nextPhysicalAddress = region->nextPhysicalAddress;
-            region = (MemoryRegionDescriptor*) TempMemory::mapPages(region->nextPhysicalAddress, 1, false);
-            // Output::getDefault()->printf("Memory: Deleted region\n");
-            continue;
-        } else if (a1 <= b1) {
-            // case 3
-            // change start of region to a2
-            // Output::getDefault()->printf("Memory: Case3: Changing start of region at 0x%llx with size 0x%llx to 0x%llx\n", b1 * pageSize, b2 * pageSize, a2 * pageSize);
-            uint64_t newStart = a2 * pageSize;
-            MemoryRegionDescriptor* newRegion = (MemoryRegionDescriptor*) TempMemory::mapPages(newStart, 1, false);
-            newRegion->startPageIndex = a2;
-            newRegion->pageCount = b2 - a2;// end - start
-            newRegion->type = region->type;
-            newRegion->nextPhysicalAddress = region->nextPhysicalAddress;
-            last->nextPhysicalAddress = newStart;
-            region = newRegion;
-            // Output::getDefault()->printf("Memory: Region is now at 0x%llx with size 0x%llx\n", region->startPageIndex * pageSize, region->pageCount * pageSize);
-        } else if (b2 <= a2) {
-            // case 4
-            // change end of region to a1
-            // Output::getDefault()->printf("Memory: Case4: Changing end of region at 0x%llx with size 0x%llx to 0x%llx\n", b1 * pageSize, b2 * pageSize, a1 * pageSize);
-            region->pageCount = a1 - b1;
-            // Output::getDefault()->printf("Memory: Region is now at 0x%llx with size 0x%llx\n", region->startPageIndex * pageSize, region->pageCount * pageSize);
-        } else {
-            // case 5
-            // change end of region to a1 and create region a2----b2
-            // Output::getDefault()->printf("Memory: Case5: Changing end of region at 0x%llx with size 0x%llx to 0x%llx and creating region at 0x%llx with size 0x%llx\n", b1 * pageSize, b2 * pageSize, a1 * pageSize, a2 * pageSize, b2 * pageSize);
-
-            // change end of region to a1
-            region->pageCount = a1 - b1;
-            // Output::getDefault()->printf("Memory: Region is now at 0x%llx with size 0x%llx\n", region->startPageIndex * pageSize, region->pageCount * pageSize);
-
-            // create region a2----b2
-            uint64_t newStart = a2 * pageSize;
-            MemoryRegionDescriptor* newRegion = (MemoryRegionDescriptor*) TempMemory::mapPages(newStart, 1, false);
-            newRegion->startPageIndex = a2;
-            newRegion->pageCount = b2 - a2;
-            newRegion->type = region->type;
-            newRegion->nextPhysicalAddress = region->nextPhysicalAddress;
-            region->nextPhysicalAddress = newStart;
-            // Output::getDefault()->printf("Memory: Region is now at 0x%llx with size 0x%llx\n", region->startPageIndex * pageSize, region->pageCount * pageSize);
+        if (start < end) {
+            addUsableFrames(start, end);
+            Output::getDefault()->printf("Found usable memory region at 0x%llx with size 0x%llx\n", start * pageSize, (end - start) * pageSize);
         }
-
-        last = region;
-        region = (MemoryRegionDescriptor*) TempMemory::mapPages(region->nextPhysicalAddress, 1, false);
-    }
+    });
 }
 
 void PhysicalAllocator::readMultibootInfos(uint8_t* ptr) {
     getStaticData(ptr);
-    initMemoryInfos(ptr);
     //set kernel used
     uint64_t trampolineStart;
     saveReadSymbol("trampolineStart", trampolineStart);
@@ -333,8 +478,10 @@ void PhysicalAllocator::readMultibootInfos(uint8_t* ptr) {
     uint64_t kernelEnd;
     saveReadSymbol("physical_end", kernelEnd);
 
-    setUsed(kernelStart, kernelEnd - kernelStart);
+    reservedRangeCount = 0;
+    reserve(kernelStart, kernelEnd - kernelStart);
     Output::getDefault()->printf("Memory: Kernel used: 0x%llx - 0x%llx\n", kernelStart, kernelEnd);
-    setUsed(trampolineStart, trampolineEnd - trampolineStart);
+    reserve(trampolineStart, trampolineEnd - trampolineStart);
     Output::getDefault()->printf("Memory: Trampoline used: 0x%llx - 0x%llx\n", trampolineStart, trampolineEnd);
-}
\ No newline at end of file
+    initMemoryInfos(ptr);
+}
@@ -4,6 +4,7 @@
 #include "Common/Units.hpp"
 #include "Memory/memory.hpp"
 #include "Memory/pageTable.hpp"
+#include "Memory/virtualAllocator.hpp"
 
 uint8_t* TempMemory::mapPages(uint64_t physicalAddress, uint64_t count, bool user) {
     if (!user) {
@@ -15,18 +16,45 @@ uint8_t* TempMemory::mapPages(uint64_t physicalAddress, uint64_t count, bool use
         }
     }
     uint64_t baseAddress = 32Ti;
-    uint64_t virtualAddress = baseAddress + physicalAddress;
-    for (uint64_t i = 0; i < count; i++) {
-        if (PageTable::getPhysicalAddress(virtualAddress) != physicalAddress || physicalAddress == 0) {
-            PageTable::map(physicalAddress + i * pageSize, (void*) (virtualAddress + i * pageSize),
-                           {
-                                   .writeEnable = true,  //
-                                   .userAvailable = true,//
-                                   .writeThrough = true, //
-                                   .cacheDisable = true, //
-                                   .executeDisable = true//
-                           });
-        }
+    uint64_t pageAddress = physicalAddress & ~(pageSize - 1);
+    uint64_t virtualAddress = baseAddress + pageAddress;
+    if (PageTable::getPhysicalAddress(virtualAddress) != pageAddress || pageAddress == 0) {
+        PageTable::mapRange(pageAddress, (void*) virtualAddress, count * pageSize,
+                            {
+                                    .writeEnable = true,                           //
+                                    .userAvailable = true,                         //
+                                    .memoryType = PageTable::MemoryType::Uncached,//
+                                    .executeDisable = true                         //
+                            });
+    }
+    return (uint8_t*) (virtualAddress | (physicalAddress & 0xFFF));
+}
+
+uint8_t* TempMemory::mapMMIO(uint64_t physicalAddress, uint64_t count) {
+    // the uncached window maps the first 512Gi, the whole range has to be inside it
+    if (physicalAddress >= 512Gi || count > (512Gi - (physicalAddress & ~(pageSize - 1))) / pageSize) {
+        Output::getDefault()->printf("Physical range %llx + %llu pages is too high for TempMemory::mapMMIO\n", physicalAddress, count);
+        stop();
+    }
+    return (uint8_t*) (physicalAddress + 97Ti);
+}
+
+uint8_t* TempMemory::mapWithType(uint64_t physicalAddress, uint64_t count, PageTable::MemoryType memoryType) {
+    if (physicalAddress >= 512Gi) {
+        Output::getDefault()->printf("Physical address %llx is too high for TempMemory::mapWithType\n", physicalAddress);
+        stop();
+    }
+    uint64_t pageAddress = physicalAddress & ~(pageSize - 1);
+    uint64_t virtualAddress = VirtualAllocator::reserve(count);
+    if (virtualAddress == 0) {
+        stop();
     }
+    PageTable::mapRange(pageAddress, (void*) virtualAddress, count * pageSize,
+                        {
+                                .writeEnable = true,   //
+                                .userAvailable = false,//
+                                .memoryType = memoryType,
+                                .executeDisable = true//
+                        });
     return (uint8_t*) (virtualAddress | (physicalAddress & 0xFFF));
 }
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "Memory/tlb.hpp"
+#include "ACPI/APIC.hpp"
+#include "CPUControl/cpu.hpp"
+#include "CPUControl/interrupts.hpp"
+#include "CPUControl/smp.hpp"
+#include "CPUControl/spinlock.hpp"
+#include "Memory/addressSpace.hpp"
+
+struct alignas(64) ShootdownQueue {
+    SpinLock lock;
+    uint64_t count;// number of queued addresses, more than maxAddresses flushes everything
+    bool global;
+    uint64_t requestedGeneration;
+    uint64_t doneGeneration;
+    uint64_t addresses[TLB::maxAddresses];
+};
+
+static ShootdownQueue queues[SMP::maxCPUCount];
+static uint64_t generation;
+static AddressSpace* activeAddressSpaces[SMP::maxCPUCount];
+
+static void flushLocal(const uint64_t* addresses, uint64_t count, bool global) {
+    if (count > TLB::maxAddresses && global) {
+        uint64_t cr4 = getCR4();
+        setCR4(cr4 & ~(1ull << 7));// toggling global pages flushes everything
+        setCR4(cr4);
+    } else if (count > TLB::maxAddresses) {
+        setCR3(getCR3());
+    } else {
+        for (uint64_t i = 0; i < count; ++i) {
+            invalidatePage(addresses[i]);
+        }
+    }
+}
+
+/**
+ * @brief Executes the requests queued for the calling cpu (interrupts have to be disabled).
+ */
+static void processQueue() {
+    ShootdownQueue& queue = queues[SMP::getIndex()];
+    uint64_t addresses[TLB::maxAddresses];
+    uint64_t count;
+    bool global;
+    uint64_t requested;
+    queue.lock.lock();
+    count = queue.count;
+    global = queue.global;
+    requested = queue.requestedGeneration;
+    for (uint64_t i = 0; i < count && i < TLB::maxAddresses; ++i) {
+        addresses[i] = queue.addresses[i];
+    }
+    queue.count = 0;
+    queue.global = false;
+    queue.lock.unlock();
+    if (count) {
+        flushLocal(addresses, count, global);
+    }
+    __atomic_store_n(&queue.doneGeneration, requested, __ATOMIC_RELEASE);
+}
+
+static void onShootdown(Interrupt&) {
+    processQueue();
+}
+
+void TLB::setupInterrupt() {
+    Interrupt::setupInterruptHandler(shootdownVector, onShootdown, {false, 0});
+}
+
+void TLB::setActiveAddressSpace(AddressSpace* addressSpace) {
+    __atomic_store_n(&activeAddressSpaces[SMP::getIndex()], addressSpace, __ATOMIC_SEQ_CST);
+}
+
+void TLB::shootdown(const uint64_t* addresses, uint64_t count, bool global) {
+    uint8_t cpuCount = SMP::getCount();
+    if (cpuCount == 1 || count == 0) {
+        return;
+    }
+    uint64_t cpus = 0;
+    if (global) {
+        cpus = ~0ull;
+    } else {
+        AddressSpace* addressSpace = __atomic_load_n(&activeAddressSpaces[SMP::getIndex()], __ATOMIC_SEQ_CST);
+        if (addressSpace) {
+            addressSpace->invalidate();// cpus that do not run it flush when they switch to it
+        }
+        for (uint8_t i = 0; i < cpuCount; ++i) {
+            if (__atomic_load_n(&activeAddressSpaces[i], __ATOMIC_SEQ_CST) == addressSpace) {
+                cpus |= 1ull << i;
+            }
+        }
+    }
+    flushOn(cpus, addresses, count, global);
+}
+
+void TLB::flushOn(uint64_t cpus, const uint64_t* addresses, uint64_t count, bool global) {
+    InterruptGuard guard;
+    uint8_t self = SMP::getIndex();
+    uint8_t cpuCount = SMP::getCount();
+    uint64_t requested = __atomic_add_fetch(&generation, 1, __ATOMIC_ACQ_REL);
+    uint64_t targets = 0;
+    for (uint8_t i = 0; i < cpuCount; ++i) {
+        if (i == self || !(cpus & (1ull << i)) || !SMP::isOnline(i)) {
+            continue;
+        }
+        ShootdownQueue& queue = queues[i];
+        queue.lock.lock();
+        bool idle = queue.count == 0;// otherwise the cpu already has an interrupt pending
+        if (queue.count + count > maxAddresses) {
+            queue.count = maxAddresses + 1;
+        } else {
+            for (uint64_t j = 0; j < count; ++j) {
+                queue.addresses[queue.count++] = addresses[j];
+            }
+        }
+        queue.global |= global;
+        if (queue.requestedGeneration < requested) {
+            queue.requestedGeneration = requested;
+        }
+        queue.lock.unlock();
+        if (idle) {
+            APIC::sendInterrupt(shootdownVector, 0, SMP::getAPICID(i), 0, false);
+        }
+        targets |= 1ull << i;
+    }
+    for (uint8_t i = 0; i < cpuCount; ++i) {
+        if (!(targets & (1ull << i))) {
+            continue;
+        }
+        while (__atomic_load_n(&queues[i].doneGeneration, __ATOMIC_ACQUIRE) < requested) {
+            processQueue();// another cpu may wait for us with interrupts disabled
+            pause();
+        }
+    }
+}
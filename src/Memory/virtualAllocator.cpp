@@ -0,0 +1,240 @@
+#include "Memory/virtualAllocator.hpp"
+#include "BasicOutput/Output.hpp"
+#include "CPUControl/spinlock.hpp"
+#include "Common/Math.hpp"
+#include "Memory/memory.hpp"
+#include "Memory/physicalAllocator.hpp"
+#include "Memory/tempMapping.hpp"
+
+struct FreeRange {
+    uint64_t start;
+    uint64_t size;
+    uint64_t largest;// largest size in this subtree
+    FreeRange* left;
+    FreeRange* right;
+    int64_t height;
+};
+
+static SpinLock rangeLock;
+static FreeRange* root;
+static FreeRange* unusedNodes;// linked through right
+static bool initialized;
+static uint64_t reservedSize;
+
+/**
+ * @brief Takes a tree node, nodes live in pages of the direct map because the heap itself uses this allocator.
+ */
+static FreeRange* takeNode() {
+    if (unusedNodes == nullptr) {
+        FreeRange* nodes = (FreeRange*) TempMemory::mapPages(PhysicalAllocator::allocatePhysicalMemory(1), 1, false);
+        for (uint64_t i = 0; i < pageSize / sizeof(FreeRange); ++i) {
+            nodes[i].right = unusedNodes;
+            unusedNodes = &nodes[i];
+        }
+    }
+    FreeRange* node = unusedNodes;
+    unusedNodes = node->right;
+    return node;
+}
+
+static void returnNode(FreeRange* node) {
+    node->right = unusedNodes;
+    unusedNodes = node;
+}
+
+static int64_t getHeight(FreeRange* node) {
+    return node ? node->height : 0;
+}
+
+static uint64_t getLargest(FreeRange* node) {
+    return node ? node->largest : 0;
+}
+
+static void update(FreeRange* node) {
+    node->height = max(getHeight(node->left), getHeight(node->right)) + 1;
+    node->largest = max(node->size, max(getLargest(node->left), getLargest(node->right)));
+}
+
+static FreeRange* rotateRight(FreeRange* node) {
+    FreeRange* left = node->left;
+    node->left = left->right;
+    left->right = node;
+    update(node);
+    update(left);
+    return left;
+}
+
+static FreeRange* rotateLeft(FreeRange* node) {
+    FreeRange* right = node->right;
+    node->right = right->left;
+    right->left = node;
+    update(node);
+    update(right);
+    return right;
+}
+
+static FreeRange* balance(FreeRange* node) {
+    update(node);
+    int64_t difference = getHeight(node->left) - getHeight(node->right);
+    if (difference > 1) {
+        if (getHeight(node->left->left) < getHeight(node->left->right)) {
+            node->left = rotateLeft(node->left);
+        }
+        return rotateRight(node);
+    }
+    if (difference < -1) {
+        if (getHeight(node->right->right) < getHeight(node->right->left)) {
+            node->right = rotateRight(node->right);
+        }
+        return rotateLeft(node);
+    }
+    return node;
+}
+
+static FreeRange* insert(FreeRange* node, FreeRange* range) {
+    if (node == nullptr) {
+        range->left = nullptr;
+        range->right = nullptr;
+        update(range);
+        return range;
+    }
+    if (range->start < node->start) {
+        node->left = insert(node->left, range);
+    } else {
+        node->right = insert(node->right, range);
+    }
+    return balance(node);
+}
+
+static FreeRange* removeMin(FreeRange* node, FreeRange** removed) {
+    if (node->left == nullptr) {
+        *removed = node;
+        return node->right;
+    }
+    node->left = removeMin(node->left, removed);
+    return balance(node);
+}
+
+static FreeRange* remove(FreeRange* node, uint64_t start) {
+    if (node == nullptr) {
+        return nullptr;
+    }
+    if (start < node->start) {
+        node->left = remove(node->left, start);
+    } else if (start > node->start) {
+        node->right = remove(node->right, start);
+    } else {
+        if (node->left == nullptr) {
+            return node->right;
+        }
+        if (node->right == nullptr) {
+            return node->left;
+        }
+        FreeRange* successor;
+        FreeRange* right = removeMin(node->right, &successor);
+        successor->left = node->left;
+        successor->right = right;
+        return balance(successor);
+    }
+    return balance(node);
+}
+
+/**
+ * @brief Finds the free range with the lowest address that has at least size bytes.
+ */
+static FreeRange* findFit(uint64_t size) {
+    FreeRange* node = root;
+    while (node != nullptr && node->largest >= size) {
+        if (getLargest(node->left) >= size) {
+            node = node->left;
+        } else if (node->size >= size) {
+            return node;
+        } else {
+            node = node->right;
+        }
+    }
+    return nullptr;
+}
+
+static void addFreeRange(uint64_t start, uint64_t size) {
+    FreeRange* range = takeNode();
+    range->start = start;
+    range->size = size;
+    root = insert(root, range);
+}
+
+static void init() {
+    root = nullptr;
+    addFreeRange(VirtualAllocator::rangeStart, VirtualAllocator::rangeEnd - VirtualAllocator::rangeStart);
+    initialized = true;
+}
+
+uint64_t VirtualAllocator::reserve(uint64_t count, uint64_t alignment) {
+    if (count == 0) {
+        return 0;
+    }
+    alignment = max(alignment, pageSize);
+    uint64_t size = (count + guardPages) * pageSize;
+    SpinLockGuard guard(rangeLock);
+    if (!initialized) {
+        init();
+    }
+    FreeRange* range = findFit(size + alignment - pageSize);// enough for every possible alignment offset
+    if (range == nullptr) {
+        Output::getDefault()->printf("VirtualAllocator: no range of %llu pages left\n", count);
+        return 0;
+    }
+    uint64_t rangeStart = range->start;
+    uint64_t rangeSize = range->size;
+    uint64_t start = (rangeStart + alignment - 1) & ~(alignment - 1);
+    root = remove(root, rangeStart);
+    returnNode(range);
+    if (start > rangeStart) {
+        addFreeRange(rangeStart, start - rangeStart);
+    }
+    if (start + size < rangeStart + rangeSize) {
+        addFreeRange(start + size, rangeStart + rangeSize - start - size);
+    }
+    reservedSize += size;
+    return start;
+}
+
+void VirtualAllocator::release(uint64_t address, uint64_t count) {
+    if (address == 0 || count == 0) {
+        return;
+    }
+    uint64_t start = address;
+    uint64_t size = (count + guardPages) * pageSize;
+    SpinLockGuard guard(rangeLock);
+    reservedSize -= min(reservedSize, size);
+    //merge with the free ranges directly before and after
+    FreeRange* before = nullptr;
+    FreeRange* after = nullptr;
+    for (FreeRange* node = root; node != nullptr;) {
+        if (node->start < address) {
+            before = node;
+            node = node->right;
+        } else {
+            if (node->start == address + size) {
+                after = node;
+            }
+            node = node->left;
+        }
+    }
+    if (before != nullptr && before->start + before->size == address) {
+        start = before->start;
+        size += before->size;
+        root = remove(root, before->start);
+        returnNode(before);
+    }
+    if (after != nullptr) {
+        size += after->size;
+        root = remove(root, after->start);
+        returnNode(after);
+    }
+    addFreeRange(start, size);
+}
+
+uint64_t VirtualAllocator::getReservedSize() {
+    return __atomic_load_n(&reservedSize, __ATOMIC_RELAXED);
+}
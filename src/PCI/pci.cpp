@@ -81,7 +81,7 @@ static void iterateDevicesHelperFunction(uint8_t bus, uint8_t device, uint8_t fu
     pciDevice.device = device;
     pciDevice.function = function;
     pciDevice.physicalAddress = getConfigurationSpace(bus, device, function);
-    uint8_t* ptr = TempMemory::mapPages(pciDevice.physicalAddress, 1, false);// configuration space is exactly one page (4KiB)
+    uint8_t* ptr = TempMemory::mapMMIO(pciDevice.physicalAddress, 1);// configuration space is exactly one page (4KiB)
     uint16_t vendor = pciDevice.readConfigWord(0);
     if (vendor == 0xFFFF) {
         return;// device not present
@@ -198,35 +198,35 @@ void PCI::init() {
 //------------------------------------------------------------------------------
 
 uint8_t PCI::readConfigByte(uint64_t offset) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     return ptr[offset];
 }
 uint16_t PCI::readConfigWord(uint64_t offset) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     return *(uint16_t*) (ptr + offset);
 }
 uint32_t PCI::readConfigDWord(uint64_t offset) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     return *(uint32_t*) (ptr + offset);
 }
 uint64_t PCI::readConfigQWord(uint64_t offset) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     return *(uint64_t*) (ptr + offset);
 }
 void PCI::writeConfigByte(uint64_t offset, uint8_t value) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     ptr[offset] = value;
 }
 void PCI::writeConfigWord(uint64_t offset, uint16_t value) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     *(uint16_t*) (ptr + offset) = value;
 }
 void PCI::writeConfigDWord(uint64_t offset, uint32_t value) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     *(uint32_t*) (ptr + offset) = value;
 }
 void PCI::writeConfigQWord(uint64_t offset, uint64_t value) {
-    uint8_t* ptr = TempMemory::mapPages(physicalAddress, 1, false);
+    uint8_t* ptr = TempMemory::mapMMIO(physicalAddress, 1);
     *(uint64_t*) (ptr + offset) = value;
 }
 
@@ -246,10 +246,51 @@ PCI::BAR PCI::getBar(uint8_t index) {
         return BAR{address & ~0b11ull, (uint8_t) (address & 0b11ull)};
     } else {
         uint64_t memory = address & ~0b1111ull;
-        return BAR{(uint64_t) TempMemory::mapPages(memory, 1, false), (uint8_t) (address & 0b1111ull)};
+        return BAR{(uint64_t) TempMemory::mapMMIO(memory, 1), (uint8_t) (address & 0b1111ull)};
     }
 }
 
+void PCI::enableBusMaster() {
+    uint16_t command = readConfigWord(0x04);
+    command |= 0b110;// memory space, bus master
+    writeConfigWord(0x04, command);
+}
+
+uint8_t PCI::findCapability(uint8_t id) {
+    if (!(readConfigWord(0x06) & (1 << 4))) {// status: capability list
+        return 0;
+    }
+    uint8_t offset = readConfigByte(0x34) & ~0b11;
+    for (uint8_t i = 0; i < 48 && offset != 0; ++i) {// the list can not be longer than the config space
+        if (readConfigByte(offset) == id) {
+            return offset;
+        }
+        offset = readConfigByte(offset + 1) & ~0b11;
+    }
+    return 0;
+}
+
+bool PCI::enableMSI(uint8_t vector, uint8_t apicId) {
+    uint8_t capability = findCapability(0x05);
+    if (capability == 0) {
+        return false;
+    }
+    uint16_t control = readConfigWord(capability + 2);
+    uint32_t address = 0xFEE00000 | ((uint32_t) apicId << 12);// fixed delivery, physical destination
+    writeConfigDWord(capability + 4, address);
+    if (control & (1 << 7)) {// 64 bit address
+        writeConfigDWord(capability + 8, 0);
+        writeConfigWord(capability + 12, vector);
+    } else {
+        writeConfigWord(capability + 8, vector);
+    }
+    control &= ~(0b111 << 4);// one message
+    control |= 0b1;
+    writeConfigWord(capability + 2, control);
+    writeConfigWord(0x04, readConfigWord(0x04) | (1 << 10));// disable the legacy interrupt line
+    return true;
+}
+
 uint8_t PCI::BAR::readByte(uint64_t offset) {
     if (isIO()) {
         return in8((uint16_t) (offset + baseAddress));
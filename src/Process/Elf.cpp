@@ -55,9 +55,13 @@ ElfFile::ProgramHeader ElfFile::getProgramSegment(uint64_t segment) const {
 
 ElfFile::ElfFile(const char* name) {
     data = make_shared<Data>();
-    data->filename = name;
     data->valid = false;
-    Filesystem::read(name, 0, sizeof(data->header), (uint8_t*) &data->header);
+    if (!Filesystem::lookup(name, data->file)) {
+        return;
+    }
+    if (Filesystem::read(data->file, 0, sizeof(data->header), (uint8_t*) &data->header) != sizeof(data->header)) {
+        return;
+    }
     if (data->header.magic[0] != 0x7F || data->header.magic[1] != 'E' || data->header.magic[2] != 'L' || data->header.magic[3] != 'F') {
         Output::getDefault()->printf("Elf: Invalid magic in ELF file: %s\n", name);
         return;
@@ -83,7 +87,7 @@ ElfFile::ElfFile(const char* name) {
     //  allocate memory for program headers
     data->programHeaders = unique_ptr(new ProgramHeader::ElfProgHeader[phnum]);
     //  read program headers
-    int64_t programHeaderReadResult = Filesystem::read(name, phoff, phnum * phentsize, (uint8_t*) data->programHeaders.get());
+    int64_t programHeaderReadResult = Filesystem::read(data->file, phoff, phnum * phentsize, (uint8_t*) data->programHeaders.get());
     if (programHeaderReadResult != phnum * phentsize) {
         Output::getDefault()->printf("Elf: Failed to read program headers in ELF file: %s\n", name);
         return;
@@ -102,7 +106,7 @@ ElfFile::ElfFile(const char* name) {
     //  allocate memory for section headers
     data->sectionHeaders = unique_ptr(new SectionHeader::ElfSecHeader[shnum]);
     //  read section headers
-    int64_t sectionHeaderReadResult = Filesystem::read(name, shoff, shnum * shentsize, (uint8_t*) data->sectionHeaders.get());
+    int64_t sectionHeaderReadResult = Filesystem::read(data->file, shoff, shnum * shentsize, (uint8_t*) data->sectionHeaders.get());
     if (sectionHeaderReadResult != shnum * shentsize) {
         Output::getDefault()->printf("Elf: Failed to read section headers in ELF file: %s\n", name);
         return;
@@ -115,7 +119,7 @@ ElfFile::ElfFile(const char* name) {
     //  allocate memory for section header string table
     data->sectionHeadersStringTable = unique_ptr(new uint8_t[stringSectionSize]);
     //  read section header string table
-    if (Filesystem::read(name, stringSectionOffset, stringSectionSize, data->sectionHeadersStringTable.get()) < stringSectionSize) {
+    if (Filesystem::read(data->file, stringSectionOffset, stringSectionSize, data->sectionHeadersStringTable.get()) < stringSectionSize) {
         Output::getDefault()->printf("Elf: Failed to read section header string table in ELF file: %s\n", name);
         return;
     }
@@ -131,16 +135,13 @@ unique_ptr<Process> ElfFile::spawnProcess() {
             Mapping::Flags flag;
             flag.writable = segment.header().flags & 1;
             flag.executable = segment.header().flags & 2;
-            uint64_t pageCount = (segment.getSize() + pageSize - 1) / pageSize;
-            uint64_t start = segment.getVirtAddr();
-            for (uint64_t index = 0; index < pageCount; ++index) {
-                uint64_t page = start + index * pageSize;
-                uint64_t physical = PhysicalAllocator::allocatePhysicalMemory(1);
-                process->getProcessMemory().map(page, physical, pageSize, flag);
-            }
+            //the segment is read on the first access, the memory behind the file data is zero filled
+            uint64_t start = segment.getVirtAddr() & ~(pageSize - 1);
+            uint64_t skipped = segment.getVirtAddr() - start;
+            process->getProcessMemory().mapFile(start, segment.getSize() + skipped, flag, data->file,
+                                                segment.getFileOffset() - skipped, segment.getFileSize() + skipped);
         }
     }
-    process->getProcessMemory().compact();
     return process;
 }
 
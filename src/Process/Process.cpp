@@ -1,87 +1,479 @@
 #include "Process/Process.hpp"
+#include "CPUControl/smp.hpp"
+#include "CPUControl/spinlock.hpp"
+#include "Common/Math.hpp"
 #include "LanguageFeatures/Types.hpp"
+#include "LanguageFeatures/memory.hpp"
 #include "Memory/pageTable.hpp"
+#include "Memory/physicalAllocator.hpp"
+#include "Memory/tempMapping.hpp"
+#include "Storage/Filesystem.hpp"
+#include "Storage/PageCache.hpp"
 
-Mapping::Mapping() {
-    head = nullptr;
+static Process* currentProcesses[SMP::maxCPUCount];
+
+static PageTable::Option getPageOption(Mapping::Flags flags) {
+    return {
+            /*writeEnable:*/ flags.writable,
+            /*userAvailable:*/ true,
+            /*memoryType:*/ PageTable::MemoryType::WriteBack,
+            /*executeDisable:*/ false,
+    };
+}
+
+Mapping::Mapping() : root(nullptr), entryCount(0), lock() {
+}
+
+Mapping::~Mapping() {
+    destroy(root);
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------[Tree]---------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+Mapping::Entry* Mapping::balance(Entry* node) {
+    auto height = [](Entry* entry) -> int { return entry ? entry->height : 0; };
+    auto update = [&](Entry* entry) { entry->height = max(height(entry->left), height(entry->right)) + 1; };
+    auto rotateRight = [&](Entry* entry) {
+        Entry* left = entry->left;
+        entry->left = left->right;
+        left->right = entry;
+        update(entry);
+        update(left);
+        return left;
+    };
+    auto rotateLeft = [&](Entry* entry) {
+        Entry* right = entry->right;
+        entry->right = right->left;
+        right->left = entry;
+        update(entry);
+        update(right);
+        return right;
+    };
+    update(node);
+    int difference = height(node->left) - height(node->right);
+    if (difference > 1) {
+        if (height(node->left->left) < height(node->left->right)) {
+            node->left = rotateLeft(node->left);
+        }
+        return rotateRight(node);
+    }
+    if (difference < -1) {
+        if (height(node->right->right) < height(node->right->left)) {
+            node->right = rotateRight(node->right);
+        }
+        return rotateLeft(node);
+    }
+    return node;
+}
+
+Mapping::Entry* Mapping::insert(Entry* node, Entry* entry) {
+    if (node == nullptr) {
+        entry->left = nullptr;
+        entry->right = nullptr;
+        entry->height = 1;
+        return entry;
+    }
+    if (entry->virtAddr < node->virtAddr) {
+        node->left = insert(node->left, entry);
+    } else {
+        node->right = insert(node->right, entry);
+    }
+    return balance(node);
+}
+
+Mapping::Entry* Mapping::removeMin(Entry* node, Entry** removed) {
+    if (node->left == nullptr) {
+        *removed = node;
+        return node->right;
+    }
+    node->left = removeMin(node->left, removed);
+    return balance(node);
+}
+
+Mapping::Entry* Mapping::remove(Entry* node, uint64_t virtAddr, Entry** removed) {
+    if (node == nullptr) {
+        return nullptr;
+    }
+    if (virtAddr < node->virtAddr) {
+        node->left = remove(node->left, virtAddr, removed);
+    } else if (virtAddr > node->virtAddr) {
+        node->right = remove(node->right, virtAddr, removed);
+    } else {
+        *removed = node;
+        if (node->left == nullptr) {
+            return node->right;
+        }
+        if (node->right == nullptr) {
+            return node->left;
+        }
+        //the node is replaced by its successor, the entries themselves never move
+        Entry* successor;
+        Entry* right = removeMin(node->right, &successor);
+        successor->left = node->left;
+        successor->right = right;
+        return balance(successor);
+    }
+    return balance(node);
+}
+
+void Mapping::destroy(Entry* node) {
+    if (node == nullptr) {
+        return;
+    }
+    destroy(node->left);
+    destroy(node->right);
+    //the filled pages and page cache references of lazily filled entries belong to the mapping, unload already released them if it ran
+    releasePages(node, node->virtAddr, node->virtAddr + node->size);
+    delete node;
+}
+
+template<typename Callback>
+void Mapping::forEach(Entry* node, Callback callback) {
+    if (node == nullptr) {
+        return;
+    }
+    forEach(node->left, callback);
+    callback(node);
+    forEach(node->right, callback);
+}
+
+Mapping::Entry* Mapping::findEntry(uint64_t address) {
+    Entry* found = nullptr;
+    for (Entry* node = root; node != nullptr;) {
+        if (node->virtAddr <= address) {
+            found = node;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    if (found != nullptr && address < found->virtAddr + found->size) {
+        return found;
+    }
+    return nullptr;
+}
+
+Mapping::Entry* Mapping::findFirstEnd(uint64_t address) {
+    Entry* found = nullptr;
+    for (Entry* node = root; node != nullptr;) {
+        if (node->virtAddr + node->size > address) {
+            found = node;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+void Mapping::add(Entry* entry) {
+    root = insert(root, entry);
+    entryCount++;
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------[Entries]-------------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+void Mapping::initPages(Entry* entry) {
+    uint64_t pageCount = (entry->size + pageSize - 1) / pageSize;
+    entry->pages = unique_ptr(new uint64_t[pageCount]);
+    memset(entry->pages.get(), 0, pageCount * sizeof(uint64_t));
+}
+
+Mapping::Entry* Mapping::createPart(const Entry* entry, uint64_t start, uint64_t end) {
+    uint64_t offset = start - entry->virtAddr;
+    Entry* part = new Entry();
+    part->virtAddr = start;
+    part->physAddr = entry->source == Source::Physical ? entry->physAddr + offset : 0;
+    part->size = end - start;
+    part->flags = entry->flags;
+    part->source = entry->source;
+    part->file = entry->file;
+    part->fileOffset = entry->fileOffset + offset;
+    part->fileSize = entry->fileSize > offset ? entry->fileSize - offset : 0;
+    if (entry->pages) {
+        initPages(part);
+        memcpy(part->pages.get(), entry->pages.get() + offset / pageSize, (part->size + pageSize - 1) / pageSize * sizeof(uint64_t));
+    }
+    return part;
+}
+
+void Mapping::releasePages(Entry* entry, uint64_t start, uint64_t end) {
+    if (!entry->pages) {
+        return;
+    }
+    uint64_t last = (end - entry->virtAddr + pageSize - 1) / pageSize;
+    for (uint64_t i = (start - entry->virtAddr) / pageSize; i < last; ++i) {
+        if (entry->pages.get()[i] != 0) {
+            PhysicalAllocator::releaseReference(entry->pages.get()[i]);
+            entry->pages.get()[i] = 0;
+        }
+    }
 }
 
 void Mapping::map(uint64_t virtAddr, uint64_t physAddr, uint64_t size, Flags flags) {
-    auto entry = make_unique<Entry>();
+    Entry* entry = new Entry();
     entry->virtAddr = virtAddr;
     entry->physAddr = physAddr;
     entry->size = size;
     entry->flags = flags;
-    entry->next = std::move(head);
-    head = std::move(entry);
+    entry->source = Source::Physical;
+    SpinLockGuard guard(lock);
+    add(entry);
 }
 
-void Mapping::unmap(uint64_t virtAddr, uint64_t size) {
-    //look for entry that contains virtAddr
-    for (auto entry = head.get(); entry != nullptr; entry = entry->next.get();) {
-        if (entry->virtAddr <= virtAddr && entry->virtAddr + entry->size >= virtAddr + size) {
-            //found entry
-            if (entry->virtAddr == virtAddr && entry->size == size) {
-                //remove entry
-                head = std::move(entry->next);
+void Mapping::mapFile(uint64_t virtAddr, uint64_t size, Flags flags, const Filesystem::Node& file, uint64_t fileOffset, uint64_t fileSize) {
+    Entry* entry = new Entry();
+    entry->virtAddr = virtAddr;
+    entry->physAddr = 0;
+    entry->size = size;
+    entry->flags = flags;
+    entry->source = Source::File;
+    entry->file = file;
+    entry->fileOffset = fileOffset;
+    entry->fileSize = fileSize;
+    initPages(entry);
+    SpinLockGuard guard(lock);
+    add(entry);
+}
+
+bool Mapping::isMapped(uint64_t address) {
+    SpinLockGuard guard(lock);
+    return findEntry(address) != nullptr;
+}
+
+static uint64_t fillPage(Mapping::Source source, const Filesystem::Node& file, uint64_t fileOffset, uint64_t fileBytes) {
+    if (source == Mapping::Source::File && fileBytes == pageSize && fileOffset % pageSize == 0) {
+        //share the cached page, it is copied on the first write
+        uint64_t validBytes;
+        uint64_t cached = PageCache::getPage(file.filesystem, file.inode, fileOffset / pageSize, &validBytes);
+        if (cached != 0 && validBytes == pageSize) {
+            return cached;
+        }
+        if (cached != 0) {
+            PhysicalAllocator::releaseReference(cached);
+        }
+    }
+    if (source == Mapping::Source::Zero || fileBytes == 0) {
+        return PhysicalAllocator::allocatePhysicalMemory(1, pageSize, PhysicalAllocator::Flags::Zeroed);
+    }
+    uint64_t physical = PhysicalAllocator::allocatePhysicalMemory(1);
+    uint8_t* memory = TempMemory::mapPages(physical, 1, false);
+    int64_t read = Filesystem::read(file, fileOffset, fileBytes, memory);
+    fileBytes = read < 0 ? 0 : (uint64_t) read;
+    memset(memory + fileBytes, 0, pageSize - fileBytes);
+    return physical;
+}
+
+bool Mapping::handlePageFault(uint64_t address, bool write) {
+    uint64_t page = address & ~(pageSize - 1);
+    uint64_t physical = 0;
+    uint64_t released = 0;
+    uint64_t prepared = 0;   // page filled or copied without the lock
+    uint64_t preparedFor = 0;// slot value the prepared page replaces, 0 for a fill
+    bool found = false;
+    PageTable::Option option;
+    while (true) {
+        Source source = Source::Zero;
+        Filesystem::Node file{};
+        uint64_t fileOffset = 0;
+        uint64_t fileBytes = 0;
+        uint64_t copyFrom = 0;
+        {
+            SpinLockGuard guard(lock);
+            Entry* entry = findEntry(address);
+            if (entry == nullptr || (write && !entry->flags.writable)) {
+                break;
+            }
+            uint64_t offset = page - entry->virtAddr;
+            option = getPageOption(entry->flags);
+            if (entry->source == Source::Physical) {
+                physical = entry->physAddr + offset;
+                found = true;
+                break;
+            }
+            uint64_t& slot = entry->pages.get()[offset / pageSize];
+            bool needsCopy = slot != 0 && write && PhysicalAllocator::getShareCount(slot) > 1;
+            if (prepared != 0 && slot == preparedFor && (slot == 0 || needsCopy)) {
+                //nobody changed the slot while the page was prepared, a copied page is released once no tlb maps it anymore
+                released = slot;
+                slot = prepared;
+                prepared = 0;
+                //a filled page can be a shared page cache frame, a write copies it in the same fault
+                needsCopy = write && PhysicalAllocator::getShareCount(slot) > 1;
+            }
+            if (slot != 0 && !needsCopy) {
+                physical = slot;
+                option.writeEnable = entry->flags.writable && PhysicalAllocator::getShareCount(physical) == 1;
+                found = true;
+                break;
+            }
+            preparedFor = slot;
+            if (slot == 0) {
+                source = entry->source;
+                file = entry->file;
+                fileOffset = entry->fileOffset + offset;
+                fileBytes = offset < entry->fileSize ? min(pageSize, entry->fileSize - offset) : 0;
             } else {
-                //split entry
-                auto newEntry = make_unique<Entry>();
-                newEntry->virtAddr = entry->virtAddr + size;
-                newEntry->physAddr = entry->physAddr + size;
-                newEntry->size = entry->size - size;
-                newEntry->flags = entry->flags;
-                newEntry->next = std::move(entry->next);
-                entry->size = virtAddr - entry->virtAddr;
-                entry->next = std::move(newEntry);
+                copyFrom = slot;
+                PhysicalAllocator::addReference(copyFrom);// keeps it alive while it is copied
             }
-            return;
         }
+        //filled and copied without the lock, a file fill waits for the disk, with interrupts if the caller has them enabled (the fault handler keeps those of the faulting code)
+        if (prepared != 0) {
+            PhysicalAllocator::releaseReference(prepared);// the slot changed while it was prepared
+        }
+        if (copyFrom != 0) {
+            prepared = PhysicalAllocator::allocatePhysicalMemory(1);
+            memcpy(TempMemory::mapPages(prepared, 1, false), TempMemory::mapPages(copyFrom, 1, false), pageSize);
+            PhysicalAllocator::releaseReference(copyFrom);
+        } else {
+            prepared = fillPage(source, file, fileOffset, fileBytes);
+        }
+    }
+    if (prepared != 0) {
+        PhysicalAllocator::releaseReference(prepared);
+    }
+    if (!found) {
+        return false;
+    }
+    //mapped without the lock, a shootdown must not wait for cpus that spin on it
+    PageTable::map(physical, (void*) page, option);
+    if (released != 0) {
+        PhysicalAllocator::releaseReference(released);
+    }
+    return true;
+}
+
+
+void Mapping::clone(Mapping& target) {
+    {
+        SpinLockGuard guard(lock);
+        forEach(root, [&target](Entry* entry) {
+            Entry* copy = createPart(entry, entry->virtAddr, entry->virtAddr + entry->size);
+            if (copy->pages) {
+                uint64_t pageCount = (copy->size + pageSize - 1) / pageSize;
+                for (uint64_t i = 0; i < pageCount; ++i) {
+                    uint64_t& page = copy->pages.get()[i];
+                    if (page == 0) {
+                        continue;
+                    }
+                    if (entry->flags.writable && PhysicalAllocator::isPinned(page)) {
+                        //a device writes into the page, the copy on write would move the original away from it
+                        uint64_t copied = PhysicalAllocator::allocatePhysicalMemory(1);
+                        memcpy(TempMemory::mapPages(copied, 1, false), TempMemory::mapPages(page, 1, false), pageSize);
+                        page = copied;
+                    } else {
+                        PhysicalAllocator::addReference(page);
+                    }
+                }
+            }
+            target.add(copy);
+        });
+    }
+    //the shared pages are mapped read only again on the next access
+    forEach(root, [](Entry* entry) {
+        if (entry->pages && entry->flags.writable) {
+            PageTable::unmapRange(entry->virtAddr, entry->size);
+        }
+    });
+}
+
+void Mapping::unmap(uint64_t virtAddr, uint64_t size) {
+    uint64_t end = virtAddr + size;
+    Entry* removedEntries = nullptr;// linked through left, deleted without the lock
+    {
+        SpinLockGuard guard(lock);
+        for (Entry* entry = findFirstEnd(virtAddr); entry != nullptr && entry->virtAddr < end; entry = findFirstEnd(virtAddr)) {
+            Entry* removed;
+            root = remove(root, entry->virtAddr, &removed);
+            entryCount--;
+            uint64_t start = max(entry->virtAddr, virtAddr);
+            uint64_t stop = min(entry->virtAddr + entry->size, end);
+            releasePages(entry, start, stop);
+            if (entry->virtAddr < start) {
+                add(createPart(entry, entry->virtAddr, start));
+            }
+            if (stop < entry->virtAddr + entry->size) {
+                add(createPart(entry, stop, entry->virtAddr + entry->size));
+            }
+            entry->left = removedEntries;
+            removedEntries = entry;
+        }
+    }
+    while (removedEntries != nullptr) {
+        Entry* next = removedEntries->left;
+        delete removedEntries;
+        removedEntries = next;
     }
 }
 
 void Mapping::compact() {
-    bool compacted;
-    do {
-        compacted = false;
-        for (auto entry = head.get(); entry != nullptr; entry = entry->next.get()) {
-            if (entry->next != nullptr && entry->virtAddr + entry->size == entry->next->virtAddr && entry->physAddr + entry->size == entry->next->physAddr) {
+    Entry* removedEntries = nullptr;// linked through left, deleted without the lock
+    {
+        SpinLockGuard guard(lock);
+        Entry* entry = findFirstEnd(0);
+        while (entry != nullptr) {
+            Entry* next = findFirstEnd(entry->virtAddr + entry->size);
+            if (next != nullptr && entry->source == Source::Physical && next->source == Source::Physical && entry->virtAddr + entry->size == next->virtAddr && entry->physAddr + entry->size == next->physAddr && entry->flags.writable == next->flags.writable && entry->flags.executable == next->flags.executable) {
                 //merge entries
-                entry->size += entry->next->size;
-                entry->next = std::move(entry->next->next);
-                compacted = true;
+                Entry* removed;
+                root = remove(root, next->virtAddr, &removed);
+                entryCount--;
+                entry->size += next->size;
+                next->left = removedEntries;
+                removedEntries = next;
+            } else {
+                entry = next;
             }
         }
-    } while (compacted);
+    }
+    while (removedEntries != nullptr) {
+        Entry* next = removedEntries->left;
+        delete removedEntries;
+        removedEntries = next;
+    }
 }
 
 void Mapping::load() {
-    for (auto entry = head.get(); entry != nullptr; entry = entry->next.get()) {
-        auto virtAddr = entry->virtAddr;
-        auto physAddr = entry->physAddr;
-        auto size = entry->size;
-        auto flags = entry->flags;
-        for (uint64_t i = 0; i < size; i += pageSize) {
-            auto page = physAddr + i;
-            auto virtPage = virtAddr + i;
-            PageTable::map(page, (uint8_t*) virtPage, {
-                                                              /*writeEnable:*/ flags.writable,
-                                                              /*userAvailable:*/ true,
-                                                              /*writeThrough:*/ false,
-                                                              /*cacheDisable:*/ false,
-                                                              /*executeDisable:*/ false,
-                                                      });
+    forEach(root, [](Entry* entry) {
+        if (entry->source != Source::Physical) {
+            return;// mapped on the first access
         }
-    }
+        PageTable::mapRange(entry->physAddr, (uint8_t*) entry->virtAddr, entry->size, getPageOption(entry->flags));
+    });
 }
 
 void Mapping::unload() {
-    for (auto entry = head.get(); entry != nullptr; entry = entry->next.get()) {
-        auto virtAddr = entry->virtAddr;
-        auto size = entry->size;
-        for (uint64_t i = 0; i < size; i += pageSize) {
-            auto virtPage = virtAddr + i;
-            PageTable::unmap(virtPage);
-        }
+    forEach(root, [this](Entry* entry) {
+        PageTable::unmapRange(entry->virtAddr, entry->size);
+        //the pages of lazily filled entries belong to the mapping, shared ones to all mappings that use them
+        SpinLockGuard guard(lock);
+        releasePages(entry, entry->virtAddr, entry->virtAddr + entry->size);
+    });
+}
+
+Process::Process() : loaded(false) {
+}
+
+void Process::activate() {
+    addressSpace.activate();
+    currentProcesses[SMP::getIndex()] = this;
+    if (!loaded) {
+        processMemory.load();
+        loaded = true;
     }
+}
+
+unique_ptr<Process> Process::fork() {
+    unique_ptr<Process> child = make_unique<Process>();
+    processMemory.clone(child->processMemory);
+    return child;
+}
+
+Process* Process::getCurrent() {
+    return currentProcesses[SMP::getIndex()];
 }
\ No newline at end of file
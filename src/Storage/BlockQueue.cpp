@@ -0,0 +1,322 @@
+#include "Storage/BlockQueue.hpp"
+#include "CPUControl/smp.hpp"
+#include "Common/Math.hpp"
+#include "LanguageFeatures/memory.hpp"
+#include "Memory/memory.hpp"
+#include "Storage/Storage.hpp"
+
+// copies size bytes starting at offset in the buffers of from to the start of the buffers of to, page by page through the kernel addresses
+static void copyBetween(BlockRequest& from, uint64_t offset, BlockRequest& to, uint64_t size) {
+    uint64_t fromIndex = 0;
+    while (offset >= from.segments[fromIndex].size) {
+        offset -= from.segments[fromIndex].size;
+        fromIndex++;
+    }
+    uint64_t toIndex = 0;
+    uint64_t toOffset = 0;
+    while (size > 0) {
+        BlockSegment& source = from.segments[fromIndex];
+        BlockSegment& destination = to.segments[toIndex];
+        uint64_t sourcePage = pageSize - (((uint64_t) source.buffer + offset) & (pageSize - 1));
+        uint64_t destinationPage = pageSize - (((uint64_t) destination.buffer + toOffset) & (pageSize - 1));
+        uint64_t length = min(min(min(source.size - offset, destination.size - toOffset), min(sourcePage, destinationPage)), size);
+        memcpy(destination.getKernelAddress(toOffset), source.getKernelAddress(offset), length);
+        size -= length;
+        offset += length;
+        toOffset += length;
+        if (offset == source.size) {
+            fromIndex++;
+            offset = 0;
+        }
+        if (toOffset == destination.size) {
+            toIndex++;
+            toOffset = 0;
+        }
+    }
+}
+
+BlockQueue::BlockQueue(Storage& storage)
+    : storage(storage), commands(new Command[maxCommands]), lock(), sorted(nullptr), position(0), sequence(0), statistics() {
+    for (uint64_t i = 0; i < maxCommands; ++i) {
+        commands[i].used = false;
+        commands[i].queue = this;
+    }
+}
+
+BlockQueue::~BlockQueue() {
+    delete[] commands;
+}
+
+bool BlockQueue::submit(BlockRequest& request) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < request.segmentCount; ++i) {
+        if (((uint64_t) request.segments[i].buffer | request.segments[i].size) & 1) {
+            return false;// a merged command would fail for all its requests
+        }
+        total += request.segments[i].size;
+    }
+    if (request.sectorCount == 0 || total != request.getSize() || (request.getStartSector() + request.sectorCount) * BlockRequest::sectorSize > storage.getSize()) {
+        return false;
+    }
+    if (!request.pin()) {
+        return false;
+    }
+    request.waitingCPU = SMP::getIndex();
+    request.result = 0;
+    request.next = nullptr;
+    request.shared = nullptr;
+    {
+        SpinLockGuard guard(lock);
+        statistics.submitted++;
+        request.queuedAt = sequence;
+        if (!request.write) {
+            uint64_t start = request.getStartSector();
+            uint64_t end = start + request.sectorCount;
+            for (BlockRequest* host = sorted; host && host->getStartSector() <= start; host = host->next) {
+                if (!host->write && host->getStartSector() + host->sectorCount >= end) {
+                    request.next = host->shared;
+                    host->shared = &request;
+                    statistics.sharedReads++;
+                    return true;
+                }
+            }
+        }
+        insertSorted(request);
+    }
+    dispatch();
+    return true;
+}
+
+bool BlockQueue::cancel(BlockRequest& request) {
+    SpinLockGuard guard(lock);
+    BlockRequest* previous = nullptr;
+    for (BlockRequest* current = sorted; current; previous = current, current = current->next) {
+        if (current == &request) {
+            if (request.shared) {
+                return false;// other reads wait for its data
+            }
+            (previous ? previous->next : sorted) = request.next;
+            request.next = nullptr;
+            request.unpin();
+            statistics.queued--;
+            return true;
+        }
+        for (BlockRequest** link = &current->shared; *link; link = &(*link)->next) {
+            if (*link == &request) {
+                *link = request.next;
+                request.next = nullptr;
+                request.unpin();
+                return true;
+            }
+        }
+    }
+    return false;// already sent to the storage or finished
+}
+
+BlockQueue::Statistics BlockQueue::getStatistics() {
+    SpinLockGuard guard(lock);
+    return statistics;
+}
+
+void BlockQueue::insertSorted(BlockRequest& request) {
+    BlockRequest** link = &sorted;
+    while (*link && (*link)->getStartSector() <= request.getStartSector()) {
+        link = &(*link)->next;
+    }
+    request.next = *link;
+    *link = &request;
+    statistics.queued++;
+    statistics.maxQueued = max(statistics.maxQueued, statistics.queued);
+}
+
+BlockRequest* BlockQueue::takeNext() {
+    BlockRequest** chosen = nullptr;
+    // a request that waited too long goes first, the oldest of them
+    for (BlockRequest** link = &sorted; *link; link = &(*link)->next) {
+        BlockRequest* request = *link;
+        if (sequence - request->queuedAt > (request->write ? writeExpire : readExpire) && (!chosen || request->queuedAt < (*chosen)->queuedAt)) {
+            chosen = link;
+        }
+    }
+    if (chosen) {
+        statistics.expired++;
+    } else {
+        // otherwise the next one in the direction of the last command, wrapping around to the lowest sector
+        chosen = &sorted;
+        for (BlockRequest** link = &sorted; *link; link = &(*link)->next) {
+            if ((*link)->getStartSector() >= position) {
+                chosen = link;
+                break;
+            }
+        }
+    }
+    BlockRequest* request = *chosen;
+    *chosen = request->next;
+    request->next = nullptr;
+    statistics.queued--;
+    return request;
+}
+
+BlockQueue::Command* BlockQueue::buildCommand() {
+    uint64_t depth = min<uint64_t>(storage.getQueueDepth(), maxCommands);
+    if (!sorted || statistics.inFlight >= depth) {
+        return nullptr;
+    }
+    Command* command = nullptr;
+    for (uint64_t i = 0; i < maxCommands; ++i) {
+        if (!commands[i].used) {
+            command = &commands[i];
+            break;
+        }
+    }
+    if (!command) {
+        return nullptr;
+    }
+
+    BlockRequest* first = takeNext();
+    uint64_t start = first->getStartSector();
+    uint64_t end = start + first->sectorCount;
+    uint64_t segmentCount = first->segmentCount;
+    BlockRequest* last = first;
+    command->members = first;
+
+    // requests with more segments than fit in a command go to the storage as they are
+    bool merged = segmentCount <= maxSegments;
+    while (merged) {
+        merged = false;
+        for (BlockRequest** link = &sorted; *link; link = &(*link)->next) {
+            BlockRequest* candidate = *link;
+            if (candidate->write != first->write || end - start + candidate->sectorCount > maxMergeSectors ||
+                segmentCount + candidate->segmentCount > maxSegments) {
+                continue;
+            }
+            if (candidate->getStartSector() == end) {
+                last->next = candidate;
+                *link = candidate->next;
+                candidate->next = nullptr;
+                last = candidate;
+                end += candidate->sectorCount;
+                statistics.backMerges++;
+            } else if (candidate->getStartSector() + candidate->sectorCount == start) {
+                *link = candidate->next;
+                candidate->next = command->members;
+                command->members = candidate;
+                start = candidate->getStartSector();
+                statistics.frontMerges++;
+            } else {
+                continue;
+            }
+            segmentCount += candidate->segmentCount;
+            statistics.queued--;
+            merged = true;
+            break;
+        }
+    }
+
+    BlockRequest& request = command->request;
+    request = BlockRequest{};
+    request.sectorIndex = start;
+    request.sectorCount = end - start;
+    request.write = first->write;
+    request.callback = onCommandDone;
+    request.context = command;
+    if (command->members->next) {
+        request.segments = command->segments;
+        for (BlockRequest* member = command->members; member; member = member->next) {
+            for (uint64_t i = 0; i < member->segmentCount; ++i) {
+                command->segments[request.segmentCount++] = member->segments[i];
+            }
+        }
+    } else {
+        request.segments = first->segments;
+        request.segmentCount = first->segmentCount;
+    }
+
+    command->used = true;
+    position = end;
+    sequence++;
+    statistics.dispatched++;
+    statistics.inFlight++;
+    statistics.maxInFlight = max(statistics.maxInFlight, statistics.inFlight);
+    return command;
+}
+
+void BlockQueue::dispatch() {
+    while (true) {
+        Command* command;
+        {
+            SpinLockGuard guard(lock);
+            command = buildCommand();
+        }
+        if (!command) {
+            return;
+        }
+        // submit outside of the lock, a storage may complete the request before it returns
+        if (!storage.submit(command->request)) {
+            InterruptGuard guard;// completions run with interrupts disabled
+            command->request.result = -1;
+            finish(*command);
+        }
+    }
+}
+
+void BlockQueue::finish(Command& command) {
+    int64_t result = command.request.result;
+    BlockRequest* finished = nullptr;
+    {
+        SpinLockGuard guard(lock);
+        uint64_t offset = 0;
+        BlockRequest* member = command.members;
+        bool isFirst = true;
+        while (member) {
+            BlockRequest* next = member->next;
+            uint64_t size = member->getSize();
+            if (result >= 0 && (uint64_t) result < offset + size && !isFirst) {
+                // a short transfer, the storage starts this one again later
+                insertSorted(*member);
+                statistics.requeued++;
+            } else {
+                if (result < 0) {
+                    member->result = -1;
+                } else {
+                    member->result = min((uint64_t) result - offset, size);
+                }
+                member->next = finished;
+                finished = member;
+            }
+            offset += size;
+            isFirst = false;
+            member = next;
+        }
+        command.used = false;
+        statistics.inFlight--;
+    }
+
+    while (finished) {
+        BlockRequest* member = finished;
+        finished = member->next;
+        BlockRequest* shared = member->shared;
+        while (shared) {
+            BlockRequest* next = shared->next;
+            uint64_t offset = (shared->getStartSector() - member->getStartSector()) * BlockRequest::sectorSize;
+            if (member->result >= 0 && (uint64_t) member->result >= offset + shared->getSize()) {
+                copyBetween(*member, offset, *shared, shared->getSize());
+                shared->result = shared->getSize();
+            } else {
+                shared->result = -1;
+            }
+            shared->unpin();
+            shared->complete();
+            shared = next;
+        }
+        member->unpin();
+        member->complete();
+    }
+}
+
+void BlockQueue::onCommandDone(BlockRequest& request) {
+    Command* command = (Command*) request.context;
+    BlockQueue* queue = command->queue;
+    queue->finish(*command);
+    queue->dispatch();
+}
@@ -1,8 +1,21 @@
 #include "Storage/Ext4.hpp"
+#include "Common/CRC32C.hpp"
 #include "Common/Math.hpp"
 #include "LanguageFeatures/memory.hpp"
+#include <stddef.h>
 
-Ext4::Ext4(shared_ptr<Partition> partition) : Filesystem(partition), valid(false) {
+constexpr uint32_t incompat64Bit = 0x80;
+constexpr uint32_t incompatChecksumSeed = 0x2000;
+constexpr uint32_t roCompatMetadataChecksum = 0x400;
+constexpr uint8_t checksumTypeCRC32C = 1;
+constexpr uint64_t oldDescriptorSize = 32;
+constexpr uint64_t oldINodeSize = 128;
+constexpr uint64_t superblockChecksumOffset = 0x3FC;
+constexpr uint64_t descriptorChecksumOffset = 0x1E;
+constexpr uint64_t inodeChecksumLowOffset = 0x7C;
+constexpr uint64_t inodeChecksumHighOffset = 0x82;
+
+Ext4::Ext4(shared_ptr<Partition> partition) : Filesystem(partition), valid(false), metadataChecksums(false), checksumSeed(0) {
     superblock = make_unique<Superblock>();
     if (partition->read(1024, sizeof(Superblock), (uint8_t*) superblock.get()) != sizeof(Superblock)) {
         Output::getDefault()->printf("Ext4: Failed to read superblock\n");
@@ -14,20 +27,101 @@ Ext4::Ext4(shared_ptr<Partition> partition) : Filesystem(partition), valid(false
     }
 
     blockSize = (1 << (10 + superblock->log_block_size));
+    descriptorSize = (superblock->feature_incompat & incompat64Bit) ? superblock->desc_size : oldDescriptorSize;
+
+    metadataChecksums = superblock->feature_ro_compat & roCompatMetadataChecksum;
+    if (metadataChecksums) {
+        if (superblock->checksum_type != checksumTypeCRC32C) {
+            Output::getDefault()->printf("Ext4: Unknown checksum type: %hhu\n", superblock->checksum_type);
+            return;
+        }
+        if (!verifySuperblock()) {
+            Output::getDefault()->printf("Ext4: Superblock has a wrong checksum\n");
+            return;
+        }
+        if (superblock->feature_incompat & incompatChecksumSeed) {
+            checksumSeed = superblock->checksum_seed;
+        } else {
+            checksumSeed = CRC32C::update(~0u, superblock->uuid, sizeof(superblock->uuid));
+        }
+    }
 
     valid = true;
 }
 
+bool Ext4::verifySuperblock() {
+    static_assert(offsetof(Superblock, checksum) == superblockChecksumOffset, "Superblock checksum offset is wrong");
+    return CRC32C::update(~0u, superblock.get(), superblockChecksumOffset) == superblock->checksum;
+}
+
+bool Ext4::verifyGroupDescriptor(uint32_t group, uint8_t* descriptor) {
+    static_assert(offsetof(GroupDesc, checksum) == descriptorChecksumOffset, "GroupDesc checksum offset is wrong");
+    uint16_t zero = 0;
+    uint32_t crc = CRC32C::update(checksumSeed, &group, sizeof(group));
+    crc = CRC32C::update(crc, descriptor, descriptorChecksumOffset);
+    crc = CRC32C::update(crc, &zero, sizeof(zero));
+    uint64_t rest = descriptorChecksumOffset + sizeof(zero);
+    if (descriptorSize > rest) {
+        crc = CRC32C::update(crc, descriptor + rest, descriptorSize - rest);
+    }
+    return (crc & 0xFFFF) == ((GroupDesc*) descriptor)->checksum;
+}
+
+uint32_t Ext4::getINodeSeed(uint64_t inodeNumber, uint32_t generation) {
+    uint32_t number = inodeNumber;
+    uint32_t crc = CRC32C::update(checksumSeed, &number, sizeof(number));
+    return CRC32C::update(crc, &generation, sizeof(generation));
+}
+
+bool Ext4::verifyINode(uint8_t* raw, uint32_t inodeSeed) {
+    static_assert(offsetof(INode, osd2.linux2.l_checksum_lo) == inodeChecksumLowOffset, "INode checksum offset is wrong");
+    static_assert(offsetof(INode, checksum_hi) == inodeChecksumHighOffset, "INode checksum offset is wrong");
+    INode* node = (INode*) raw;
+    uint16_t zero = 0;
+    // the checksum fields are replaced by zeros
+    uint32_t crc = CRC32C::update(inodeSeed, raw, inodeChecksumLowOffset);
+    crc = CRC32C::update(crc, &zero, sizeof(zero));
+    crc = CRC32C::update(crc, raw + inodeChecksumLowOffset + sizeof(zero), oldINodeSize - inodeChecksumLowOffset - sizeof(zero));
+    uint32_t expected = node->osd2.linux2.l_checksum_lo;
+    uint32_t mask = 0xFFFF;
+    if (superblock->inode_size > oldINodeSize) {
+        crc = CRC32C::update(crc, raw + oldINodeSize, inodeChecksumHighOffset - oldINodeSize);
+        uint64_t rest = inodeChecksumHighOffset;
+        if (node->extra_isize >= inodeChecksumHighOffset + sizeof(zero) - oldINodeSize) {
+            crc = CRC32C::update(crc, &zero, sizeof(zero));
+            rest += sizeof(zero);
+            expected |= (uint32_t) node->checksum_hi << 16;
+            mask = 0xFFFFFFFF;
+        }
+        crc = CRC32C::update(crc, raw + rest, superblock->inode_size - rest);
+    }
+    return (crc & mask) == expected;
+}
+
 struct IOOperationData {
     uint64_t offset;
     uint64_t size;
     uint8_t* buffer;
     int64_t result;
 };
+int64_t Ext4::implGetINode(const char* filepath) {
+    if (!valid) { return -1; }
+    return getINodeNumber(filepath);
+}
 int64_t Ext4::implRead(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) {
     if (!valid) { return -1; }
-    uint64_t inodeNumber = getINodeNumber(filepath);
+    int64_t inodeNumber = getINodeNumber(filepath);
     if (inodeNumber < 1) { return -1; }
+    return implReadINode(inodeNumber, offset, size, buffer);
+}
+int64_t Ext4::implReadINode(uint64_t inodeNumber, uint64_t offset, uint64_t size, uint8_t* buffer) {
+    if (!valid) { return -1; }
+    INode node;
+    if (!getINode(inodeNumber, &node)) { return -1; }
+    //extents cover whole blocks, the last one is only used up to the file size
+    uint64_t fileSize = node.getFileSize();
+    if (offset >= fileSize) { return 0; }
+    size = min(size, fileSize - offset);
     IOOperationData data;
     data.result = 0;
     data.offset = offset;
@@ -45,15 +139,13 @@ int64_t Ext4::implRead(const char* filepath, uint64_t offset, uint64_t size, uin
                 }
                 uint64_t overlapLength = overlapEnd - overlapStart;
 
-                uint64_t realOffsetInPartition = offsetInPartition + overlapStart;
+                uint64_t realOffsetInPartition = offsetInPartition + (overlapStart - offsetInFile);
 
-                uint64_t offsetInBuffer = data->offset - overlapStart;
+                uint64_t offsetInBuffer = overlapStart - data->offset;
                 // example:
-                // data->offset: 0x1000, offsetInFile = 0xF00, offsetInBuffer = 0x1000 - 0xF00 = 0x100
-
-                uint64_t lengthInBuffer = min(overlapLength, data->size - offsetInBuffer);
+                // data->offset: 0x1000, offsetInFile = 0x1F00, overlapStart = 0x1F00, offsetInBuffer = 0x1F00 - 0x1000 = 0xF00
 
-                data->result += instance->partition->read(realOffsetInPartition, lengthInBuffer, data->buffer + offsetInBuffer);
+                data->result += instance->partition->read(realOffsetInPartition, overlapLength, data->buffer + offsetInBuffer);
                 return false;
             },
             &data);
@@ -71,7 +163,7 @@ int64_t Ext4::implGetSize(const char* filepath) {
     int64_t inodeNumber = getINodeNumber(filepath);
     if (inodeNumber < 0) { return -1; }
     INode node;
-    getINode(inodeNumber, &node);
+    if (!getINode(inodeNumber, &node)) { return -1; }
     return node.getFileSize();
 }
 int64_t Ext4::implCreateFile(const char* filepath) {
@@ -169,7 +261,7 @@ Filesystem::FileType Ext4::implGetType(const char* filepath) {
     uint64_t inodeNumber = getINodeNumber(filepath);
     if (inodeNumber < 1) { return Filesystem::FileType::None; }
     INode node;
-    getINode(inodeNumber, &node);
+    if (!getINode(inodeNumber, &node)) { return Filesystem::FileType::Other; }
     uint64_t type = node.mode & 0xF000;
     switch (type) {
         case 0x8000:
@@ -181,12 +273,14 @@ Filesystem::FileType Ext4::implGetType(const char* filepath) {
     }
 }
 
-void Ext4::getINode(int64_t inodeNumber, INode* out) {
+bool Ext4::getINode(int64_t inodeNumber, INode* out) {
     if (inodeNumber < 1) {
-        return;
+        return false;
     }
     GroupDesc groupDesc;
-    getGroupDescriptor(inodeNumber, &groupDesc);
+    if (!getGroupDescriptor(inodeNumber, &groupDesc)) {
+        return false;
+    }
     uint64_t index = (inodeNumber - 1) % superblock->inodes_per_group;
 
     uint64_t inodeTableBlock = groupDesc.inode_table_lo;
@@ -195,14 +289,36 @@ void Ext4::getINode(int64_t inodeNumber, INode* out) {
     inodeTableBlock *= blockSize;
     uint64_t offset = index * superblock->inode_size;
 
-    partition->read(inodeTableBlock + offset, sizeof(INode), (uint8_t*) out);
+    //the checksum covers the whole on disk inode, which may be larger or smaller than INode
+    uint64_t size = superblock->inode_size;
+    uint8_t* raw = new uint8_t[max(size, sizeof(INode))];
+    memset(raw, 0, max(size, sizeof(INode)));
+    bool result = partition->read(inodeTableBlock + offset, size, raw) == (int64_t) size;
+    if (result && metadataChecksums && !verifyINode(raw, getINodeSeed(inodeNumber, ((INode*) raw)->generation))) {
+        Output::getDefault()->printf("Ext4: Inode %lld has a wrong checksum\n", inodeNumber);
+        result = false;
+    }
+    memcpy(out, raw, sizeof(INode));
+    delete[] raw;
+    return result;
 }
-void Ext4::getGroupDescriptor(int64_t inodeNumber, GroupDesc* out) {
+bool Ext4::getGroupDescriptor(int64_t inodeNumber, GroupDesc* out) {
     if (inodeNumber < 1) {
-        return;
+        return false;
     }
     uint64_t groupNumber = (inodeNumber - 1) / superblock->inodes_per_group;
-    partition->read(blockSize + groupNumber * superblock->desc_size, sizeof(GroupDesc), (uint8_t*) out);
+    uint64_t tableStart = (superblock->first_data_block + 1) * blockSize;
+    //the upper half of 32 byte descriptors stays 0
+    uint8_t* raw = new uint8_t[max(descriptorSize, sizeof(GroupDesc))];
+    memset(raw, 0, max(descriptorSize, sizeof(GroupDesc)));
+    bool result = partition->read(tableStart + groupNumber * descriptorSize, descriptorSize, raw) == (int64_t) descriptorSize;
+    if (result && metadataChecksums && !verifyGroupDescriptor(groupNumber, raw)) {
+        Output::getDefault()->printf("Ext4: Group descriptor %llu has a wrong checksum\n", groupNumber);
+        result = false;
+    }
+    memcpy(out, raw, sizeof(GroupDesc));
+    delete[] raw;
+    return result;
 }
 
 struct ExtentHeader {
@@ -228,7 +344,17 @@ struct ExtentLeaf {
 } __attribute__((packed));
 static_assert(sizeof(ExtentLeaf) == 12, "ExtentLeaf has wrong size");
 
-bool Ext4::travelExtentTree(uint8_t* buffer, TravelCallback callback, void* context) {
+bool Ext4::verifyExtentBlock(uint8_t* block, uint32_t inodeSeed) {
+    ExtentHeader* header = (ExtentHeader*) block;
+    //the checksum follows the last possible entry
+    uint64_t tailOffset = sizeof(ExtentHeader) + header->maxEntries * sizeof(ExtentLeaf);
+    if (tailOffset + sizeof(uint32_t) > blockSize) {
+        return false;
+    }
+    return CRC32C::update(inodeSeed, block, tailOffset) == *(uint32_t*) (block + tailOffset);
+}
+
+bool Ext4::travelExtentTree(uint8_t* buffer, uint32_t inodeSeed, TravelCallback callback, void* context) {
     ExtentHeader* header = (ExtentHeader*) buffer;
     if (header->magic != 0xF30A) {
         return false;
@@ -249,10 +375,17 @@ bool Ext4::travelExtentTree(uint8_t* buffer, TravelCallback callback, void* cont
             uint8_t* buffer = new uint8_t[blockSize];
             uint64_t position = index->leafLow | ((uint64_t) index->leafHigh) << 32;
             partition->read(position * blockSize, blockSize, buffer);
-            if (travelExtentTree(buffer, callback, context)) {
+            if (metadataChecksums && !verifyExtentBlock(buffer, inodeSeed)) {
+                Output::getDefault()->printf("Ext4: Extent block %llu has a wrong checksum\n", position);
+                delete[] buffer;
+                return true;// stops the traversal
+            }
+            if (travelExtentTree(buffer, inodeSeed, callback, context)) {
+                delete[] buffer;
                 return true;
             }
             delete[] buffer;
+            entries += sizeof(ExtentIndex);
         }
     }
     return false;
@@ -263,14 +396,19 @@ void Ext4::travelFile(int64_t inodeNumber, TravelCallback callback, void* contex
         return;
     }
     INode inode;
-    getINode(inodeNumber, &inode);
+    if (!getINode(inodeNumber, &inode)) {
+        return;
+    }
     if (inode.flags & 0x80000) {// extend tree
-        travelExtentTree((uint8_t*) &inode.block, callback, context);
+        uint32_t inodeSeed = metadataChecksums ? getINodeSeed(inodeNumber, inode.generation) : 0;
+        travelExtentTree((uint8_t*) &inode.block, inodeSeed, callback, context);
         return;
     }
     if (inode.flags & 0x10000000) {// inline data
         GroupDesc groupDesc;
-        getGroupDescriptor(inodeNumber, &groupDesc);
+        if (!getGroupDescriptor(inodeNumber, &groupDesc)) {
+            return;
+        }
 
         uint64_t index = (inodeNumber - 1) % superblock->inodes_per_group;
 
@@ -343,7 +481,9 @@ int64_t Ext4::getINodeNumber(const char* filepath, int64_t inodeNumber) {
         return 2;
     }
     INode inode;
-    getINode(inodeNumber, &inode);
+    if (!getINode(inodeNumber, &inode)) {
+        return -1;
+    }
     //if directory search for entry
     //if file return inode number
     if ((inode.mode & 0xF000ull) == 0x4000ull) {
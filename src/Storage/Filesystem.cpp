@@ -1,6 +1,10 @@
 #include "Storage/Filesystem.hpp"
 #include "Common/Math.hpp"
 #include "LanguageFeatures/memory.hpp"
+#include "Memory/memory.hpp"
+#include "Memory/physicalAllocator.hpp"
+#include "Memory/tempMapping.hpp"
+#include "Storage/PageCache.hpp"
 
 bool Filesystem::handles(const char* filepath) {
     uint64_t inLength = strlen(filepath);
@@ -73,13 +77,46 @@ static shared_ptr<Filesystem> getFilesystem(const char* filepath) {
     return shared_ptr<Filesystem>();
 }
 
-int64_t Filesystem::read(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) {
+bool Filesystem::lookup(const char* filepath, Node& node) {
     shared_ptr<Filesystem> filesystem = getFilesystem(filepath);
     if (!filesystem) {
-        return -1;
+        return false;
     }
     const char* path = filesystem->prefixLength + filepath;
-    return filesystem->implRead(path, offset, size, buffer);
+    int64_t inode = filesystem->implGetINode(path);
+    if (inode < 1) {
+        return false;
+    }
+    node.filesystem = filesystem.get();// filesystems are never removed
+    node.inode = inode;
+    return true;
+}
+int64_t Filesystem::read(const Node& node, uint64_t offset, uint64_t size, uint8_t* buffer) {
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t pageIndex = (offset + done) / pageSize;
+        uint64_t inPage = (offset + done) % pageSize;
+        uint64_t validBytes;
+        uint64_t physical = PageCache::getPage(node.filesystem, node.inode, pageIndex, &validBytes);
+        if (physical == 0) {
+            return done > 0 ? (int64_t) done : -1;
+        }
+        uint64_t length = inPage < validBytes ? min(validBytes - inPage, size - done) : 0;
+        memcpy(buffer + done, TempMemory::mapPages(physical, 1, false) + inPage, length);
+        PhysicalAllocator::releaseReference(physical);
+        done += length;
+        if (validBytes < pageSize || length == 0) {
+            break;// end of file
+        }
+    }
+    return done;
+}
+int64_t Filesystem::read(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) {
+    Node node;
+    if (!lookup(filepath, node)) {
+        return -1;
+    }
+    return read(node, offset, size, buffer);
 }
 int64_t Filesystem::write(const char* filepath, uint64_t offset, uint64_t size, uint8_t* buffer) {
     shared_ptr<Filesystem> filesystem = getFilesystem(filepath);
@@ -87,7 +124,13 @@ int64_t Filesystem::write(const char* filepath, uint64_t offset, uint64_t size,
         return -1;
     }
     const char* path = filesystem->prefixLength + filepath;
-    return filesystem->implWrite(path, offset, size, buffer);
+    int64_t written = filesystem->implWrite(path, offset, size, buffer);
+    // after the write, a reader that filled the cache while it ran could have cached the old data
+    int64_t inode = filesystem->implGetINode(path);
+    if (inode > 0) {
+        PageCache::invalidate(filesystem.get(), inode);
+    }
+    return written;
 }
 int64_t Filesystem::getSize(const char* filepath) {
     shared_ptr<Filesystem> filesystem = getFilesystem(filepath);
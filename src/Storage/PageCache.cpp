@@ -0,0 +1,186 @@
+#include "Storage/PageCache.hpp"
+#include "CPUControl/spinlock.hpp"
+#include "LanguageFeatures/memory.hpp"
+#include "Memory/memory.hpp"
+#include "Memory/physicalAllocator.hpp"
+#include "Memory/tempMapping.hpp"
+#include "Storage/Filesystem.hpp"
+
+struct CachedPage {
+    Filesystem* filesystem;
+    uint64_t inode;
+    uint64_t pageIndex;
+    uint64_t physical; // the cache holds one reference
+    uint64_t validBytes;
+    CachedPage* nextInBucket;
+    CachedPage* newer;// least recently used list
+    CachedPage* older;
+};
+
+constexpr uint64_t bucketCount = 1024;
+
+static SpinLock cacheLock;
+static CachedPage* buckets[bucketCount];
+static CachedPage* newest;
+static CachedPage* oldest;
+static uint64_t cachedPageCount;
+static uint64_t invalidations;// pages read before an invalidation are not inserted, they may be older than the write
+
+static uint64_t getBucket(Filesystem* filesystem, uint64_t inode, uint64_t pageIndex) {
+    uint64_t hash = (uint64_t) filesystem;
+    hash ^= inode * 0x9E3779B97F4A7C15ull;
+    hash ^= pageIndex * 0xC2B2AE3D27D4EB4Full;
+    hash ^= hash >> 29;
+    return hash % bucketCount;
+}
+
+static void unlinkLRU(CachedPage* page) {
+    if (page->newer) {
+        page->newer->older = page->older;
+    } else {
+        newest = page->older;
+    }
+    if (page->older) {
+        page->older->newer = page->newer;
+    } else {
+        oldest = page->newer;
+    }
+    page->newer = nullptr;
+    page->older = nullptr;
+}
+
+static void pushLRU(CachedPage* page) {
+    page->older = newest;
+    page->newer = nullptr;
+    if (newest) {
+        newest->newer = page;
+    } else {
+        oldest = page;
+    }
+    newest = page;
+}
+
+static void unlinkBucket(CachedPage* page) {
+    CachedPage** link = &buckets[getBucket(page->filesystem, page->inode, page->pageIndex)];
+    while (*link != page) {
+        link = &(*link)->nextInBucket;
+    }
+    *link = page->nextInBucket;
+}
+
+static CachedPage* find(Filesystem* filesystem, uint64_t inode, uint64_t pageIndex) {
+    for (CachedPage* page = buckets[getBucket(filesystem, inode, pageIndex)]; page; page = page->nextInBucket) {
+        if (page->filesystem == filesystem && page->inode == inode && page->pageIndex == pageIndex) {
+            return page;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Releases dropped pages, done without the cache lock because freeing memory may shoot down tlb entries.
+ */
+static void releasePages(CachedPage* pages) {
+    while (pages) {
+        CachedPage* next = pages->nextInBucket;
+        PhysicalAllocator::releaseReference(pages->physical);
+        delete pages;
+        pages = next;
+    }
+}
+
+uint64_t PageCache::getPage(Filesystem* filesystem, uint64_t inode, uint64_t pageIndex, uint64_t* validBytes) {
+    {
+        SpinLockGuard guard(cacheLock);
+        CachedPage* page = find(filesystem, inode, pageIndex);
+        if (page) {
+            unlinkLRU(page);
+            pushLRU(page);
+            PhysicalAllocator::addReference(page->physical);
+            *validBytes = page->validBytes;
+            return page->physical;
+        }
+    }
+
+    //read the page without holding the lock, a concurrent reader of the same page may win the insertion
+    uint64_t generation = __atomic_load_n(&invalidations, __ATOMIC_ACQUIRE);
+    uint64_t physical = PhysicalAllocator::allocatePhysicalMemory(1);
+    uint8_t* memory = TempMemory::mapPages(physical, 1, false);
+    int64_t read = filesystem->implReadINode(inode, pageIndex * pageSize, pageSize, memory);
+    if (read < 0) {
+        PhysicalAllocator::freePhysicalMemory(physical, 1);
+        return 0;
+    }
+    memset(memory + read, 0, pageSize - read);
+
+    CachedPage* page = new CachedPage();
+    page->filesystem = filesystem;
+    page->inode = inode;
+    page->pageIndex = pageIndex;
+    page->physical = physical;
+    page->validBytes = read;
+
+    CachedPage* dropped = nullptr;
+    {
+        SpinLockGuard guard(cacheLock);
+        if (generation != invalidations) {
+            // the caller gets the page uncached with the reference of the allocation
+            *validBytes = read;
+            delete page;
+            return physical;
+        }
+        CachedPage* existing = find(filesystem, inode, pageIndex);
+        if (existing) {
+            page->nextInBucket = nullptr;
+            dropped = page;
+            page = existing;
+        } else {
+            uint64_t bucket = getBucket(filesystem, inode, pageIndex);
+            page->nextInBucket = buckets[bucket];
+            buckets[bucket] = page;
+            pushLRU(page);
+            cachedPageCount++;
+            while (cachedPageCount > maxCachedPages) {
+                CachedPage* victim = oldest;
+                unlinkLRU(victim);
+                unlinkBucket(victim);
+                victim->nextInBucket = dropped;
+                dropped = victim;
+                cachedPageCount--;
+            }
+        }
+        PhysicalAllocator::addReference(page->physical);
+        *validBytes = page->validBytes;
+        physical = page->physical;
+    }
+    releasePages(dropped);
+    return physical;
+}
+
+void PageCache::invalidate(Filesystem* filesystem, uint64_t inode) {
+    CachedPage* dropped = nullptr;
+    {
+        SpinLockGuard guard(cacheLock);
+        __atomic_store_n(&invalidations, invalidations + 1, __ATOMIC_RELEASE);
+        for (uint64_t bucket = 0; bucket < bucketCount; ++bucket) {
+            CachedPage** link = &buckets[bucket];
+            while (*link) {
+                CachedPage* page = *link;
+                if (page->filesystem == filesystem && page->inode == inode) {
+                    *link = page->nextInBucket;
+                    unlinkLRU(page);
+                    page->nextInBucket = dropped;
+                    dropped = page;
+                    cachedPageCount--;
+                } else {
+                    link = &page->nextInBucket;
+                }
+            }
+        }
+    }
+    releasePages(dropped);
+}
+
+uint64_t PageCache::getCachedPageCount() {
+    return __atomic_load_n(&cachedPageCount, __ATOMIC_RELAXED);
+}
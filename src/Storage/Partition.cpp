@@ -24,6 +24,36 @@ int64_t OffsetImplementationPartition::read(uint64_t offset, uint64_t size, uint
     return -1;
 }
 
+bool OffsetImplementationPartition::submit(BlockRequest& request) {
+    if (offset % BlockRequest::sectorSize != 0 || (request.sectorIndex + request.sectorCount) * BlockRequest::sectorSize > size) {
+        return false;
+    }
+    if (auto ptr = partitionTable->getStorage().lock(); ptr) {
+        request.baseSector = offset / BlockRequest::sectorSize;
+        return ptr->getQueue().submit(request);
+    }
+    return false;
+}
+
+void OffsetImplementationPartition::poll() {
+    if (auto ptr = partitionTable->getStorage().lock(); ptr) {
+        ptr->poll();
+    }
+}
+
+void OffsetImplementationPartition::wait(BlockRequest& request) {
+    if (auto ptr = partitionTable->getStorage().lock(); ptr) {
+        ptr->wait(request);
+    }
+}
+
+bool OffsetImplementationPartition::cancel(BlockRequest& request) {
+    if (auto ptr = partitionTable->getStorage().lock(); ptr) {
+        return ptr->getQueue().cancel(request);
+    }
+    return false;
+}
+
 MBRPartitionTable::MBRPartitionTable(weak_ptr<Storage> storage) : PartitionTable(storage) {
     if (auto ptr = storage.lock(); ptr) {
         ptr->read(0, 512, bootSector);
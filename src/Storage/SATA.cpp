@@ -1,6 +1,8 @@
 #include "Storage/SATA.hpp"
+#include "ACPI/APIC.hpp"
 #include "BasicOutput/Output.hpp"
 #include "CPUControl/cpu.hpp"
+#include "CPUControl/smp.hpp"
 #include "CPUControl/time.hpp"
 #include "Common/Math.hpp"
 #include "Common/Units.hpp"
@@ -36,7 +38,14 @@ void MyHandler::onDeviceFound(PCI& pci) {
 //---------------------------------------------------[SATA Controller]---------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------
 
-SATA::Controller::Controller(PCI& pci) : pci(pci) {
+constexpr uint32_t hbaInterruptEnable = 1 << 1;
+constexpr uint8_t maxControllers = 8;
+constexpr uint64_t interruptTestTimeout = 100;// ms
+
+static SATA::Controller* controllers[maxControllers];
+static uint8_t controllerCount;
+
+SATA::Controller::Controller(PCI& pci) : pci(pci), ports(), interruptCount(0), useInterrupts(false) {
     abar = pci.getBar(5);
 }
 
@@ -69,16 +78,32 @@ void SATA::Controller::init(shared_ptr<SATA::Controller> me) {
         }
     }
 
-    // try to init each port
+    pci.enableBusMaster();
+
+    // try to init each port, they poll until the interrupt is set up
+    shared_ptr<SATA> devices[32];
+    bool found = false;
     for (uint8_t i = 0; i < 32; ++i) {
         if (portsAvailable & (1 << i)) {
             shared_ptr<SATA> sata = make_shared<SATA>(me);
             if (sata->tryToInit(i)) {
-                shared_ptr<Storage> storagePtr = static_pointer_cast<Storage>(sata);
-                Storage::addStorage(storagePtr);
+                ports[i] = sata.get();
+                devices[i] = sata;
+                found = true;
             }
         }
     }
+    if (found && controllerCount < maxControllers) {
+        controllers[controllerCount++] = this;// kept alive by its devices
+        setupInterrupt();
+    }
+    // added after the interrupt test, so no request can use the ports before
+    for (uint8_t i = 0; i < 32; ++i) {
+        if (devices[i]) {
+            shared_ptr<Storage> storagePtr = static_pointer_cast<Storage>(devices[i]);
+            Storage::addStorage(storagePtr);
+        }
+    }
 }
 
 PCI::BAR& SATA::Controller::getABAR() {
@@ -89,6 +114,26 @@ PCI::BAR& SATA::Controller::getABAR() {
 //-----------------------------------------------------[SATA Device]-----------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------------------
 
+constexpr uint8_t identifyDevice = 0xEC;
+constexpr uint8_t readDMA = 0xC8;
+constexpr uint8_t writeDMA = 0xCA;
+constexpr uint8_t readDMAExt = 0x25;
+constexpr uint8_t writeDMAExt = 0x35;
+constexpr uint8_t readFPDMAQueued = 0x60;
+constexpr uint8_t writeFPDMAQueued = 0x61;
+constexpr uint8_t readLogExt = 0x2F;
+
+constexpr uint8_t ncqErrorLog = 0x10;// names the tag of the failed queued command, reading it resumes queuing
+constexpr uint8_t ncqErrorNonQueued = 1 << 7;
+constexpr uint32_t taskFileBusy = (0b1 << 7) | (0b1 << 3);// BSY and DRQ
+constexpr uint32_t commandListRunning = 0b1 << 15;
+
+constexpr uint64_t registerPollLimit = 1'000'000;// register reads before a wait gives up (several hundred ms)
+constexpr uint64_t resetHoldReads = 10'000;     // register reads that keep COMRESET asserted for more than 1 ms
+
+constexpr uint64_t maxSectorsLBA28 = 0xFF;  // the count field is 8 bit, 0 would mean 256
+constexpr uint64_t maxSectorsLBA48 = 0xFFFF;// the count field is 16 bit, 0 would mean 65536
+
 struct FisDmaSetup {
     uint8_t fisType;// 0x41
     uint8_t portMultiplier : 4;
@@ -229,7 +274,9 @@ struct PrdtEntry {
     bool interruptEnable : 1;
 } __attribute__((packed));
 
-static constexpr uint64_t prdtEntryCount = ((pageSize / 0x10) - 64 - 16 - 48) / sizeof(PrdtEntry);
+static constexpr uint64_t commandTablePages = 8;// per slot
+static constexpr uint64_t prdtEntryCount = (commandTablePages * pageSize - 64 - 16 - 48) / sizeof(PrdtEntry);
+static constexpr uint64_t maxPrdtEntrySize = 1 << 22;// the byte count field has 22 bits and counts from 0
 
 struct CommandTable {
     uint8_t commandFIS[64];
@@ -239,48 +286,36 @@ struct CommandTable {
 
     PrdtEntry prdtEntries[prdtEntryCount];// Physical region descriptor table entries, 0 ~ 65535
 
-    uint8_t createPrdt(void* address, uint64_t& size);// return prdt count
+    uint32_t appendPrdt(uint32_t entryCount, BlockSegment& segment, uint64_t& covered);// return prdt count
 } __attribute__((packed));
 
-uint8_t CommandTable::createPrdt(void* ptr, uint64_t& size) {
-    uint8_t* address = (uint8_t*) ptr;
-    uint8_t currentEntryIndex = 0;
-    memset(prdtEntries, 0, sizeof(prdtEntries));
-
-    uint64_t lastPhysicalAddress = 0;
-    while (size > 0) {
-        PrdtEntry* entry = &prdtEntries[currentEntryIndex];
-        uint64_t physicalAddress = PageTable::getPhysicalAddress((uint64_t) address);
-        uint64_t entrySize = min(size, pageSize);
-        uint64_t offsetInPage = ((uint64_t) address) & (pageSize - 1);
-        entrySize = min(entrySize, pageSize - offsetInPage);
-        if (entry->dataByteCount != 0) {
-            //check if the entry is full
-            if (entry->dataByteCount + entrySize >= (0b1 << 22) - 1) {
-                currentEntryIndex++;
-                if (currentEntryIndex >= prdtEntryCount) {
-                    return currentEntryIndex;
-                }
-                entry = &prdtEntries[currentEntryIndex];
-            } else if ((lastPhysicalAddress & ~(pageSize - 1)) + pageSize == physicalAddress) {//check if physical address is adjacent to the current entry
-                entry->dataByteCount += entrySize;
-            }
-        }
-        lastPhysicalAddress = physicalAddress;
-
-        if (entry->dataByteCount == 0) {
+uint32_t CommandTable::appendPrdt(uint32_t entryCount, BlockSegment& segment, uint64_t& covered) {
+    covered = 0;
+    while (covered < segment.size) {
+        uint64_t physicalAddress = segment.getPhysicalAddress(covered);
+        uint64_t length = min(segment.size - covered, pageSize - (physicalAddress & (pageSize - 1)));
+        PrdtEntry* last = entryCount ? &prdtEntries[entryCount - 1] : nullptr;
+        uint64_t lastEnd = last ? (last->dataBaseAddressLow | ((uint64_t) last->dataBaseAddressHigh << 32)) + last->dataByteCount + 1 : 0;
+        if (last && lastEnd == physicalAddress && last->dataByteCount + 1 + length <= maxPrdtEntrySize) {
+            last->dataByteCount += length;// physically contiguous with the last entry
+        } else if (entryCount < prdtEntryCount) {
+            PrdtEntry* entry = &prdtEntries[entryCount++];
             entry->dataBaseAddressLow = (uint32_t) physicalAddress;
             entry->dataBaseAddressHigh = (uint32_t) (physicalAddress >> 32);
-            entry->dataByteCount = (uint32_t) entrySize - 1;// '0' based count => 0 = 1 byte, 1 = 2 bytes, ...
+            entry->rsv0 = 0;
+            entry->dataByteCount = (uint32_t) length - 1;// '0' based count => 0 = 1 byte, 1 = 2 bytes, ...
+            entry->rsv1 = 0;
             entry->interruptEnable = false;
+        } else {
+            break;// the table is full
         }
-        address += entrySize;
-        size -= entrySize;
+        covered += length;
     }
-    return currentEntryIndex + 1;
+    return entryCount;
 }
 
-static_assert(sizeof(CommandTable) == (pageSize / 0x10));
+static_assert(sizeof(CommandTable) == commandTablePages * pageSize);
+static_assert(prdtEntryCount <= 0xFFFF);
 
 struct CommandSlot {
     uint8_t commandFISLength : 5;
@@ -304,80 +339,372 @@ struct CommandSlot {
     uint32_t rsv1[4];
 
     inline CommandTable* getCommandTable() {
-        return (CommandTable*) TempMemory::mapPages((commandTableBaseLow | (((uint64_t) commandTableBaseHigh) << 32)), 1, false);
+        return (CommandTable*) TempMemory::mapPages((commandTableBaseLow | (((uint64_t) commandTableBaseHigh) << 32)), commandTablePages, false);
     }
 } __attribute__((packed));
 
-SATA::SATA(shared_ptr<Controller> controller) : controller(controller) {
+/**
+ * @brief Reads registers until the condition holds, usable with interrupts disabled.
+ * @return false if the condition did not hold within registerPollLimit reads.
+ */
+template<typename Condition>
+static bool pollRegister(Condition condition) {
+    for (uint64_t i = 0; i < registerPollLimit; ++i) {
+        if (condition()) {
+            return true;
+        }
+        pause();
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------------------------------------------------
+//------------------------------------------------------[Interrupts]-----------------------------------------------------
+//-----------------------------------------------------------------------------------------------------------------------
+
+constexpr uint32_t portCompletionInterrupts = 0b1111;                                  // d2h register, pio setup, dma setup, set device bits
+constexpr uint32_t portErrorInterrupts = (1 << 30) | (1 << 29) | (1 << 28) | (1 << 27);// task file, host bus fatal, host bus data, interface fatal
+
+void SATA::Controller::setupInterrupt() {
+    if (controllerCount == 1) {
+        Interrupt::setupInterruptHandler(interruptVector, onInterrupt, {false, 0});
+    }
+    uint8_t apicId = APIC::getCPUID();
+    uint32_t legacyInterrupt = ~0u;
+    if (!pci.enableMSI(interruptVector, apicId)) {
+        // without ACPI _PRT the interrupt line is only a guess, the test below catches a wrong one
+        uint8_t line = pci.readConfigByte(0x3C);
+        if (line == 0 || line == 0xFF) {
+            Output::getDefault()->printf("SATA: No interrupt, ports keep polling\n");
+            return;
+        }
+        legacyInterrupt = APIC::getSourceOverride(line);
+        if (legacyInterrupt == (uint32_t) ~0ull) {
+            legacyInterrupt = line;
+        }
+        bool isaLine = legacyInterrupt < 16;// isa lines are edge triggered, pci lines are level triggered and active low
+        APIC::mapInterrupt(legacyInterrupt, interruptVector, apicId, !isaLine, !isaLine);
+    }
+
+    for (uint8_t i = 0; i < 32; ++i) {
+        if (ports[i]) {
+            Port* port = ports[i]->dbar.getAs<Port>();
+            port->interruptStatus = ~0u;
+            port->interruptEnable = portCompletionInterrupts | portErrorInterrupts;
+        }
+    }
+    getABAR()[0x08] = ~0u;
+    getABAR()[4] = (uint32_t) getABAR()[4] | hbaInterruptEnable;
+
+    // a command that completes without an interrupt means the interrupt is not routed
+    for (uint8_t i = 0; i < 32; ++i) {
+        if (ports[i]) {
+            uint64_t count = interruptCount;
+            {
+                // the port is not added yet, the lock only keeps the interrupt handler from recovering in between
+                SpinLockGuard guard(ports[i]->lock);
+                if (ports[i]->usedSlots == 0) {
+                    ports[i]->runCommand(identifyDevice, 0, 0);
+                }
+            }
+            for (uint64_t j = 0; j < interruptTestTimeout && interruptCount == count; ++j) {
+                sleep(time::millisecond(1));
+            }
+            useInterrupts = interruptCount != count;
+            break;
+        }
+    }
+    if (!useInterrupts) {
+        getABAR()[4] = (uint32_t) getABAR()[4] & ~hbaInterruptEnable;
+        if (legacyInterrupt != ~0u) {
+            APIC::setInterruptEnabled(legacyInterrupt, false);
+        }
+        Output::getDefault()->printf("SATA: Interrupt was not delivered, ports keep polling\n");
+    }
+}
+
+void SATA::Controller::onInterrupt(Interrupt&) {
+    for (uint8_t c = 0; c < controllerCount; ++c) {
+        Controller* controller = controllers[c];
+        uint32_t pending = controller->getABAR()[0x08];
+        if (pending == 0) {
+            continue;
+        }
+        controller->interruptCount++;
+        for (uint32_t remaining = pending; remaining; remaining &= remaining - 1) {
+            uint8_t i = __builtin_ctz(remaining);
+            if (controller->ports[i]) {
+                controller->ports[i]->poll();
+            }
+        }
+        controller->getABAR()[0x08] = pending;// port status first, otherwise the bits are set again
+    }
+}
+
+SATA::SATA(shared_ptr<Controller> controller)
+    : controller(controller), pollingSize(defaultPollingSize), useNCQ(false), queueDepth(1), lock(),
+      queueHead(nullptr), queueTail(nullptr), usedSlots(0), slotRequests() {
+}
+
+void SATA::setPollingSize(uint64_t size) {
+    pollingSize = size;
 }
 
-uint64_t SATA::findSlot() {
+bool SATA::submit(BlockRequest& request) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < request.segmentCount; ++i) {
+        if (((uint64_t) request.segments[i].buffer | request.segments[i].size) & 1) {
+            return false;// the PRDT only takes even addresses and sizes
+        }
+        total += request.segments[i].size;
+    }
+    if (request.sectorCount == 0 || total != request.sectorCount * sectorSize ||
+        request.baseSector + request.sectorIndex + request.sectorCount > sectorCount) {
+        return false;
+    }
+    request.waitingCPU = SMP::getIndex();
+    request.result = 0;
+    request.next = nullptr;
+    SpinLockGuard guard(lock);
+    if (queueTail) {
+        queueTail->next = &request;
+    } else {
+        queueHead = &request;
+    }
+    queueTail = &request;
+    startQueued();
+    return true;
+}
+
+void SATA::startQueued() {
+    uint32_t allowedSlots = queueDepth == 32 ? ~0u : (1u << queueDepth) - 1;
+    while (queueHead) {
+        uint32_t freeSlots = ~usedSlots & allowedSlots;
+        if (freeSlots == 0) {
+            return;
+        }
+        BlockRequest* request = queueHead;
+        queueHead = request->next;
+        if (queueHead == nullptr) {
+            queueTail = nullptr;
+        }
+        request->next = nullptr;
+        startRequest(__builtin_ctz(freeSlots), *request);
+    }
+}
+
+void SATA::startRequest(uint32_t slotID, BlockRequest& request) {
     Port* port = dbar.getAs<Port>();
-    uint8_t maxSlot = ((controller->capabilities >> 8) & 0b11111) + 1;
-    uint32_t slots = (port->sataActive | port->commandIssue);
-    for (uint64_t i = 0; i < maxSlot; i++) {
-        if ((slots & 1) == 0) {
-            return i;
+    CommandSlot* slot = (CommandSlot*) (commandSlotPtr + slotID * sizeof(CommandSlot));
+    CommandTable* table = slot->getCommandTable();
+
+    uint32_t entryCount = 0;
+    uint64_t covered = 0;
+    for (uint64_t i = 0; i < request.segmentCount; ++i) {
+        uint64_t segmentCovered;
+        entryCount = table->appendPrdt(entryCount, request.segments[i], segmentCovered);
+        covered += segmentCovered;
+        if (segmentCovered < request.segments[i].size) {
+            break;// the PRDT is full
         }
-        slots >>= 1;
     }
-    return ~0;
+    slot->prdTableLength = entryCount;
+    uint64_t sectors = min(covered / sectorSize, hasLBA48 ? maxSectorsLBA48 : maxSectorsLBA28);
+    request.result = sectors * sectorSize;
+
+    uint8_t command;
+    if (useNCQ) {
+        command = request.write ? writeFPDMAQueued : readFPDMAQueued;
+    } else if (hasLBA48) {
+        command = request.write ? writeDMAExt : readDMAExt;
+    } else {
+        command = request.write ? writeDMA : readDMA;
+    }
+    writeH2DCommand(slotID, command, request.baseSector + request.sectorIndex, sectors, request.write);
+
+    uint32_t bit = 1u << slotID;
+    usedSlots |= bit;
+    slotRequests[slotID] = &request;
+    if (useNCQ) {
+        port->sataActive = bit;// has to be set before the command is issued
+    }
+    port->commandIssue = bit;// writing 0 bits has no effect
 }
 
-bool SATA::waitForTask(uint64_t slot) {
+BlockRequest* SATA::collectCompletions() {
     Port* port = dbar.getAs<Port>();
-    while (true) {
-        if (!(port->commandIssue & (0b1 << slot)))
-            return true;
-        if (port->sataError) {
-            return false;
+    uint32_t status = port->interruptStatus;
+    port->interruptStatus = status;
+    // queued commands leave commandIssue when the device accepted them and sataActive when they are done
+    uint32_t done = usedSlots & ~(port->commandIssue | port->sataActive);
+    uint32_t failed = 0;
+    uint32_t restarted = 0;
+    if ((status & portErrorInterrupts) || (port->taskFileData & 0b1)) {
+        // the port stops at an error, the commands that did not finish either failed or were aborted by the device
+        uint32_t outstanding = usedSlots & ~done;
+        failed = recover(outstanding);
+        restarted = outstanding & ~failed;
+        done |= outstanding;
+    }
+    BlockRequest* finished = nullptr;
+    for (uint32_t remaining = done; remaining; remaining &= remaining - 1) {
+        uint32_t slotID = __builtin_ctz(remaining);
+        BlockRequest* request = slotRequests[slotID];
+        slotRequests[slotID] = nullptr;
+        if (restarted & (1u << slotID)) {
+            // started again before the queued requests, startRequest sets the result again
+            request->next = queueHead;
+            queueHead = request;
+            if (!queueTail) {
+                queueTail = request;
+            }
+            continue;
         }
-        if (port->taskFileData & 0b1)
-            return false;// error
+        if (failed & (1u << slotID)) {
+            request->result = -1;
+        }
+        request->next = finished;
+        finished = request;
+    }
+    usedSlots &= ~done;
+    if (done) {
+        startQueued();
     }
+    return finished;
 }
 
-bool SATA::waitForFinish() {
+uint32_t SATA::recover(uint32_t outstanding) {
     Port* port = dbar.getAs<Port>();
-    while (true) {
-        if (!(port->taskFileData & (0b10001) << 3)) return true;
-        if (port->taskFileData & 0b1) return false;// error
+    port->commandAndStatus &= ~0b1;// stop processing the command list, clears commandIssue and sataActive
+    bool stopped = pollRegister([port] { return !(port->commandAndStatus & commandListRunning); });
+    port->sataError = ~0u;
+    port->interruptStatus = ~0u;
+    if (!stopped || (port->taskFileData & taskFileBusy)) {
+        // the device hangs in the failed command, only a reset gets it back, the aborted commands are not retried
+        resetPort();
+        return outstanding;
     }
+    port->commandAndStatus |= 0b1;
+    if (!useNCQ) {
+        return outstanding;// only one command runs at a time
+    }
+
+    // after a queued command failed the device aborts all others and accepts queued commands only after the log was read
+    uint32_t failed = outstanding;
+    if (runCommand(readLogExt, ncqErrorLog, 1)) {
+        if (!(scratchPtr[0] & ncqErrorNonQueued)) {
+            failed &= 1u << (scratchPtr[0] & 0b11111);
+        }
+    } else {
+        Output::getDefault()->printf("SATA: NCQ error log unreadable, port %hhu continues without NCQ\n", portIndex);
+        resetPort();
+        useNCQ = false;
+        queueDepth = 1;
+    }
+    port->interruptStatus = ~0u;// the log command completed like any other
+    return failed;
 }
 
-bool SATA::sendIdentify() {
-    using namespace time;
+bool SATA::resetPort() {
     Port* port = dbar.getAs<Port>();
+    port->commandAndStatus &= ~0b1;
+    pollRegister([port] { return !(port->commandAndStatus & commandListRunning); });
+    port->sataControl = (port->sataControl & ~0b1111u) | 0b1;// COMRESET
+    for (uint64_t i = 0; i < resetHoldReads; ++i) {
+        (void) port->sataControl;
+        pause();// the clobber keeps the read
+    }
+    port->sataControl &= ~0b1111u;
+    bool ready = pollRegister([port] { return (port->sataStatus & 0b1111) == 0b11; }) &&
+                 pollRegister([port] { return !(port->taskFileData & taskFileBusy); });
+    port->sataError = ~0u;
+    port->interruptStatus = ~0u;
+    port->commandAndStatus |= 0b1;
+    return ready;
+}
 
-    uint64_t slotID = findSlot();
-    if (slotID >= 32) {
+void SATA::poll() {
+    InterruptGuard guard;// completions run with interrupts disabled, like in the interrupt handler
+    lock.lock();
+    BlockRequest* finished = collectCompletions();
+    lock.unlock();
+    while (finished) {
+        BlockRequest* next = finished->next;// the callback may free the request
+        finished->complete();
+        finished = next;
+    }
+}
+
+void SATA::wait(BlockRequest& request) {
+    // hlt needs interrupts, a caller that disabled them has to poll
+    bool useHalt = request.sectorCount * sectorSize > pollingSize && controller->useInterrupts && Interrupt::isInterruptEnabled();
+    while (true) {
+        InterruptGuard guard;
+        if (!useHalt) {
+            poll();
+        }
+        if (request.isDone()) {
+            return;
+        }
+        if (useHalt) {
+            asm volatile("sti; hlt; cli" ::
+                                 : "memory");// sti only takes effect after hlt, so the interrupt can not get lost
+        } else {
+            pause();
+        }
+    }
+}
+
+bool SATA::cancel(BlockRequest& request) {
+    SpinLockGuard guard(lock);
+    BlockRequest* previous = nullptr;
+    for (BlockRequest* current = queueHead; current; previous = current, current = current->next) {
+        if (current != &request) {
+            continue;
+        }
+        if (previous) {
+            previous->next = current->next;
+        } else {
+            queueHead = current->next;
+        }
+        if (queueTail == current) {
+            queueTail = previous;
+        }
+        current->next = nullptr;
+        return true;
+    }
+    return false;// already started or finished
+}
+
+bool SATA::runCommand(uint8_t command, uint64_t sectorIndex, uint64_t sectorCount) {
+    Port* port = dbar.getAs<Port>();
+    uint32_t slotID = 0;
+    if (!pollRegister([port] { return !(port->taskFileData & taskFileBusy); })) {
         return false;
     }
+    writeH2DCommand(slotID, command, sectorIndex, sectorCount, false);
     CommandSlot* commandSlot = (CommandSlot*) (commandSlotPtr + (slotID * sizeof(CommandSlot)));
     CommandTable* commandTable = commandSlot->getCommandTable();
-    FisH2D* fis = (FisH2D*) &(commandTable->commandFIS);
-    memset(fis, 0, sizeof(FisH2D));
-    fis->fisType = 0x27;
-    fis->command = 0xEC;
-    fis->isCommand = true;
-    commandSlot->commandFISLength = sizeof(FisH2D) / sizeof(uint32_t);
-
-    uint8_t buffer[512]{};
-    commandTable->prdtEntries[0].dataByteCount = sizeof(buffer);
-    commandTable->prdtEntries[0].dataBaseAddressLow = (uint32_t) PageTable::getPhysicalAddress((uint64_t) buffer);
-    commandTable->prdtEntries[0].dataBaseAddressHigh = (uint32_t) (PageTable::getPhysicalAddress((uint64_t) buffer) >> 32);
+    uint64_t physical = PageTable::getPhysicalAddress((uint64_t) scratchPtr);
+    commandTable->prdtEntries[0].dataByteCount = scratchSize - 1;
+    commandTable->prdtEntries[0].dataBaseAddressLow = (uint32_t) physical;
+    commandTable->prdtEntries[0].dataBaseAddressHigh = (uint32_t) (physical >> 32);
     commandTable->prdtEntries[0].interruptEnable = false;
-    commandSlot->prdByteCount = sizeof(buffer);
-    if (!waitForFinish()) {
-        return false;
-    }
-    port->commandIssue |= 0b1 << slotID;// execute command
-    if (!waitForTask(slotID)) {
+    commandSlot->prdTableLength = 1;
+    port->commandIssue = 1u << slotID;
+    return pollRegister([port, slotID] { return !(port->commandIssue & (1u << slotID)) || port->sataError || (port->taskFileData & 0b1); }) &&
+           !(port->commandIssue & (1u << slotID)) && !port->sataError && !(port->taskFileData & 0b1);
+}
+
+bool SATA::sendIdentify() {
+    // only used before the device is added, nothing else uses the port yet
+    if (!runCommand(identifyDevice, 0, 0)) {
         return false;
     }
+    uint16_t* buffer = (uint16_t*) scratchPtr;
 
-    uint64_t LBA48SectorCount = *(uint64_t*) (buffer + 200);
-    uint64_t LBA28SectorCount = *(uint32_t*) (buffer + 120);
+    uint64_t LBA48SectorCount = *(uint64_t*) (buffer + 100);
+    uint64_t LBA28SectorCount = *(uint32_t*) (buffer + 60);
 
     //init sectorCount
     if (LBA48SectorCount) {
@@ -387,6 +714,11 @@ bool SATA::sendIdentify() {
         sectorCount = LBA28SectorCount;
         hasLBA48 = false;
     }
+
+    // NCQ needs support by the controller and the device, the device may accept less commands than there are slots
+    uint8_t slotCount = ((controller->capabilities >> 8) & 0b11111) + 1;
+    useNCQ = hasLBA48 && (controller->capabilities & (1u << 30)) && (buffer[76] & (1 << 8));
+    queueDepth = useNCQ ? min<uint8_t>(slotCount, (buffer[75] & 0b11111) + 1) : 1;
     return true;
 }
 
@@ -431,20 +763,21 @@ bool SATA::tryToInit(uint8_t portIndex) {
 
     //allocate memory structure for this port
     uint8_t commandSlots = ((controller->capabilities >> 8) & 0b11111) + 1;// 1 to 32 command slots
-    uint64_t neededMemory = sizeof(ReceivedFIS) + sizeof(CommandTable) * commandSlots;
+    // the command list needs 1 KiB alignment and the received FIS 256 bytes, so the list goes first
+    uint64_t commandListSize = sizeof(CommandSlot) * 32;
+    uint64_t neededMemory = commandListSize + sizeof(ReceivedFIS) + scratchSize;
     uint64_t neededPageCount = (neededMemory + pageSize - 1) / pageSize;
     uint8_t* ptr = TempMemory::mapPages(PhysicalAllocator::allocatePhysicalMemory(neededPageCount), neededPageCount, false);
-    receivedFISPtr = ptr;
-    commandSlotPtr = ptr + sizeof(ReceivedFIS);
+    commandSlotPtr = ptr;
+    receivedFISPtr = ptr + commandListSize;
+    scratchPtr = receivedFISPtr + sizeof(ReceivedFIS);
     memset(ptr, 0, neededMemory);
-    uint64_t commandTablePageCount = (commandSlots >= 16) ? 2 : 1;
-    commandTablePtr = TempMemory::mapPages(PhysicalAllocator::allocatePhysicalMemory(commandTablePageCount), commandTablePageCount, false);
-    memset(commandTablePtr, 0, commandTablePageCount * pageSize);
     for (uint64_t i = 0; i < commandSlots; ++i) {
-        CommandTable* table = (CommandTable*) (commandTablePtr + (i * sizeof(CommandTable)));
-        uint64_t physical = PageTable::getPhysicalAddress((uint64_t) table);
+        // every slot has its own table, large enough for the PRDT of a multi megabyte transfer
+        uint64_t physical = PhysicalAllocator::allocatePhysicalMemory(commandTablePages);
+        memset(TempMemory::mapPages(physical, commandTablePages, false), 0, sizeof(CommandTable));
         CommandSlot* slot = (CommandSlot*) (commandSlotPtr + (i * sizeof(CommandSlot)));
-        slot->prdTableLength = prdtEntryCount;
+        slot->prdTableLength = 0;
         slot->commandTableBaseLow = (uint32_t) physical;
         slot->commandTableBaseHigh = (uint32_t) (physical >> 32);
     }
@@ -508,11 +841,14 @@ PCI::BAR& SATA::getDBAR() {
     return dbar;
 }
 
-void SATA::writeH2DCommand(uint32_t slotID, uint8_t command, uint64_t sectorIndex, uint64_t sectorCount) {
-    CommandSlot* slot = (CommandSlot*) (commandSlotPtr + slotID);
+void SATA::writeH2DCommand(uint32_t slotID, uint8_t command, uint64_t sectorIndex, uint64_t sectorCount, bool write) {
+    CommandSlot* slot = (CommandSlot*) (commandSlotPtr + slotID * sizeof(CommandSlot));
     CommandTable* table = slot->getCommandTable();
     FisH2D* fis = (FisH2D*) &(table->commandFIS);
+    memset(fis, 0, sizeof(FisH2D));
     slot->commandFISLength = sizeof(FisH2D) / sizeof(uint32_t);
+    slot->write = write;
+    slot->prdByteCount = 0;
     fis->fisType = 0x27;
     fis->device = 1 << 6;// LBA mode
     fis->command = command;
@@ -523,8 +859,15 @@ void SATA::writeH2DCommand(uint32_t slotID, uint8_t command, uint64_t sectorInde
     fis->lba3 = (uint8_t) (sectorIndex >> 24);
     fis->lba4 = (uint8_t) (sectorIndex >> 32);
     fis->lba5 = (uint8_t) (sectorIndex >> 40);
-    fis->countl = (uint8_t) sectorCount;
-    fis->counth = (uint8_t) (sectorCount >> 8);
+    if (command == readFPDMAQueued || command == writeFPDMAQueued) {
+        // queued commands carry the sector count in the feature field and the tag in the count field
+        fis->featurel = (uint8_t) sectorCount;
+        fis->featureh = (uint8_t) (sectorCount >> 8);
+        fis->countl = (uint8_t) (slotID << 3);
+    } else {
+        fis->countl = (uint8_t) sectorCount;
+        fis->counth = (uint8_t) (sectorCount >> 8);
+    }
 }
 
 uint64_t SATA::getSize() {
@@ -618,31 +961,7 @@ int64_t SATA::read(uint64_t offset, uint64_t size, uint8_t* buffer) {
     }
 
     //everything is nice and aligned
-    uint64_t sectorCount = size / 512;
-    uint64_t sectorIndex = offset / 512;
-
-    Port* port = dbar.getAs<Port>();
-
-    uint32_t slotID = findSlot();
-    if (slotID > 32) {
-        return -1;
-    }
-    CommandSlot* slot = (CommandSlot*) (commandSlotPtr + slotID * sizeof(CommandSlot));
-    CommandTable* table = slot->getCommandTable();
-
-    uint64_t startSize = size;
-    uint8_t prdtCount = table->createPrdt(buffer, size);
-    slot->prdTableLength = prdtCount;
-    uint64_t usedSectors = (startSize - size) / 512;
-    writeH2DCommand(slotID, 0x20, sectorIndex, usedSectors);
-    if (!waitForFinish()) {
-        return -1;
-    }
-    port->commandIssue |= 0b1 << slotID;// execute command
-    if (!waitForTask(slotID)) {
-        return -1;
-    }
-    return startSize - size;
+    return transfer(offset, size, buffer, false);
 }
 
 static int64_t fixMissalignedOffsetWrite(SATA* me, uint64_t offset, uint64_t size, uint8_t* buffer) {
@@ -727,43 +1046,19 @@ int64_t fixMissalignedBufferWrite(SATA* me, uint64_t offset, uint64_t size, uint
 
 int64_t SATA::write(uint64_t offset, uint64_t size, uint8_t* buffer) {
     //handle offset that starts in a sector
-    int64_t res = 0;
+    if (size == 0) return 0;
     if (offset % 512 != 0) {
-        fixMissalignedOffsetWrite(this, offset, size, buffer);
+        return fixMissalignedOffsetWrite(this, offset, size, buffer);
     }
     //handle size that ends in the middle of a sector
     if (size % 512 != 0) {
-        fixMissalignedSizeWrite(this, offset, size, buffer);
+        return fixMissalignedSizeWrite(this, offset, size, buffer);
     }
     //handle misaligned buffer (has to be aligned to 2byte boundary)
     if ((uint64_t) buffer % 2 != 0) {
-        fixMissalignedBufferWrite(this, offset, size, buffer);
+        return fixMissalignedBufferWrite(this, offset, size, buffer);
     }
 
     //everything is nice and aligned
-    uint64_t sectorCount = size / 512;
-    uint64_t sectorIndex = offset / 512;
-
-    Port* port = dbar.getAs<Port>();
-
-    uint32_t slotID = findSlot();
-    if (slotID > 32) {
-        return -1;
-    }
-    CommandSlot* slot = (CommandSlot*) (commandSlotPtr + slotID * sizeof(CommandSlot));
-    CommandTable* table = slot->getCommandTable();
-
-    uint64_t startSize = size;
-    uint8_t prdtCount = table->createPrdt(buffer, size);
-    slot->prdTableLength = prdtCount;
-    uint64_t usedSectors = (startSize - size) / 512;
-    writeH2DCommand(slotID, 0x35, sectorIndex, usedSectors);
-    if (!waitForFinish()) {
-        return -1;
-    }
-    port->commandIssue |= 0b1 << slotID;// execute command
-    if (!waitForTask(slotID)) {
-        return -1;
-    }
-    return startSize - size + res;
+    return transfer(offset, size, buffer, true);
 }
@@ -1,7 +1,14 @@
 #include "Storage/Storage.hpp"
+#include "CPUControl/cpu.hpp"
+#include "CPUControl/smp.hpp"
+#include "CPUControl/spinlock.hpp"
 #include "Common/Units.hpp"
 #include "LanguageFeatures/memory.hpp"
 #include "LanguageFeatures/string.hpp"
+#include "Memory/pageTable.hpp"
+#include "Memory/physicalAllocator.hpp"
+#include "Memory/tempMapping.hpp"
+#include "Process/Process.hpp"
 #include "Storage/Filesystem.hpp"
 #include "Storage/Partition.hpp"
 
@@ -64,4 +71,137 @@ void Storage::addStorage(const shared_ptr<Storage>& obj) {
 }
 const shared_ptr<Storage>& Storage::getFirst() {
     return *firstStorage;
-}
\ No newline at end of file
+}
+uint64_t BlockSegment::getPhysicalAddress(uint64_t offset) {
+    uint64_t address = (uint64_t) buffer + offset;
+    if (frames) {
+        return frames[address / pageSize - (uint64_t) buffer / pageSize] + (address & (pageSize - 1));
+    }
+    return PageTable::getPhysicalAddress(address);
+}
+
+uint8_t* BlockSegment::getKernelAddress(uint64_t offset) {
+    if (frames) {
+        return TempMemory::mapPages(getPhysicalAddress(offset), 1, false);
+    }
+    return buffer + offset;
+}
+
+bool BlockRequest::pin() {
+    for (uint64_t i = 0; i < segmentCount; ++i) {
+        segments[i].frames = nullptr;
+    }
+    Process* process = Process::getCurrent();
+    for (uint64_t i = 0; i < segmentCount; ++i) {
+        BlockSegment& segment = segments[i];
+        uint64_t first = (uint64_t) segment.buffer & ~(pageSize - 1);
+        if (first >= ((uint64_t) PageTable::kernelSpaceStartEntry << 39)) {
+            continue;// the kernel half is the same in every address space
+        }
+        uint64_t pageCount = ((uint64_t) segment.buffer + segment.size - first + pageSize - 1) / pageSize;
+        segment.frames = new uint64_t[pageCount]{};
+        for (uint64_t j = 0; j < pageCount; ++j) {
+            uint64_t page = first + j * pageSize;
+            uint64_t physical = PageTable::getPhysicalAddress(page);
+            // the device writes the buffer of a read, so its pages have to be private and writable
+            if (physical == 0 || !write) {
+                if (process == nullptr || !process->getProcessMemory().handlePageFault(page, !write)) {
+                    unpin();
+                    return false;
+                }
+                physical = PageTable::getPhysicalAddress(page);
+                if (!write && PhysicalAllocator::getShareCount(physical) > 1) {
+                    unpin();// the device would write into a page that other mappings or the page cache see
+                    return false;
+                }
+            }
+            PhysicalAllocator::pin(physical);// the process may unmap or share the page while the transfer runs
+            segment.frames[j] = physical;
+        }
+    }
+    return true;
+}
+
+void BlockRequest::unpin() {
+    for (uint64_t i = 0; i < segmentCount; ++i) {
+        BlockSegment& segment = segments[i];
+        if (segment.frames == nullptr) {
+            continue;
+        }
+        uint64_t first = (uint64_t) segment.buffer & ~(pageSize - 1);
+        uint64_t pageCount = ((uint64_t) segment.buffer + segment.size - first + pageSize - 1) / pageSize;
+        for (uint64_t j = 0; j < pageCount; ++j) {
+            if (segment.frames[j]) {
+                PhysicalAllocator::unpin(segment.frames[j]);
+            }
+        }
+        delete[] segment.frames;
+        segment.frames = nullptr;
+    }
+}
+
+void BlockRequest::complete() {
+    if (callback) {
+        callback(*this);
+        return;
+    }
+    uint8_t cpu = waitingCPU;// the waiter may free the request as soon as it is done
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    SMP::wake(cpu);// does nothing for the own cpu, it is not in hlt
+}
+
+bool Storage::submit(BlockRequest& request) {
+    uint64_t offset = (request.baseSector + request.sectorIndex) * BlockRequest::sectorSize;
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < request.segmentCount; ++i) {
+        total += request.segments[i].size;
+    }
+    if (request.sectorCount == 0 || total != request.sectorCount * BlockRequest::sectorSize || offset + total > getSize()) {
+        return false;
+    }
+    request.waitingCPU = SMP::getIndex();
+    request.result = 0;
+    for (uint64_t i = 0; i < request.segmentCount; ++i) {
+        BlockSegment& segment = request.segments[i];
+        int64_t result = request.write ? write(offset, segment.size, segment.buffer) : read(offset, segment.size, segment.buffer);
+        if (result != (int64_t) segment.size) {
+            request.result = -1;
+            break;
+        }
+        offset += segment.size;
+        request.result += result;
+    }
+    InterruptGuard guard;// callbacks always run with interrupts disabled
+    request.complete();
+    return true;
+}
+
+void Storage::wait(BlockRequest& request) {
+    while (!request.isDone()) {
+        poll();
+        pause();
+    }
+}
+
+int64_t Storage::transfer(uint64_t offset, uint64_t size, uint8_t* buffer, bool write) {
+    uint64_t done = 0;
+    while (done < size) {
+        // a storage may transfer less than requested (a full PRDT), the rest is submitted again
+        BlockSegment segment{buffer + done, size - done};
+        BlockRequest request{};
+        request.sectorIndex = (offset + done) / BlockRequest::sectorSize;
+        request.sectorCount = (size - done) / BlockRequest::sectorSize;
+        request.segments = &segment;
+        request.segmentCount = 1;
+        request.write = write;
+        if (!queue.submit(request)) {
+            return -1;
+        }
+        wait(request);
+        if (request.result <= 0) {
+            return -1;
+        }
+        done += request.result;
+    }
+    return done;
+}
@@ -2,12 +2,16 @@
 #include "ACPI/multiboot.hpp"
 #include "BasicOutput/VGATextOut.hpp"
 #include "CPUControl/cpu.hpp"
+#include "CPUControl/fpu.hpp"
 #include "CPUControl/interrupts.hpp"
+#include "CPUControl/smp.hpp"
 #include "CPUControl/time.hpp"
 #include "CPUControl/tss.hpp"
 #include "Common/Symbols.hpp"
 #include "Common/Units.hpp"
+#include "Debug/benchmark.hpp"
 #include "LanguageFeatures/memory.hpp"
+#include "Memory/addressSpace.hpp"
 #include "Memory/heap.hpp"
 #include "Memory/memory.hpp"
 #include "Memory/pageTable.hpp"
@@ -20,6 +24,8 @@
 alignas(4096) char firstKernelStack[4096 * 4]{};
 
 extern "C" void main(uint64_t multiboot) {
+    SMP::initCPU(0, 0);
+    FPU::initCPU();
     Output::init();
     Output::getDefault()->clear();
     Output::getDefault()->setCursor(0, 0);
@@ -27,11 +33,17 @@ extern "C" void main(uint64_t multiboot) {
     Interrupt::setupInterruptVectorTable();
     PageTable::init();
     readMultiboot(multiboot);
+    AddressSpace::init();
+    Output::initMemoryType();
     ACPI::init();
     Interrupt::enableInterrupts();
     APIC::initAllCPUs();
     PCI::init();
 
+#ifdef BENCHMARK
+    Benchmark::run();
+#endif
+
     const char* filename = "/fs0/a.out";
 
     int64_t fileSize = Filesystem::getSize(filename);